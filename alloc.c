@@ -0,0 +1,498 @@
+#include "alloc.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "cache.h"
+#include "journal.h"
+
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8)
+#define WORD_BITS 64
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+#define GROUPS_PER_BLOCK (BITS_PER_BLOCK / ALLOC_GROUP_BITS)
+
+// 一组不会跨越位图块
+_Static_assert(BITS_PER_BLOCK % ALLOC_GROUP_BITS == 0, "group spans bitmap blocks");
+_Static_assert(ALLOC_MAX_GROUPS <= 32 && GROUPS_PER_BLOCK < 32, "groups do not fit in uint32_t");
+
+// 位图块按 64 位的字访问
+typedef uint64_t __attribute__((may_alias)) word_t;
+
+static struct cache_buf* bitmap_block(struct alloc* a, uint32_t bit) {
+    return cache_get(a->bitmap_start + bit / BITS_PER_BLOCK);
+}
+
+static word_t* bitmap_word(struct cache_buf* buf, uint32_t bit) {
+    return (word_t*)buf->data + bit % BITS_PER_BLOCK / WORD_BITS;
+}
+
+// 第 bit 位及其之后（同一个字内）的掩码
+static uint64_t mask_from(uint32_t bit) {
+    return ~0ULL << (bit % WORD_BITS);
+}
+
+static uint32_t group_end(struct alloc* a, uint32_t group) {
+    return min(a->nbits, (group + 1) * ALLOC_GROUP_BITS);
+}
+
+// 第 bit 位所在的位图块中的组
+static uint32_t block_groups(struct alloc* a, uint32_t bit) {
+    uint32_t groups = (a->nbits + ALLOC_GROUP_BITS - 1) / ALLOC_GROUP_BITS;
+    uint32_t all = groups == 32 ? ~0u : (1u << groups) - 1;
+    return ((1u << GROUPS_PER_BLOCK) - 1) << (bit / BITS_PER_BLOCK * GROUPS_PER_BLOCK) & all;
+}
+
+// 载入 summary，其中有超过组大小的空闲数量时返回 false
+static bool load_summary(struct alloc* a, const struct alloc_summary* summary) {
+    uint32_t groups = (a->nbits + ALLOC_GROUP_BITS - 1) / ALLOC_GROUP_BITS, free = 0;
+    for (uint32_t g = 0; g < groups; ++g) {
+        if (summary->group_free[g] > group_end(a, g) - g * ALLOC_GROUP_BITS)
+            return false;
+        free += summary->group_free[g];
+    }
+    memcpy(a->group_free, summary->group_free, groups * sizeof(uint16_t));
+    a->free = free;
+    a->hint = summary->hint < a->nbits ? summary->hint : 0;
+    return true;
+}
+
+int alloc_init(struct alloc* a, int bitmap_start, uint32_t nbits, uint32_t* uninit, alloc_group_fn init_group,
+               const struct alloc_summary* summary) {
+    a->bitmap_start = bitmap_start;
+    a->nbits = nbits;
+    a->free = 0;
+    a->hint = 0;
+    a->uninit = uninit;
+    a->init_group = init_group;
+    pthread_mutex_init(&a->init_lock, NULL);
+    pthread_mutex_init(&a->window_lock, NULL);
+    a->nwindows = 0;
+    a->window_stamp = 0;
+    memset(a->windows, 0, sizeof(a->windows));
+    memset(a->group_free, 0, sizeof(a->group_free));
+    for (uint32_t i = 0; i < ALLOC_MAX_GROUPS; ++i)
+        pthread_mutex_init(&a->group_lock[i], NULL);
+    if (summary != NULL && load_summary(a, summary))
+        return 0;
+    for (uint32_t bit = 0; bit < nbits; bit += BITS_PER_BLOCK) {
+        uint32_t end = min(nbits, bit + BITS_PER_BLOCK);
+        // 位图块还不存在，其中的位都是空闲的
+        uint32_t groups = block_groups(a, bit);
+        if ((*uninit & groups) == groups) {
+            for (uint32_t b = bit; b < end; b += ALLOC_GROUP_BITS) {
+                uint32_t n = group_end(a, b / ALLOC_GROUP_BITS) - b;
+                a->group_free[b / ALLOC_GROUP_BITS] = n;
+                a->free += n;
+            }
+            continue;
+        }
+        struct cache_buf* buf = bitmap_block(a, bit);
+        if (buf == NULL)
+            return -EIO;
+        for (uint32_t b = bit; b < end; b += WORD_BITS) {
+            uint32_t zeros = WORD_BITS - __builtin_popcountll(*bitmap_word(buf, b));
+            a->group_free[b / ALLOC_GROUP_BITS] += zeros;
+            a->free += zeros;
+        }
+        cache_put(buf);
+    }
+    return 0;
+}
+
+void alloc_save(const struct alloc* a, struct alloc_summary* summary) {
+    memset(summary, 0, sizeof(*summary));
+    memcpy(summary->group_free, a->group_free, sizeof(a->group_free));
+    summary->hint = a->hint;
+}
+
+// 第一次使用第 group 组时初始化它，见 alloc.h，调用时持有该组的锁
+static int group_init(struct alloc* a, uint32_t group) {
+    uint32_t bit = 1u << group;
+    if (!(__atomic_load_n(a->uninit, __ATOMIC_ACQUIRE) & bit))
+        return 0;
+    pthread_mutex_lock(&a->init_lock);
+    int ret = 0;
+    uint32_t uninit = *a->uninit;
+    if (uninit & bit) {
+        // 位图块中还没有组用过，它在磁盘上还不存在，不能读，直接清零
+        uint32_t groups = block_groups(a, group * ALLOC_GROUP_BITS);
+        if ((uninit & groups) == groups) {
+            struct cache_buf* buf = cache_zero(a->bitmap_start + group * ALLOC_GROUP_BITS / BITS_PER_BLOCK);
+            if (buf == NULL) {
+                ret = -EIO;
+            } else {
+                journal_dirty(buf);
+                cache_put(buf);
+            }
+        }
+        if (ret == 0) {
+            __atomic_and_fetch(a->uninit, ~bit, __ATOMIC_RELEASE);
+            if (a->init_group != NULL && (ret = a->init_group(group)))
+                __atomic_or_fetch(a->uninit, bit, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&a->init_lock);
+    return ret;
+}
+
+// 找到 [from, to) 中第一个空闲位，调用时持有该组的锁
+static int find_free(struct cache_buf* buf, uint32_t from, uint32_t to, uint32_t* index) {
+    for (; from < to; from = (from / WORD_BITS + 1) * WORD_BITS) {
+        uint64_t zeros = ~*bitmap_word(buf, from) & mask_from(from);
+        if (zeros == 0)
+            continue;
+        uint32_t bit = from / WORD_BITS * WORD_BITS + __builtin_ctzll(zeros);
+        if (bit >= to)
+            break;
+        *index = bit;
+        return 0;
+    }
+    return -ENOSPC;
+}
+
+// 从空闲位 start 开始，数出 [start, end) 中连续的空闲位，调用时持有该组的锁
+static uint32_t run_length(struct cache_buf* buf, uint32_t start, uint32_t end) {
+    uint32_t bit = start;
+    while (bit < end) {
+        uint64_t used = *bitmap_word(buf, bit) & mask_from(bit);
+        if (used != 0) {
+            bit = bit / WORD_BITS * WORD_BITS + __builtin_ctzll(used);
+            break;
+        }
+        bit = (bit / WORD_BITS + 1) * WORD_BITS;
+    }
+    return min(bit, end) - start;
+}
+
+// 把同一组中的 [start, start + len) 设为 value，同时维护空闲计数，调用时持有该组的锁
+static void set_bits(struct alloc* a, struct cache_buf* buf, uint32_t start, uint32_t len, bool value) {
+    uint32_t bit = start, end = start + len;
+    int changed = 0;
+    while (bit < end) {
+        uint32_t word_end = min(end, (bit / WORD_BITS + 1) * WORD_BITS);
+        uint64_t mask = mask_from(bit);
+        if (word_end % WORD_BITS)
+            mask &= ~mask_from(word_end);
+        word_t* word = bitmap_word(buf, bit);
+        changed += __builtin_popcountll(value ? mask & ~*word : mask & *word);
+        if (value)
+            *word |= mask;
+        else
+            *word &= ~mask;
+        bit = word_end;
+    }
+    uint32_t group = start / ALLOC_GROUP_BITS;
+    if (value) {
+        __atomic_sub_fetch(&a->group_free[group], changed, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&a->free, changed, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&a->group_free[group], changed, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&a->free, changed, __ATOMIC_RELAXED);
+    }
+    journal_dirty(buf);
+}
+
+// 第 bit 位在别人的窗口中时返回窗口的末尾，否则返回 0，并把 *limit 缩小到 bit 之后第一个别人的窗口的开头
+//
+// 窗口只在持有所在组的锁时建立，调用时持有 bit 所在组的锁，所以检查的结果在放锁之前一直有效
+static uint32_t window_skip(struct alloc* a, uint32_t owner, uint32_t bit, uint32_t* limit) {
+    if (__atomic_load_n(&a->nwindows, __ATOMIC_RELAXED) == 0)
+        return 0;
+    uint32_t skip = 0;
+    pthread_mutex_lock(&a->window_lock);
+    for (int i = 0; i < ALLOC_WINDOWS; ++i) {
+        struct alloc_window* w = &a->windows[i];
+        if (w->start == w->end || w->owner == owner)
+            continue;
+        if (bit >= w->start && bit < w->end)
+            skip = w->end;
+        else if (w->start > bit)
+            *limit = min(*limit, w->start);
+    }
+    pthread_mutex_unlock(&a->window_lock);
+    return skip;
+}
+
+// 丢掉 owner 的窗口，owner 为 ALLOC_NO_OWNER 时丢掉所有窗口，调用时持有 window_lock
+static void window_drop(struct alloc* a, uint32_t owner) {
+    uint32_t dropped = 0;
+    for (int i = 0; i < ALLOC_WINDOWS; ++i) {
+        struct alloc_window* w = &a->windows[i];
+        if (w->start != w->end && (owner == ALLOC_NO_OWNER || w->owner == owner)) {
+            w->start = w->end = 0;
+            dropped++;
+        }
+    }
+    __atomic_sub_fetch(&a->nwindows, dropped, __ATOMIC_RELAXED);
+}
+
+// 为 owner 预留 [start, end)，替换它原来的窗口，窗口都在用时替换最久没用的那个
+static void window_set(struct alloc* a, uint32_t owner, uint32_t start, uint32_t end) {
+    pthread_mutex_lock(&a->window_lock);
+    window_drop(a, owner);
+    if (start < end) {
+        struct alloc_window* slot = &a->windows[0];
+        for (int i = 0; i < ALLOC_WINDOWS && slot->start != slot->end; ++i) {
+            struct alloc_window* w = &a->windows[i];
+            if (w->start == w->end || (int32_t)(w->stamp - slot->stamp) < 0)
+                slot = w;
+        }
+        if (slot->start == slot->end)
+            __atomic_add_fetch(&a->nwindows, 1, __ATOMIC_RELAXED);
+        *slot = (struct alloc_window){.owner = owner, .start = start, .end = end, .stamp = ++a->window_stamp};
+    }
+    pthread_mutex_unlock(&a->window_lock);
+}
+
+// 在 [from, end) 中找分配的起点，跳过别人的窗口，*limit 返回起点之后第一个别人的窗口的开头（没有时为 end）
+//
+// need 大于 0 时（owner 另起一段），起点不是 from 的话还要求从它开始有 need 个连续的空闲位，
+// 新的一段和之后的窗口能放在一起，而不是塞进别的文件之间的小空隙；没有这样的空隙时用第一个空闲位。
+// 调用时持有该组的锁
+static int find_start(struct alloc* a, struct cache_buf* buf, uint32_t from, uint32_t end, uint32_t owner,
+                      uint32_t need, uint32_t* start, uint32_t* limit) {
+    uint32_t goal = from, first = end, first_limit = end;
+    for (;;) {
+        *limit = end;
+        if (find_free(buf, from, end, start))
+            break;
+        uint32_t skip = window_skip(a, owner, *start, limit);
+        if (skip) {
+            from = skip;
+            continue;
+        }
+        if (need == 0 || *start == goal)
+            return 0;
+        uint32_t run = run_length(buf, *start, min((uint64_t)*start + need, *limit));
+        if (run == need)
+            return 0;
+        if (first == end) {
+            first = *start;
+            first_limit = *limit;
+        }
+        from = *start + run;
+    }
+    if (first == end)
+        return -ENOSPC;
+    *start = first;
+    *limit = first_limit;
+    return 0;
+}
+
+// 在第 group 组的 [from, 组末尾) 中分配，该组没有空闲位时返回 -ENOSPC
+//
+// 跳过别人的窗口；window 大于 0 时在分配到的位之后为 owner 预留窗口，否则只丢掉它原来的窗口
+static int alloc_in_group(struct alloc* a, uint32_t group, uint32_t from, uint32_t want, uint32_t owner,
+                          uint32_t window, uint32_t* start, uint32_t* got) {
+    if (__atomic_load_n(&a->group_free[group], __ATOMIC_RELAXED) == 0)
+        return -ENOSPC;
+    uint32_t end = group_end(a, group);
+    pthread_mutex_lock(&a->group_lock[group]);
+    int ret = -ENOSPC;
+    if (a->group_free[group] > 0 && (ret = group_init(a, group)) == 0) {
+        struct cache_buf* buf = bitmap_block(a, from);
+        if (buf == NULL) {
+            ret = -EIO;
+        } else {
+            uint32_t limit, need = owner != ALLOC_NO_OWNER && window > 0 ? min(want, ALLOC_WINDOW_MAX) + window : 0;
+            if ((ret = find_start(a, buf, from, end, owner, need, start, &limit)) == 0) {
+                *got = run_length(buf, *start, min((uint64_t)*start + want, limit));
+                set_bits(a, buf, *start, *got, true);
+            }
+            if (ret == 0 && owner != ALLOC_NO_OWNER) {
+                uint32_t next = *start + *got, run = 0;
+                limit = min(end, (uint64_t)next + window);
+                if (next < limit && window_skip(a, owner, next, &limit) == 0)
+                    run = run_length(buf, next, limit);
+                window_set(a, owner, next, next + run);
+            }
+            cache_put(buf);
+        }
+    }
+    pthread_mutex_unlock(&a->group_lock[group]);
+    return ret;
+}
+
+// 从 goal 所在的组往后找，绕一圈后再从头找一遍 goal 所在的组
+static int alloc_scan(struct alloc* a, uint32_t owner, uint32_t window, uint32_t goal, uint32_t want, uint32_t* start,
+                      uint32_t* got) {
+    uint32_t groups = (a->nbits + ALLOC_GROUP_BITS - 1) / ALLOC_GROUP_BITS;
+    uint32_t group = goal / ALLOC_GROUP_BITS;
+    int ret = -ENOSPC;
+    for (uint32_t n = 0; n <= groups && ret == -ENOSPC; ++n, group = (group + 1) % groups)
+        ret = alloc_in_group(a, group, n == 0 ? goal : group * ALLOC_GROUP_BITS, want, owner, window, start, got);
+    return ret;
+}
+
+int alloc_range_owned(struct alloc* a, uint32_t owner, uint32_t window, uint32_t goal, uint32_t want, uint32_t* start,
+                      uint32_t* got) {
+    if (__atomic_load_n(&a->free, __ATOMIC_RELAXED) == 0)
+        return -ENOSPC;
+    if (goal == 0 || goal >= a->nbits)
+        goal = __atomic_load_n(&a->hint, __ATOMIC_RELAXED);
+    window = min(window, ALLOC_WINDOW_MAX);
+    int ret = alloc_scan(a, owner, window, goal, want, start, got);
+    // 剩下的空闲位都在别人的窗口中
+    if (ret == -ENOSPC && __atomic_load_n(&a->nwindows, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&a->window_lock);
+        window_drop(a, ALLOC_NO_OWNER);
+        pthread_mutex_unlock(&a->window_lock);
+        ret = alloc_scan(a, owner, window, goal, want, start, got);
+    }
+    if (ret)
+        return ret;
+    uint32_t next = *start + *got;
+    __atomic_store_n(&a->hint, next < a->nbits ? next : 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int alloc_range(struct alloc* a, uint32_t goal, uint32_t want, uint32_t* start, uint32_t* got) {
+    return alloc_range_owned(a, ALLOC_NO_OWNER, 0, goal, want, start, got);
+}
+
+void alloc_release(struct alloc* a, uint32_t owner) {
+    if (__atomic_load_n(&a->nwindows, __ATOMIC_RELAXED) == 0)
+        return;
+    pthread_mutex_lock(&a->window_lock);
+    window_drop(a, owner);
+    pthread_mutex_unlock(&a->window_lock);
+}
+
+// 在第 group 组的 [from, to) 中找 want 个连续的空闲位并分配，跳过所有窗口
+static int exact_in_group(struct alloc* a, uint32_t group, uint32_t from, uint32_t to, uint32_t want,
+                          uint32_t* start) {
+    if (__atomic_load_n(&a->group_free[group], __ATOMIC_RELAXED) < want)
+        return -ENOSPC;
+    pthread_mutex_lock(&a->group_lock[group]);
+    int ret = -ENOSPC;
+    if (a->group_free[group] >= want && (ret = group_init(a, group)) == 0) {
+        struct cache_buf* buf = bitmap_block(a, from);
+        ret = buf == NULL ? -EIO : -ENOSPC;
+        while (buf != NULL && from < to && find_free(buf, from, to, start) == 0) {
+            uint32_t limit = to, skip = window_skip(a, ALLOC_NO_OWNER, *start, &limit);
+            if (skip) {
+                from = skip;
+                continue;
+            }
+            uint32_t run = run_length(buf, *start, min((uint64_t)*start + want, limit));
+            if (run == want) {
+                set_bits(a, buf, *start, want, true);
+                ret = 0;
+                break;
+            }
+            from = *start + run;
+        }
+        if (buf != NULL)
+            cache_put(buf);
+    }
+    pthread_mutex_unlock(&a->group_lock[group]);
+    return ret;
+}
+
+int alloc_exact(struct alloc* a, uint32_t from, uint32_t to, uint32_t want, uint32_t* start) {
+    if (want == 0 || want > ALLOC_GROUP_BITS)
+        return -ENOSPC;
+    to = min(to, a->nbits);
+    int ret = -ENOSPC;
+    for (uint32_t bit = from; bit < to && ret == -ENOSPC; bit = group_end(a, bit / ALLOC_GROUP_BITS))
+        ret = exact_in_group(a, bit / ALLOC_GROUP_BITS, bit, min(to, group_end(a, bit / ALLOC_GROUP_BITS)), want,
+                             start);
+    return ret;
+}
+
+int alloc_next(struct alloc* a, uint32_t from, uint32_t* bit) {
+    for (uint32_t b = from; b < a->nbits;) {
+        uint32_t group = b / ALLOC_GROUP_BITS, end = group_end(a, group);
+        // 没有用过的组中没有已用的位
+        if (__atomic_load_n(a->uninit, __ATOMIC_ACQUIRE) & (1u << group)) {
+            b = end;
+            continue;
+        }
+        pthread_mutex_lock(&a->group_lock[group]);
+        struct cache_buf* buf = bitmap_block(a, b);
+        int ret = buf == NULL ? -EIO : -ENOENT;
+        for (; buf != NULL && b < end; b = (b / WORD_BITS + 1) * WORD_BITS) {
+            uint64_t used = *bitmap_word(buf, b) & mask_from(b);
+            if (used != 0) {
+                *bit = b / WORD_BITS * WORD_BITS + __builtin_ctzll(used);
+                ret = 0;
+                break;
+            }
+        }
+        if (buf != NULL)
+            cache_put(buf);
+        pthread_mutex_unlock(&a->group_lock[group]);
+        if (ret != -ENOENT)
+            return ret;
+    }
+    return -ENOENT;
+}
+
+// 一段长为 run 的空闲位结束了
+static void free_run_end(uint32_t* run, uint32_t* runs, uint32_t* largest) {
+    if (*run == 0)
+        return;
+    (*runs)++;
+    *largest = *run > *largest ? *run : *largest;
+    *run = 0;
+}
+
+int alloc_free_runs(struct alloc* a, uint32_t* runs, uint32_t* largest) {
+    uint32_t groups = (a->nbits + ALLOC_GROUP_BITS - 1) / ALLOC_GROUP_BITS, run = 0;
+    *runs = *largest = 0;
+    for (uint32_t group = 0; group < groups; ++group) {
+        uint32_t start = group * ALLOC_GROUP_BITS, end = group_end(a, group);
+        // 没有用过的组整个都是空闲的，和前后的空闲位连成一段
+        if (__atomic_load_n(a->uninit, __ATOMIC_ACQUIRE) & (1u << group)) {
+            run += end - start;
+            continue;
+        }
+        pthread_mutex_lock(&a->group_lock[group]);
+        struct cache_buf* buf = bitmap_block(a, start);
+        for (uint32_t b = start; buf != NULL && b < end; ++b) {
+            if (*bitmap_word(buf, b) >> (b % WORD_BITS) & 1)
+                free_run_end(&run, runs, largest);
+            else
+                run++;
+        }
+        if (buf != NULL)
+            cache_put(buf);
+        pthread_mutex_unlock(&a->group_lock[group]);
+        if (buf == NULL)
+            return -EIO;
+    }
+    free_run_end(&run, runs, largest);
+    return 0;
+}
+
+// 把 [start, start + len) 设为 value，按组分段加锁
+static int set_range(struct alloc* a, uint32_t start, uint32_t len, bool value) {
+    uint32_t bit = start, end = start + len;
+    while (bit < end) {
+        uint32_t group = bit / ALLOC_GROUP_BITS;
+        uint32_t n = min(end, group_end(a, group)) - bit;
+        pthread_mutex_lock(&a->group_lock[group]);
+        int ret = group_init(a, group);
+        struct cache_buf* buf = ret == 0 ? bitmap_block(a, bit) : NULL;
+        if (buf != NULL) {
+            set_bits(a, buf, bit, n, value);
+            cache_put(buf);
+        }
+        pthread_mutex_unlock(&a->group_lock[group]);
+        if (buf == NULL)
+            return ret ? ret : -EIO;
+        bit += n;
+    }
+    return 0;
+}
+
+int alloc_free(struct alloc* a, uint32_t start, uint32_t len) {
+    return set_range(a, start, len, false);
+}
+
+int alloc_mark(struct alloc* a, uint32_t start, uint32_t len) {
+    return set_range(a, start, len, true);
+}
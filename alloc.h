@@ -0,0 +1,109 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "disk.h"
+
+// 基于位图的分配器，inode 和数据块各用一个
+//
+// 位图本身存放在磁盘上（通过块缓存访问），每次按 64 位的字扫描，用 ctz/popcount 找空闲位；
+// 另外在内存中按组（ALLOC_GROUP_BITS 位一组）记录每组的空闲数量，扫描时整组跳过已满的组，
+// 并记录上一次分配结束的位置（next-fit），没有指定目标位置时从那里继续找
+//
+// 多线程：每组有自己的锁，一次分配只在一个组内进行，所以不同的线程在不同的组里分配时互不影响；
+// 空闲数量和 hint 用原子操作读写，扫描时不加锁先看空闲数量，跳过已满的组
+//
+// 位图中第 i 位位于第 i / 8 个字节的第 i % 8 位，按小端序读成 64 位的字时恰好是第 i % 64 位
+//
+// 延迟初始化（类似 ext4 的 uninit_bg）：*uninit 的第 g 位表示第 g 组从格式化以来没有用过，
+// 这样的组的所有位都是空闲的，不需要读位图；一个位图块中的组都没有用过时，这个位图块在磁盘上还不存在，
+// 挂载时既不读它，格式化时也不写它。第一次在一组中分配或者标记时才初始化这一组：
+// 位图块还不存在时先在缓存中清零它，再调用 init_group，之后清掉 *uninit 中的位
+//
+// 预留窗口（类似 ext3 的 reservation window）：几个文件交替追加时，如果都从上一次分配结束的位置找，
+// 它们的块会互相穿插。alloc_range_owned 在分配到的位之后为调用者（owner，比如 inode 号）预留一段空闲位，
+// 别的分配跳过这段，owner 下一次从这里接着分配时仍然是连续的。窗口只记在内存中，位图和空闲数量都不变，
+// 崩溃后也不需要恢复；窗口之外没有空闲位时丢掉所有窗口再找一遍，所以不会因为预留而返回 -ENOSPC
+#define ALLOC_GROUP_BITS 2048
+#define ALLOC_MAX_GROUPS (BLOCK_NUM / ALLOC_GROUP_BITS)
+#define ALLOC_WINDOWS 16  // 同时预留的窗口数，满了替换最久没用的
+#define ALLOC_WINDOW_MAX (ALLOC_GROUP_BITS / 4)  // 一个窗口至多预留的位数
+
+// 不预留窗口的分配
+#define ALLOC_NO_OWNER UINT32_MAX
+
+// 初始化第 group 组时调用，调用时这一组已经标记为用过（*uninit 中的位已经清掉），失败时会恢复
+typedef int (*alloc_group_fn)(uint32_t group);
+
+// 正常卸载时存进超级块的分配器状态，下次挂载时直接载入，不用扫描位图
+struct alloc_summary {
+    uint32_t hint;
+    uint16_t group_free[ALLOC_MAX_GROUPS];
+};
+
+// [start, end) 为 owner 预留，start == end 表示空闲
+struct alloc_window {
+    uint32_t owner;
+    uint32_t start;
+    uint32_t end;
+    uint32_t stamp;  // 最近一次预留的时间
+};
+
+struct alloc {
+    int bitmap_start;  // 位图的起始块号
+    uint32_t nbits;
+    uint32_t free;  // 空闲位的总数，fs_statfs 直接读这个值
+    uint32_t hint;  // 下一次没有目标位置时从这里开始找
+    uint32_t* uninit;  // 没有用过的组，存放在超级块中，用原子操作读写
+    alloc_group_fn init_group;
+    pthread_mutex_t init_lock;  // 初始化组时持有，同一个位图块只清零一次
+    uint16_t group_free[ALLOC_MAX_GROUPS];
+    pthread_mutex_t group_lock[ALLOC_MAX_GROUPS];
+    pthread_mutex_t window_lock;  // 保护下面的字段，可以在持有组的锁时获取
+    uint32_t nwindows;  // 在用的窗口数，为 0 时分配不需要检查窗口
+    uint32_t window_stamp;
+    struct alloc_window windows[ALLOC_WINDOWS];
+};
+
+// 载入 summary 中的空闲数量和 hint；summary 为 NULL 或者内容不合理时，
+// 读取磁盘上的位图（没有用过的组跳过），统计每组的空闲数量
+int alloc_init(struct alloc* a, int bitmap_start, uint32_t nbits, uint32_t* uninit, alloc_group_fn init_group,
+               const struct alloc_summary* summary);
+
+// 把现在的空闲数量和 hint 存进 summary，调用时不能有分配和释放在进行
+void alloc_save(const struct alloc* a, struct alloc_summary* summary);
+
+// 分配至多 want 个连续的位，从 goal 开始往后找第一个空闲位并尽量向后延伸，goal 为 0 时从 hint 开始
+//
+// 实际分配的数量通过 *got 返回（至少为 1，不会跨组），没有空闲位时返回 -ENOSPC
+int alloc_range(struct alloc* a, uint32_t goal, uint32_t want, uint32_t* start, uint32_t* got);
+
+// 和 alloc_range 一样，但可以使用 owner 自己的窗口，成功后在分配到的位之后为 owner 重新预留
+// 至多 window 个空闲位（不跨组，也不超过 ALLOC_WINDOW_MAX），window 为 0 时只丢掉原来的窗口。
+// 不能接着 goal 分配时，优先找一段放得下这次分配和整个窗口的空隙
+int alloc_range_owned(struct alloc* a, uint32_t owner, uint32_t window, uint32_t goal, uint32_t want, uint32_t* start,
+                      uint32_t* got);
+
+// 丢掉 owner 的窗口，用于文件被截短或删除时
+void alloc_release(struct alloc* a, uint32_t owner);
+
+// 在 [from, to) 中找第一段至少 want 个连续的空闲位（跳过所有窗口），分配其中开头的 want 位。
+// 和 alloc_range 不同，找不到这么长的一段时返回 -ENOSPC，不会只分配一部分；一段不跨组，
+// 所以 want 不能超过 ALLOC_GROUP_BITS。用于碎片整理，见 defrag.h
+int alloc_exact(struct alloc* a, uint32_t from, uint32_t to, uint32_t want, uint32_t* start);
+
+// 找到 from 之后（包括 from）第一个已用的位，没有时返回 -ENOENT
+int alloc_next(struct alloc* a, uint32_t from, uint32_t* bit);
+
+// 统计空闲位组成的连续段：段数通过 *runs 返回，最长的一段的长度通过 *largest 返回
+int alloc_free_runs(struct alloc* a, uint32_t* runs, uint32_t* largest);
+
+// 释放 [start, start + len)
+int alloc_free(struct alloc* a, uint32_t start, uint32_t len);
+
+// 把 [start, start + len) 标记为已用，用于格式化时占住元数据区域
+int alloc_mark(struct alloc* a, uint32_t start, uint32_t len);
+
+#endif
@@ -0,0 +1,98 @@
+#include "attrcache.h"
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define SHARD_SIZE (ATTRCACHE_SIZE / ATTRCACHE_SHARDS)
+
+// 空闲项的 inode 号
+#define FREE_INO UINT32_MAX
+
+struct attr_entry {
+    uint32_t ino;  // FREE_INO 表示空闲
+    uint32_t stamp;  // 最近一次使用的时间，满了替换最小的
+    struct inode_attr attr;
+};
+
+struct attrcache_shard {
+    pthread_mutex_t lock;
+    uint32_t clock;
+    struct attr_entry entries[SHARD_SIZE];
+};
+
+static struct attrcache_shard shards[ATTRCACHE_SHARDS];
+
+// 连续的 inode 号落在不同的分片中，同一个目录下的文件通常是连续分配的
+static struct attrcache_shard* shard_of(uint32_t ino) {
+    return &shards[ino % ATTRCACHE_SHARDS];
+}
+
+// 一个分片只有几项，直接逐项比较
+static struct attr_entry* find(struct attrcache_shard* shard, uint32_t ino) {
+    for (int i = 0; i < SHARD_SIZE; ++i)
+        if (shard->entries[i].ino == ino)
+            return &shard->entries[i];
+    return NULL;
+}
+
+void attrcache_init(void) {
+    for (int s = 0; s < ATTRCACHE_SHARDS; ++s) {
+        struct attrcache_shard* shard = &shards[s];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->clock = 0;
+        for (int i = 0; i < SHARD_SIZE; ++i) {
+            shard->entries[i].ino = FREE_INO;
+            shard->entries[i].stamp = 0;
+        }
+    }
+}
+
+bool attrcache_lookup(uint32_t ino, struct inode_attr* attr) {
+    struct attrcache_shard* shard = shard_of(ino);
+    pthread_mutex_lock(&shard->lock);
+    struct attr_entry* e = find(shard, ino);
+    if (e != NULL) {
+        e->stamp = ++shard->clock;
+        *attr = e->attr;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return e != NULL;
+}
+
+void attrcache_insert(uint32_t ino, const struct inode_attr* attr) {
+    struct attrcache_shard* shard = shard_of(ino);
+    pthread_mutex_lock(&shard->lock);
+    struct attr_entry* e = find(shard, ino);
+    if (e == NULL) {
+        // 复用空闲的或者最久未使用的一项，空闲项的 stamp 为 0
+        e = &shard->entries[0];
+        for (int i = 1; i < SHARD_SIZE; ++i)
+            if (shard->entries[i].stamp < e->stamp)
+                e = &shard->entries[i];
+        e->ino = ino;
+    }
+    e->attr = *attr;
+    e->stamp = ++shard->clock;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void attrcache_set_atime(uint32_t ino, int64_t atime) {
+    struct attrcache_shard* shard = shard_of(ino);
+    pthread_mutex_lock(&shard->lock);
+    struct attr_entry* e = find(shard, ino);
+    if (e != NULL)
+        e->attr.atime = atime;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void attrcache_remove(uint32_t ino) {
+    struct attrcache_shard* shard = shard_of(ino);
+    pthread_mutex_lock(&shard->lock);
+    struct attr_entry* e = find(shard, ino);
+    if (e != NULL) {
+        // 优先被复用
+        e->ino = FREE_INO;
+        e->stamp = 0;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
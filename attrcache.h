@@ -0,0 +1,48 @@
+#ifndef ATTRCACHE_H
+#define ATTRCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// 属性缓存，缓存 inode 号 -> getattr 需要的属性
+//
+// `ls -l` 先 readdir 一次，再对每一项 getattr 一次。readdir 本来就要遍历目录项，
+// 它顺便读出每一项的属性交给 filler，同时放进这里（和目录项缓存），
+// 紧接着的 getattr 解析路径和取属性就都命中内存，不需要再读目录块和 inode 表
+//
+// 缓存是 inode 的一个副本，inode_write 总是同时更新它，所以不会读到旧的属性；
+// 只有 atime 例外：持有读锁的读者可能同时填入和更新 atime，见 inode_set_atime
+//
+// 容量受运行时内存限制（整个文件系统的静态数据加上栈不能超过 128KB，见 Makefile 中的检查），
+// 只保留最近的 ATTRCACHE_SIZE 项，正好是一个线性目录块的目录项数：这样的小目录 `ls -l` 全部命中；
+// 目录项可能比这多时 readdir 不预读属性（见 do_readdir），否则后面读入的属性会把前面的挤掉，白白多读 inode 表
+//
+// 多线程：和目录项缓存一样按 inode 号分片，每个分片有自己的锁。一个分片只有几项，
+// 查找时逐项比较，满了替换最久没用的一项，不需要哈希表和 LRU 链表
+#define ATTRCACHE_SIZE 128
+#define ATTRCACHE_SHARDS 8
+
+struct inode_attr {
+    uint16_t mode;
+    uint32_t blocks;
+    uint64_t size;
+    int64_t atime;
+    int64_t mtime;
+    int64_t ctime;
+};
+
+void attrcache_init(void);
+
+// 查找 ino 的属性，命中时返回 true
+bool attrcache_lookup(uint32_t ino, struct inode_attr* attr);
+
+// 加入或更新 ino 的属性，调用时需持有 ino 的锁（读锁或写锁）
+void attrcache_insert(uint32_t ino, const struct inode_attr* attr);
+
+// ino 在缓存中时更新它的 atime
+void attrcache_set_atime(uint32_t ino, int64_t atime);
+
+// 删除 ino 的属性（如果有），用于 inode 被释放时
+void attrcache_remove(uint32_t ino);
+
+#endif
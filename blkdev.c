@@ -0,0 +1,261 @@
+#include "blkdev.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "options.h"
+#include "stats.h"
+
+#define IMAGE_NAME "/image"
+#define PATH_SIZE 256
+
+static enum blkdev_backend backend;
+static int image_fd = -1;
+
+// 一批请求还有多少没有完成
+struct io_batch {
+    int pending;
+};
+
+struct io_entry {
+    struct blkdev_req* req;
+    struct io_batch* batch;
+};
+
+// 提交队列（环形）和 I/O 线程
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;  // 队列中有请求
+    pthread_cond_t completed;  // 有一批请求完成
+    struct io_entry queue[BLKDEV_QUEUE];
+    uint32_t head;  // 下一个要处理的请求
+    uint32_t count;
+    bool running;
+    uint32_t nworkers;
+    pthread_t workers[BLKDEV_WORKERS_MAX];
+} io = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .nonempty = PTHREAD_COND_INITIALIZER,
+    .completed = PTHREAD_COND_INITIALIZER,
+};
+
+// 和 disk_mount 一样，从文件 `fuse~` 中读出虚拟磁盘目录，拼上镜像文件名
+static int image_path(char path[PATH_SIZE]) {
+    FILE* fp = fopen("fuse~", "r");
+    if (fp == NULL)
+        return 1;
+    char dir[PATH_SIZE];
+    int ok = fscanf(fp, "%255s", dir) == 1;
+    fclose(fp);
+    if (!ok || strlen(dir) + strlen(IMAGE_NAME) >= PATH_SIZE) {
+        fs_error("blkdev: read disk prefix failed\n");
+        return 1;
+    }
+    strcpy(path, dir);
+    strcat(path, IMAGE_NAME);
+    return 0;
+}
+
+static int image_mount(int init_flag) {
+    char path[PATH_SIZE];
+    if (image_path(path))
+        return 1;
+    image_fd = open(path, O_RDWR | (init_flag ? O_CREAT : 0), 0644);
+    if (image_fd < 0) {
+        fs_error("blkdev: open %s failed: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (init_flag) {
+        // 先截断为 0 再扩展，整个镜像都是空洞，读出来全是 0，不占宿主机的空间
+        if (ftruncate(image_fd, 0) || ftruncate(image_fd, DISK_SIZE)) {
+            fs_error("blkdev: truncate %s failed: %s\n", path, strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+    struct stat st;
+    if (fstat(image_fd, &st) || st.st_size != DISK_SIZE) {
+        fs_error("blkdev: %s is not a disk image\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+int blkdev_mount(int init_flag) {
+    backend = options_backend();
+    if (backend == BLKDEV_IMAGE)
+        return image_mount(init_flag);
+    // disk_mount(1) 会创建并清零全部 65536 个块文件，这里只让它读出虚拟磁盘目录，见 blkdev.h
+    return disk_mount(0);
+}
+
+// 读写时不计入统计：I/O 线程不在任何回调中，统计由提交者记下，见 blkdev_submit
+static int image_read(int block_id, void* buffer) {
+    if (block_id >= BLOCK_NUM || block_id < 0)
+        return 1;
+    size_t done = 0;
+    while (done < BLOCK_SIZE) {
+        ssize_t n = pread(image_fd, (char*)buffer + done, BLOCK_SIZE - done, (off_t)block_id * BLOCK_SIZE + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fs_error("blkdev: read block %d failed\n", block_id);
+            return 1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int image_write(int block_id, void* buffer) {
+    if (block_id >= BLOCK_NUM || block_id < 0)
+        return 1;
+    size_t done = 0;
+    while (done < BLOCK_SIZE) {
+        ssize_t n = pwrite(image_fd, (char*)buffer + done, BLOCK_SIZE - done, (off_t)block_id * BLOCK_SIZE + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fs_error("blkdev: write block %d failed\n", block_id);
+            return 1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// 完成一个请求，结果记在 req->ret 中
+static int execute(struct blkdev_req* req) {
+    if (req->op == BLKDEV_READ)
+        req->ret = backend == BLKDEV_FILES ? disk_read(req->block_id, req->buffer) : image_read(req->block_id, req->buffer);
+    else
+        req->ret = backend == BLKDEV_FILES ? disk_write(req->block_id, req->buffer) : image_write(req->block_id, req->buffer);
+    return req->ret;
+}
+
+int blkdev_read(int block_id, void* buffer) {
+    stats_block_read();
+    struct blkdev_req req = {BLKDEV_READ, block_id, buffer, 0};
+    return execute(&req);
+}
+
+int blkdev_write(int block_id, void* buffer) {
+    stats_block_write();
+    struct blkdev_req req = {BLKDEV_WRITE, block_id, buffer, 0};
+    return execute(&req);
+}
+
+int blkdev_sync(void) {
+    // disk.c 每次写完就关闭文件，没有可以同步的句柄，和原来一样只保证写入了宿主机的页缓存
+    if (backend == BLKDEV_FILES)
+        return 0;
+    if (fdatasync(image_fd)) {
+        fs_error("blkdev: fdatasync failed: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+int blkdev_zero(int block_id, int n) {
+    static const uint8_t zero[BLOCK_SIZE];
+    struct blkdev_req reqs[BLKDEV_QUEUE];
+    for (int done = 0; done < n;) {
+        int batch = n - done < BLKDEV_QUEUE ? n - done : BLKDEV_QUEUE;
+        for (int i = 0; i < batch; ++i)
+            reqs[i] = (struct blkdev_req){BLKDEV_WRITE, block_id + done + i, (void*)zero, 0};
+        if (blkdev_submit(reqs, batch))
+            return 1;
+        done += batch;
+    }
+    return 0;
+}
+
+static void* worker_main(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&io.lock);
+    for (;;) {
+        while (io.running && io.count == 0)
+            pthread_cond_wait(&io.nonempty, &io.lock);
+        // 停止时先把队列中的请求做完，提交者还在等它们
+        if (io.count == 0)
+            break;
+        struct io_entry entry = io.queue[io.head];
+        io.head = (io.head + 1) % BLKDEV_QUEUE;
+        io.count--;
+        pthread_mutex_unlock(&io.lock);
+        execute(entry.req);
+        pthread_mutex_lock(&io.lock);
+        if (--entry.batch->pending == 0)
+            pthread_cond_broadcast(&io.completed);
+    }
+    pthread_mutex_unlock(&io.lock);
+    return NULL;
+}
+
+int blkdev_start(uint32_t workers) {
+    io.head = 0;
+    io.count = 0;
+    // 没有 I/O 线程时不要往队列里放请求
+    io.running = workers > 0;
+    for (io.nworkers = 0; io.nworkers < workers; io.nworkers++) {
+        int ret = pthread_create(&io.workers[io.nworkers], NULL, worker_main, NULL);
+        if (ret) {
+            fs_error("blkdev: cannot start worker: %d\n", ret);
+            blkdev_stop();
+            return -ret;
+        }
+    }
+    return 0;
+}
+
+void blkdev_stop(void) {
+    pthread_mutex_lock(&io.lock);
+    io.running = false;
+    pthread_cond_broadcast(&io.nonempty);
+    pthread_mutex_unlock(&io.lock);
+    for (uint32_t i = 0; i < io.nworkers; ++i)
+        pthread_join(io.workers[i], NULL);
+    io.nworkers = 0;
+}
+
+int blkdev_submit(struct blkdev_req* reqs, int n) {
+    for (int i = 0; i < n; ++i) {
+        if (reqs[i].op == BLKDEV_READ)
+            stats_block_read();
+        else
+            stats_block_write();
+    }
+    // 第 0 个请求由提交者自己完成，其余的能放进队列的交给 I/O 线程
+    struct io_batch batch = {0};
+    int queued = 1;
+    pthread_mutex_lock(&io.lock);
+    for (; io.running && queued < n && io.count < BLKDEV_QUEUE; ++queued) {
+        io.queue[(io.head + io.count) % BLKDEV_QUEUE] = (struct io_entry){&reqs[queued], &batch};
+        io.count++;
+        batch.pending++;
+    }
+    if (batch.pending > 0)
+        pthread_cond_broadcast(&io.nonempty);
+    pthread_mutex_unlock(&io.lock);
+
+    if (n > 0)
+        execute(&reqs[0]);
+    for (int i = queued; i < n; ++i)
+        execute(&reqs[i]);
+    pthread_mutex_lock(&io.lock);
+    while (batch.pending > 0)
+        pthread_cond_wait(&io.completed, &io.lock);
+    pthread_mutex_unlock(&io.lock);
+
+    int failed = 0;
+    for (int i = 0; i < n; ++i)
+        failed += reqs[i].ret != 0;
+    return failed;
+}
@@ -0,0 +1,70 @@
+#ifndef BLKDEV_H
+#define BLKDEV_H
+
+#include <stdint.h>
+
+#include "disk.h"
+
+// 块设备后端，位于块缓存、日志和 disk.c 之间
+//
+// disk.c 把磁盘模拟成虚拟磁盘目录下的 65536 个文件，每次读写都要打开一个文件，
+// 初始化时要逐个创建这些文件。这里提供同样的按块读写接口，挂载时用环境变量 FS_BACKEND 选择后端：
+// 1. files（默认）：直接使用 disk.c，但格式化时不再逐个创建文件，块文件在第一次写入时才创建
+// 2. image：虚拟磁盘目录下的一个稀疏镜像文件 `image`，第 i 块位于偏移 i * BLOCK_SIZE 处，
+//    用 pread/pwrite 读写，初始化时只需要把文件截断到 DISK_SIZE。
+//    不使用 mmap，因为运行时内存限制不允许把整个磁盘映射到内存里（见 README）
+//
+// 两个后端的写入都只保证进入宿主机的页缓存。需要落盘的地方（日志提交的顺序点、卸载）调用 blkdev_sync，
+// 一次提交只同步一两次，而不是每写一块同步一次
+//
+// 按块读写是同步的，一次只有一个请求在进行。互不相关的多个块（写回缓存中所有的脏块、预读一段连续的块）
+// 可以用 blkdev_submit 一批提交：请求放进提交队列，由一组 I/O 线程并行完成，提交者等整批完成后返回，
+// 这样一批请求的延迟大致是最慢的一个，而不是所有请求之和。两个后端每次读写都是独立的系统调用，可以并行
+enum blkdev_backend {
+    BLKDEV_FILES,
+    BLKDEV_IMAGE,
+};
+
+#define BLKDEV_WORKERS_MAX 8
+#define BLKDEV_QUEUE 64  // 提交队列的长度，放不下的请求由提交者自己完成
+
+enum blkdev_op {
+    BLKDEV_READ,
+    BLKDEV_WRITE,
+};
+
+struct blkdev_req {
+    enum blkdev_op op;
+    int block_id;
+    void* buffer;
+    int ret;  // 完成后和 blkdev_read/blkdev_write 的返回值相同
+};
+
+// 代替 disk_mount，按 FS_BACKEND 选择后端并初始化，init_flag 为 1 时准备一块新的磁盘
+//
+// 新的磁盘不会预先清零：文件系统从不读格式化之后没有写过的块，需要全 0 的区域在第一次使用时
+// 用 blkdev_zero 清零（见 fs.c 的 inode_group_init）。镜像文件截断之后本来就全是 0
+int blkdev_mount(int init_flag);
+
+// 读写第 block_id 块，和 disk_read/disk_write 一样，成功返回 0
+int blkdev_read(int block_id, void* buffer);
+int blkdev_write(int block_id, void* buffer);
+
+// 把之前的写入同步到宿主机的磁盘上，成功返回 0
+int blkdev_sync(void);
+
+// 把 [block_id, block_id + n) 写成全 0，每 BLKDEV_QUEUE 块一批提交（见 blkdev_submit），成功返回 0
+int blkdev_zero(int block_id, int n);
+
+// 启动 workers 个 I/O 线程，在 fuse 的 init 回调中调用（见 fs.c 的 fs_init）。workers 为 0 时 blkdev_submit 在提交者中依次完成
+int blkdev_start(uint32_t workers);
+
+// 完成队列中剩下的请求并停止 I/O 线程，在 fs_finalize 最后调用
+void blkdev_stop(void);
+
+// 提交 reqs[0, n)，等它们全部完成后返回失败的请求数，每个请求的结果在 ret 中
+//
+// 一批中的请求之间没有顺序，同一块不能在一批中出现两次
+int blkdev_submit(struct blkdev_req* reqs, int n);
+
+#endif
@@ -0,0 +1,359 @@
+#include "cache.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "blkdev.h"
+#include "journal.h"
+#include "logger.h"
+#include "stats.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;  // 有块读入结束
+    struct cache_buf* hash_table[CACHE_HASH_SIZE];
+};
+
+static struct cache_buf bufs[CACHE_NBUF];
+static struct cache_shard shards[CACHE_SHARDS];
+
+// 缓存池的锁，把空闲的缓存块分给某个块号时持有，加锁顺序在分片的锁之前
+//
+// 块号只在持有所属分片的锁时改变，从空闲变为某个块号则还要持有缓存池的锁
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_released = PTHREAD_COND_INITIALIZER;  // 有块的引用计数降为 0
+static int pool_waiters;  // 正在找空闲块的线程数
+static int clock_hand;
+
+static struct cache_shard* shard_of(int block_id) {
+    return &shards[block_id % CACHE_SHARDS];
+}
+
+static inline int hash_of(int block_id) {
+    return block_id / CACHE_SHARDS & (CACHE_HASH_SIZE - 1);
+}
+
+static void hash_insert(struct cache_shard* shard, struct cache_buf* buf) {
+    int h = hash_of(buf->block_id);
+    buf->hnext = shard->hash_table[h];
+    shard->hash_table[h] = buf;
+}
+
+static void hash_remove(struct cache_shard* shard, struct cache_buf* buf) {
+    struct cache_buf** p = &shard->hash_table[hash_of(buf->block_id)];
+    while (*p != buf)
+        p = &(*p)->hnext;
+    *p = buf->hnext;
+}
+
+static struct cache_buf* hash_find(struct cache_shard* shard, int block_id) {
+    struct cache_buf* buf = shard->hash_table[hash_of(block_id)];
+    while (buf != NULL && buf->block_id != block_id)
+        buf = buf->hnext;
+    return buf;
+}
+
+// 把块从分片中摘下，变为空闲，调用时持有分片的锁
+static void release(struct cache_shard* shard, struct cache_buf* buf) {
+    hash_remove(shard, buf);
+    // 和 lock_owner 配对：看到块空闲的线程不加分片的锁就会使用它，之前对它的修改必须可见
+    __atomic_store_n(&buf->block_id, -1, __ATOMIC_RELEASE);
+}
+
+// 锁住 buf 当前所属的分片，返回 NULL 表示 buf 是空闲的
+static struct cache_shard* lock_owner(struct cache_buf* buf) {
+    for (;;) {
+        int block_id = __atomic_load_n(&buf->block_id, __ATOMIC_ACQUIRE);
+        if (block_id < 0)
+            return NULL;
+        struct cache_shard* shard = shard_of(block_id);
+        pthread_mutex_lock(&shard->lock);
+        if (buf->block_id == block_id)
+            return shard;
+        // 加锁前块被丢弃了
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void cache_init(void) {
+    for (int i = 0; i < CACHE_SHARDS; ++i) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        pthread_cond_init(&shards[i].loaded, NULL);
+        memset(shards[i].hash_table, 0, sizeof(shards[i].hash_table));
+    }
+    for (int i = 0; i < CACHE_NBUF; ++i) {
+        bufs[i].block_id = -1;
+        bufs[i].refcnt = 0;
+        bufs[i].dirty = false;
+        bufs[i].loading = false;
+        bufs[i].valid = false;
+        bufs[i].referenced = false;
+    }
+    pool_waiters = 0;
+    clock_hand = 0;
+}
+
+// 用 CLOCK 算法找一个没有被钉住的块，写回后把它变为空闲，调用时持有缓存池的锁
+//
+// 所有块都被钉住时 *victim 为 NULL
+static int pick_victim(struct cache_buf** victim) {
+    *victim = NULL;
+    // 第一圈清掉访问位，第二圈一定能找到没被钉住的块（如果有的话）
+    for (int n = 0; n < 2 * CACHE_NBUF; ++n) {
+        struct cache_buf* buf = &bufs[clock_hand];
+        clock_hand = (clock_hand + 1) % CACHE_NBUF;
+        struct cache_shard* shard = lock_owner(buf);
+        if (shard == NULL) {
+            *victim = buf;
+            return 0;
+        }
+        if (buf->refcnt > 0) {
+            pthread_mutex_unlock(&shard->lock);
+            continue;
+        }
+        if (buf->referenced) {
+            buf->referenced = false;
+            pthread_mutex_unlock(&shard->lock);
+            continue;
+        }
+        if (buf->dirty) {
+            if (blkdev_write(journal_locate(buf->block_id), buf->data)) {
+                fs_error("cache: write back block %d failed\n", buf->block_id);
+                pthread_mutex_unlock(&shard->lock);
+                return 1;
+            }
+            buf->dirty = false;
+        }
+        release(shard, buf);
+        pthread_mutex_unlock(&shard->lock);
+        *victim = buf;
+        return 0;
+    }
+    return 0;
+}
+
+// 释放一个引用，内容无效的块在最后一个引用释放时被丢弃，调用时持有分片的锁
+static bool unpin(struct cache_shard* shard, struct cache_buf* buf) {
+    if (--buf->refcnt > 0)
+        return false;
+    if (!buf->valid)
+        release(shard, buf);
+    return true;
+}
+
+// 钉住分片中已有的块，等待它读入结束，调用时持有分片的锁，返回时释放
+static struct cache_buf* pin(struct cache_shard* shard, struct cache_buf* buf) {
+    buf->refcnt++;
+    buf->referenced = true;
+    while (buf->loading)
+        pthread_cond_wait(&shard->loaded, &shard->lock);
+    if (!buf->valid) {
+        unpin(shard, buf);
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return buf;
+}
+
+// 查找或分配 block_id 对应的缓存块，*hit 表示是否命中，未命中时返回的块处于 loading 状态
+//
+// wait 为假时用于预读：命中时只设置访问位，不钉住也不等待读入，返回 NULL；
+// 所有块都被钉住时也不等待，返回 NULL 且 *hit 为假
+static struct cache_buf* lookup(int block_id, bool wait, bool* hit) {
+    *hit = true;
+    if (block_id < 0 || block_id >= BLOCK_NUM)
+        return NULL;
+    struct cache_shard* shard = shard_of(block_id);
+    pthread_mutex_lock(&shard->lock);
+    struct cache_buf* buf = hash_find(shard, block_id);
+    if (buf != NULL && !wait) {
+        buf->referenced = true;
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+    if (buf != NULL)
+        return pin(shard, buf);
+    pthread_mutex_unlock(&shard->lock);
+
+    pthread_mutex_lock(&pool_lock);
+    __atomic_add_fetch(&pool_waiters, 1, __ATOMIC_RELAXED);
+    for (;;) {
+        // 只有持有缓存池的锁才能加入新块，所以检查过之后直到加入前都不会有别的线程读入它
+        pthread_mutex_lock(&shard->lock);
+        if ((buf = hash_find(shard, block_id)) != NULL) {
+            __atomic_sub_fetch(&pool_waiters, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&pool_lock);
+            if (!wait) {
+                pthread_mutex_unlock(&shard->lock);
+                return NULL;
+            }
+            return pin(shard, buf);
+        }
+        pthread_mutex_unlock(&shard->lock);
+        if (pick_victim(&buf)) {
+            __atomic_sub_fetch(&pool_waiters, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&pool_lock);
+            return NULL;
+        }
+        if (buf != NULL)
+            break;
+        if (!wait) {
+            __atomic_sub_fetch(&pool_waiters, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&pool_lock);
+            *hit = false;
+            return NULL;
+        }
+        pthread_cond_wait(&pool_released, &pool_lock);
+    }
+    __atomic_sub_fetch(&pool_waiters, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&shard->lock);
+    buf->refcnt = 1;
+    buf->dirty = false;
+    buf->loading = true;
+    buf->valid = false;
+    buf->referenced = true;
+    __atomic_store_n(&buf->block_id, block_id, __ATOMIC_RELAXED);
+    hash_insert(shard, buf);
+    pthread_mutex_unlock(&shard->lock);
+    pthread_mutex_unlock(&pool_lock);
+    *hit = false;
+    return buf;
+}
+
+// 结束 lookup 未命中时的读入，ok 为假时放弃这个块
+static void finish_load(struct cache_buf* buf, bool ok) {
+    struct cache_shard* shard = shard_of(buf->block_id);
+    pthread_mutex_lock(&shard->lock);
+    buf->loading = false;
+    buf->valid = ok;
+    if (!ok)
+        unpin(shard, buf);
+    pthread_cond_broadcast(&shard->loaded);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+struct cache_buf* cache_get(int block_id) {
+    bool hit;
+    struct cache_buf* buf = lookup(block_id, true, &hit);
+    if (buf != NULL)
+        stats_cache(hit);
+    if (buf == NULL || hit)
+        return buf;
+    bool ok = blkdev_read(journal_locate(block_id), buf->data) == 0;
+    finish_load(buf, ok);
+    return ok ? buf : NULL;
+}
+
+struct cache_buf* cache_zero(int block_id) {
+    bool hit;
+    struct cache_buf* buf = lookup(block_id, true, &hit);
+    if (buf == NULL)
+        return NULL;
+    memset(buf->data, 0, BLOCK_SIZE);
+    buf->dirty = true;
+    if (!hit)
+        finish_load(buf, true);
+    return buf;
+}
+
+void cache_dirty(struct cache_buf* buf) {
+    // 共用一个块的多个线程（比如同一个 inode 表块中的不同 inode）可能同时标记
+    __atomic_store_n(&buf->dirty, true, __ATOMIC_RELAXED);
+}
+
+void cache_put(struct cache_buf* buf) {
+    struct cache_shard* shard = shard_of(buf->block_id);
+    pthread_mutex_lock(&shard->lock);
+    bool released = unpin(shard, buf);
+    pthread_mutex_unlock(&shard->lock);
+    // 等待者在检查引用计数之前就已经登记，所以这里不会漏掉唤醒
+    if (released && __atomic_load_n(&pool_waiters, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&pool_lock);
+        pthread_cond_broadcast(&pool_released);
+        pthread_mutex_unlock(&pool_lock);
+    }
+}
+
+void cache_forget(int block_id) {
+    struct cache_shard* shard = shard_of(block_id);
+    pthread_mutex_lock(&shard->lock);
+    struct cache_buf* buf = hash_find(shard, block_id);
+    if (buf != NULL) {
+        buf->dirty = false;
+        if (buf->refcnt == 0)
+            release(shard, buf);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void cache_prefetch(const int* block_ids, int n) {
+    struct cache_buf* loading[CACHE_PREFETCH_MAX];
+    struct blkdev_req reqs[CACHE_PREFETCH_MAX];
+    int count = 0;
+    for (int i = 0; i < n && count < CACHE_PREFETCH_MAX; ++i) {
+        bool hit;
+        struct cache_buf* buf = lookup(block_ids[i], false, &hit);
+        if (buf == NULL && !hit)
+            break;
+        if (buf == NULL)
+            continue;
+        loading[count] = buf;
+        reqs[count] = (struct blkdev_req){BLKDEV_READ, journal_locate(block_ids[i]), buf->data, 0};
+        count++;
+    }
+    blkdev_submit(reqs, count);
+    for (int i = 0; i < count; ++i) {
+        finish_load(loading[i], reqs[i].ret == 0);
+        if (reqs[i].ret == 0)
+            cache_put(loading[i]);
+    }
+}
+
+void cache_prefetch_run(int block_id, int n) {
+    int ids[CACHE_PREFETCH_MAX];
+    for (int done = 0; done < n;) {
+        int count = min(n - done, CACHE_PREFETCH_MAX);
+        for (int i = 0; i < count; ++i)
+            ids[i] = block_id + done + i;
+        cache_prefetch(ids, count);
+        done += count;
+    }
+}
+
+int cache_flush(void) {
+    // 先钉住所有脏块，一批并行写回，写回期间它们不会被淘汰
+    struct cache_buf* dirty[CACHE_NBUF];
+    struct blkdev_req reqs[CACHE_NBUF];
+    int count = 0;
+    for (int i = 0; i < CACHE_NBUF; ++i) {
+        struct cache_buf* buf = &bufs[i];
+        struct cache_shard* shard = lock_owner(buf);
+        if (shard == NULL)
+            continue;
+        if (buf->dirty && buf->valid) {
+            buf->refcnt++;
+            dirty[count] = buf;
+            reqs[count] = (struct blkdev_req){BLKDEV_WRITE, journal_locate(buf->block_id), buf->data, 0};
+            count++;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    blkdev_submit(reqs, count);
+    int ret = 0;
+    for (int i = 0; i < count; ++i) {
+        if (reqs[i].ret) {
+            fs_error("cache: flush block %d failed\n", dirty[i]->block_id);
+            ret = 1;
+        } else {
+            struct cache_shard* shard = shard_of(dirty[i]->block_id);
+            pthread_mutex_lock(&shard->lock);
+            dirty[i]->dirty = false;
+            pthread_mutex_unlock(&shard->lock);
+        }
+        cache_put(dirty[i]);
+    }
+    return ret;
+}
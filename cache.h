@@ -0,0 +1,82 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "disk.h"
+
+// 块缓存，位于 fs.c 和 blkdev_read/blkdev_write 之间
+//
+// 缓存以块为单位，采用写回（write-back）策略：
+// 修改过的块只被标记为脏块，直到被淘汰或 cache_flush 时才真正写入磁盘
+//
+// 读写磁盘时的位置由 journal_locate 决定，未提交事务中的块会被写到日志区而不是原位置
+//
+// 实验要求运行时内存不超过 128KB，这里的缓存块数量决定了缓存的大部分内存占用
+//
+// 多线程：块按块号分到 CACHE_SHARDS 个分片中，每个分片有自己的锁和哈希表，命中时只锁一个分片。
+// 淘汰采用 CLOCK 算法（近似 LRU），命中时只设置访问位，只有未命中时才需要锁住整个缓存池。
+// 所有缓存块都被钉住时，未命中的线程等待其它线程释放缓存块，而不是直接失败
+//
+// 等待不会死锁：只读的操作同时只钉住一个块，修改文件系统的操作同时至多钉住 5 个块，
+// 而日志让同时进行的修改操作不超过 JOURNAL_MAX_OPS 个（见 journal_begin），所以总有线程能继续。
+// 写合并时句柄会在两次写之间一直钉住未写满的块（见 handle_hold），这些块另外留出位置。
+// 预读（cache_prefetch）一次钉住多个块，但它从不等待；日志提交时没有修改操作在进行，
+// 写回时至多钉住 CACHE_PREFETCH_MAX 个块
+#define CACHE_HOLD_MAX 2
+#define CACHE_NBUF (12 + CACHE_HOLD_MAX)  // 12 块多于 JOURNAL_MAX_OPS 个修改操作至多钉住的 10 块
+#define CACHE_SHARDS 4
+#define CACHE_HASH_SIZE 16  // 每个分片的哈希表大小
+
+struct cache_buf {
+    int block_id;  // -1 表示空闲
+    int refcnt;  // 被引用（钉住）的次数，大于 0 时不会被淘汰
+    bool dirty;
+    bool loading;  // 正在读入内容，其它线程需要等待
+    bool valid;  // 内容有效，读入失败时为假，最后一个引用释放时被丢弃
+    bool referenced;  // CLOCK 算法的访问位
+    struct cache_buf* hnext;  // 哈希链表
+    uint8_t data[BLOCK_SIZE];
+};
+
+// 初始化缓存，在 fs_mount 时调用
+void cache_init(void);
+
+// 获取第 block_id 块，必要时从磁盘读入，返回的块被钉住，用完后需调用 cache_put
+//
+// 失败（磁盘读写失败）时返回 NULL
+struct cache_buf* cache_get(int block_id);
+
+// 类似 cache_get，但不从磁盘读取，而是直接返回一个全 0 的块
+//
+// 用于新分配的块，此时磁盘上的旧内容没有意义，省去一次读
+struct cache_buf* cache_zero(int block_id);
+
+// 标记块被修改过，淘汰或 cache_flush 时会写回磁盘
+void cache_dirty(struct cache_buf* buf);
+
+// 释放 cache_get/cache_zero 获得的块
+void cache_put(struct cache_buf* buf);
+
+// 如果第 block_id 块在缓存中，直接丢弃它（不写回），用于块被释放的情况
+void cache_forget(int block_id);
+
+// 一批预读的块数上限
+#define CACHE_PREFETCH_MAX 8
+
+// 把 block_ids[0, n) 中不在缓存中的块一批提交给块设备并行读入（见 blkdev_submit），等读完后返回
+//
+// 只是提示：已经在缓存中（包括正在读入）的块跳过，没有空闲的缓存块时不等待，直接放弃剩下的块，
+// 读入失败也不报错。一次至多处理 CACHE_PREFETCH_MAX 块，同一块不能出现两次
+void cache_prefetch(const int* block_ids, int n);
+
+// 预读连续的 n 块 [block_id, block_id + n)，每 CACHE_PREFETCH_MAX 块一批
+void cache_prefetch_run(int block_id, int n);
+
+// 把所有脏块一批并行写回磁盘，成功返回 0
+//
+// 调用时不能有其它线程在修改缓存块的内容。读者更新 atime 是例外，写回期间的更新可能丢掉，见 fs.c 的 inode_set_atime
+int cache_flush(void);
+
+#endif
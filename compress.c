@@ -0,0 +1,129 @@
+#include "compress.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5  // 最后 5 个字节总是字面量
+#define MATCH_LIMIT 12  // 距离末尾不到 12 个字节时不再开始新的匹配
+
+_Static_assert(COMPRESS_CLUSTER_SIZE <= 65536, "positions must fit in 16 bits");
+
+static uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash32(uint32_t v) {
+    return (v * 2654435761u) >> (32 - COMPRESS_HASH_LOG);
+}
+
+// 写出长度的扩展字节：每个 255 表示还有更多，最后一个小于 255
+static uint8_t* put_length(uint8_t* op, size_t len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+// 写出一个序列：字面量 [lit, lit + nlit)，之后是距离 offset、长度 match 的匹配（match 为 0 表示只有字面量）。
+// 空间不够时返回 NULL
+static uint8_t* put_sequence(uint8_t* op, uint8_t* end, const uint8_t* lit, size_t nlit, size_t offset, size_t match) {
+    // token、两个长度的扩展字节、偏移
+    if ((size_t)(end - op) < 1 + nlit / 255 + 1 + nlit + 2 + match / 255 + 1)
+        return NULL;
+    uint8_t* token = op++;
+    *token = (nlit >= 15 ? 15 : nlit) << 4;
+    if (nlit >= 15)
+        op = put_length(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (match == 0)
+        return op;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    match -= MIN_MATCH;
+    *token |= match >= 15 ? 15 : match;
+    if (match >= 15)
+        op = put_length(op, match - 15);
+    return op;
+}
+
+size_t compress_pack(const uint8_t* src, size_t n, uint8_t* dst, size_t cap) {
+    uint16_t table[1 << COMPRESS_HASH_LOG];
+    memset(table, 0, sizeof(table));
+    uint8_t *op = dst, *end = dst + cap;
+    size_t anchor = 0;
+    if (n > MATCH_LIMIT) {
+        size_t limit = n - MATCH_LIMIT, match_end = n - LAST_LITERALS;
+        for (size_t ip = 1; ip < limit;) {
+            uint32_t h = hash32(read32(src + ip));
+            size_t ref = table[h];
+            table[h] = ip;
+            if (read32(src + ref) != read32(src + ip)) {
+                ip++;
+                continue;
+            }
+            // 向前延伸，再向后数出匹配的长度
+            while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1])
+                ip--, ref--;
+            size_t len = MIN_MATCH;
+            while (ip + len < match_end && src[ip + len] == src[ref + len])
+                len++;
+            if ((op = put_sequence(op, end, src + anchor, ip - anchor, ip - ref, len)) == NULL)
+                return 0;
+            ip += len;
+            anchor = ip;
+            if (ip < limit)
+                table[hash32(read32(src + ip - 2))] = ip - 2;
+        }
+    }
+    op = put_sequence(op, end, src + anchor, n - anchor, 0, 0);
+    return op != NULL ? (size_t)(op - dst) : 0;
+}
+
+// 读出长度的扩展字节，数据不完整时返回 false
+static bool get_length(const uint8_t** ip, const uint8_t* end, size_t* len) {
+    uint8_t b;
+    do {
+        if (*ip == end)
+            return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+size_t compress_unpack(const uint8_t* src, size_t n, uint8_t* dst, size_t cap) {
+    const uint8_t *ip = src, *end = src + n;
+    size_t op = 0;
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t nlit = token >> 4, match = token & 15;
+        if (nlit == 15 && !get_length(&ip, end, &nlit))
+            return 0;
+        if (nlit > (size_t)(end - ip) || nlit > cap - op)
+            return 0;
+        // 原地解压时字面量可能和还没读的输入重叠
+        memmove(dst + op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        // 最后一个序列只有字面量
+        if (ip == end)
+            break;
+        if (end - ip < 2)
+            return 0;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (match == 15 && !get_length(&ip, end, &match))
+            return 0;
+        match += MIN_MATCH;
+        if (offset == 0 || offset > op || match > cap - op)
+            return 0;
+        // 匹配可以和输出重叠（比如重复的一个字节），只能逐字节拷贝
+        for (size_t i = 0; i < match; ++i, ++op)
+            dst[op] = dst[op - offset];
+    }
+    return op;
+}
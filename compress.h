@@ -0,0 +1,33 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "disk.h"
+
+// 数据块压缩
+//
+// 使用 LZ4 的块格式（不带帧头），压缩和解压都在这里实现，不依赖外部的库。
+// 压缩时用一张 2^COMPRESS_HASH_LOG 项的哈希表找重复的 4 字节，贪心地取最长的匹配，
+// 速度优先，压缩率不如 LZ4HC；解压只是依次拷贝字面量和匹配，每个长度和偏移都检查边界，
+// 磁盘上损坏的数据只会返回错误
+//
+// 文件按 COMPRESS_CLUSTER 个逻辑块一组压缩（见 fs.c 的 inode_write_zipped），
+// 一组 16 KiB 的输入中的偏移总能放进 LZ4 的 16 位偏移，哈希表用 16 位的位置就够了
+//
+// 解压可以原地进行：压缩的数据放在一个 COMPRESS_INPLACE_SIZE 字节的缓冲区的末尾，解压到同一个缓冲区的开头。
+// 每个序列输出的字节数至少是它占的字节数减去长度的扩展字节，多留出的空间放得下所有的扩展字节，
+// 所以输出总是追不上还没读的输入，读一组只需要这一个缓冲区（见 fs.c 的 zip_read）
+#define COMPRESS_CLUSTER 4
+#define COMPRESS_CLUSTER_SIZE (COMPRESS_CLUSTER * BLOCK_SIZE)
+#define COMPRESS_INPLACE_SIZE (COMPRESS_CLUSTER_SIZE + COMPRESS_CLUSTER_SIZE / 255 + 16)
+#define COMPRESS_HASH_LOG 11  // 哈希表在压缩时的栈上，2^11 项是 4 KiB
+
+// 压缩 src[0, n)（n 不超过 COMPRESS_CLUSTER_SIZE）到 dst 中，返回压缩后的长度，超过 cap 时返回 0
+size_t compress_pack(const uint8_t* src, size_t n, uint8_t* dst, size_t cap);
+
+// 解压 src[0, n) 到 dst 中，返回解压后的长度，数据损坏或超过 cap 时返回 0。src 可以在 dst 之内，见上面的原地解压
+size_t compress_unpack(const uint8_t* src, size_t n, uint8_t* dst, size_t cap);
+
+#endif
@@ -0,0 +1,32 @@
+#include "ctl.h"
+
+#include <string.h>
+
+#include "defrag.h"
+#include "snapshot.h"
+#include "stats.h"
+
+static const struct ctl_file ctl_files[] = {
+    {"/.defrag", defrag_ctl_read, defrag_ctl_write},
+    {"/.fsstats", stats_ctl_read, NULL},
+    {"/.snapshot", snapshot_ctl_read, snapshot_ctl_write},
+};
+
+const struct ctl_file* ctl_find(const char* path) {
+    // 控制文件都以 "/." 开头，普通路径只需要比较两个字符
+    if (path[0] != '/' || path[1] != '.')
+        return NULL;
+    for (size_t i = 0; i < sizeof(ctl_files) / sizeof(ctl_files[0]); ++i) {
+        if (strcmp(path, ctl_files[i].path) == 0)
+            return &ctl_files[i];
+    }
+    return NULL;
+}
+
+int ctl_read_text(const char* text, size_t len, char* buffer, size_t size, off_t offset) {
+    if (offset < 0 || (size_t)offset >= len)
+        return 0;
+    size_t n = len - offset < size ? len - offset : size;
+    memcpy(buffer, text + offset, n);
+    return n;
+}
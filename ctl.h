@@ -0,0 +1,28 @@
+#ifndef CTL_H
+#define CTL_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// 控制文件
+//
+// 根目录下几个不出现在目录中的虚拟文件，读它们查询文件系统的运行状态，写它们向文件系统下达命令。
+// 它们不占 inode，路径在解析之前就被 fs.c 的各个回调截下来，交给这里登记的函数处理。
+// 新增控制文件只需要在 ctl.c 的表中加一项
+//
+// 控制文件的内容是读的时候现生成的，大小报告为 0，打开时设置 direct_io，内核不会按大小截断读取
+struct ctl_file {
+    const char* path;
+    // 从 offset 开始读取至多 size 字节，返回读到的字节数
+    int (*read)(char* buffer, size_t size, off_t offset);
+    // 写入一条命令，返回写入的字节数，NULL 表示只读
+    int (*write)(const char* buffer, size_t size, off_t offset);
+};
+
+// 找到 path 对应的控制文件，不是控制文件时返回 NULL
+const struct ctl_file* ctl_find(const char* path);
+
+// 从长度为 len 的 text 中取出 [offset, offset + size) 的部分，返回取出的字节数
+int ctl_read_text(const char* text, size_t len, char* buffer, size_t size, off_t offset);
+
+#endif
@@ -0,0 +1,154 @@
+#include "dcache.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+
+#define SHARD_SIZE (DCACHE_SIZE / DCACHE_SHARDS)
+
+struct dcache_shard {
+    pthread_mutex_t lock;
+    struct dentry dentries[SHARD_SIZE];
+    struct dentry* hash_table[DCACHE_HASH_SIZE];
+    // LRU 链表的哨兵，lru.next 是最近使用的项，lru.prev 是最久未使用的项
+    struct dentry lru;
+};
+
+static struct dcache_shard shards[DCACHE_SHARDS];
+
+// FNV-1a，低位选哈希链，高位选分片
+static uint32_t hash_of(uint32_t parent, const char* name) {
+    uint32_t h = 2166136261u ^ parent;
+    for (int i = 0; i < DCACHE_NAME_LEN && name[i] != '\0'; ++i)
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    return h;
+}
+
+static struct dcache_shard* shard_of(uint32_t hash) {
+    return &shards[(hash >> 16) % DCACHE_SHARDS];
+}
+
+static struct dentry** chain_of(struct dcache_shard* shard, uint32_t hash) {
+    return &shard->hash_table[hash & (DCACHE_HASH_SIZE - 1)];
+}
+
+static void lru_unlink(struct dentry* d) {
+    d->prev->next = d->next;
+    d->next->prev = d->prev;
+}
+
+static void lru_push_front(struct dcache_shard* shard, struct dentry* d) {
+    d->next = shard->lru.next;
+    d->prev = &shard->lru;
+    shard->lru.next->prev = d;
+    shard->lru.next = d;
+}
+
+static void lru_push_back(struct dcache_shard* shard, struct dentry* d) {
+    d->prev = shard->lru.prev;
+    d->next = &shard->lru;
+    shard->lru.prev->next = d;
+    shard->lru.prev = d;
+}
+
+static bool in_use(const struct dentry* d) {
+    return d->name[0] != '\0';
+}
+
+static void hash_remove(struct dcache_shard* shard, struct dentry* d) {
+    struct dentry** p = chain_of(shard, hash_of(d->parent, d->name));
+    while (*p != d)
+        p = &(*p)->hnext;
+    *p = d->hnext;
+}
+
+static struct dentry* hash_find(struct dcache_shard* shard, uint32_t hash, uint32_t parent, const char* name) {
+    struct dentry* d = *chain_of(shard, hash);
+    while (d != NULL && (d->parent != parent || strncmp(d->name, name, DCACHE_NAME_LEN) != 0))
+        d = d->hnext;
+    return d;
+}
+
+// 把一项从哈希表中摘下，放到 LRU 尾部等待复用
+static void release(struct dcache_shard* shard, struct dentry* d) {
+    hash_remove(shard, d);
+    d->name[0] = '\0';
+    lru_unlink(d);
+    lru_push_back(shard, d);
+}
+
+void dcache_init(void) {
+    for (int s = 0; s < DCACHE_SHARDS; ++s) {
+        struct dcache_shard* shard = &shards[s];
+        pthread_mutex_init(&shard->lock, NULL);
+        memset(shard->hash_table, 0, sizeof(shard->hash_table));
+        shard->lru.next = shard->lru.prev = &shard->lru;
+        for (int i = 0; i < SHARD_SIZE; ++i) {
+            shard->dentries[i].name[0] = '\0';
+            lru_push_back(shard, &shard->dentries[i]);
+        }
+    }
+}
+
+bool dcache_lookup(uint32_t parent, const char* name, uint32_t* ino, bool* is_dir) {
+    uint32_t hash = hash_of(parent, name);
+    struct dcache_shard* shard = shard_of(hash);
+    pthread_mutex_lock(&shard->lock);
+    struct dentry* d = hash_find(shard, hash, parent, name);
+    if (d != NULL) {
+        lru_unlink(d);
+        lru_push_front(shard, d);
+        *ino = d->ino;
+        *is_dir = d->is_dir;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return d != NULL;
+}
+
+void dcache_insert(uint32_t parent, const char* name, uint32_t ino, bool is_dir) {
+    uint32_t hash = hash_of(parent, name);
+    struct dcache_shard* shard = shard_of(hash);
+    pthread_mutex_lock(&shard->lock);
+    struct dentry* d = hash_find(shard, hash, parent, name);
+    if (d == NULL) {
+        // 复用最久未使用的一项
+        d = shard->lru.prev;
+        if (in_use(d))
+            hash_remove(shard, d);
+        d->parent = parent;
+        // 名字恰好 DCACHE_NAME_LEN 字节时不以 0 结尾，较短时补 0，覆盖这一项原来的名字
+        size_t len = strnlen(name, DCACHE_NAME_LEN);
+        memcpy(d->name, name, len);
+        memset(d->name + len, 0, DCACHE_NAME_LEN - len);
+        struct dentry** chain = chain_of(shard, hash);
+        d->hnext = *chain;
+        *chain = d;
+    }
+    d->ino = ino;
+    d->is_dir = is_dir;
+    lru_unlink(d);
+    lru_push_front(shard, d);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void dcache_remove(uint32_t parent, const char* name) {
+    uint32_t hash = hash_of(parent, name);
+    struct dcache_shard* shard = shard_of(hash);
+    pthread_mutex_lock(&shard->lock);
+    struct dentry* d = hash_find(shard, hash, parent, name);
+    if (d != NULL)
+        release(shard, d);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void dcache_purge_dir(uint32_t parent) {
+    for (int s = 0; s < DCACHE_SHARDS; ++s) {
+        struct dcache_shard* shard = &shards[s];
+        pthread_mutex_lock(&shard->lock);
+        for (int i = 0; i < SHARD_SIZE; ++i) {
+            if (in_use(&shard->dentries[i]) && shard->dentries[i].parent == parent)
+                release(shard, &shard->dentries[i]);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
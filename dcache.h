@@ -0,0 +1,47 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// 目录项缓存（dentry cache），缓存 (父目录 inode 号, 名字) -> inode 号 的映射
+//
+// 路径解析时每一级先查这里，命中时不需要读目录的数据块；
+// 查找失败的结果也会被缓存（负缓存），这样反复 stat 一个不存在的文件也不用扫描目录
+//
+// 缓存不会写回磁盘，它只是目录内容的一个副本，所以修改目录的操作必须同步更新它
+//
+// 多线程：缓存项按 (父目录, 名字) 的哈希值分到 DCACHE_SHARDS 个分片中，每个分片有自己的锁和 LRU 链表
+#define DCACHE_SIZE 128
+#define DCACHE_SHARDS 8
+#define DCACHE_HASH_SIZE 16  // 每个分片的哈希表大小
+#define DCACHE_NAME_LEN 24
+
+// 负缓存项的 inode 号
+#define DCACHE_NEGATIVE UINT32_MAX
+
+struct dentry {
+    uint32_t parent;
+    uint32_t ino;  // DCACHE_NEGATIVE 表示该名字不存在
+    bool is_dir;
+    char name[DCACHE_NAME_LEN];  // 恰好 DCACHE_NAME_LEN 字节时不以 0 结尾
+    struct dentry* prev;  // LRU 双向链表，表头是最近使用的
+    struct dentry* next;
+    struct dentry* hnext;  // 哈希链表
+};
+
+void dcache_init(void);
+
+// 查找 parent 目录下的 name，命中时返回 true，*ino 可能是 DCACHE_NEGATIVE
+bool dcache_lookup(uint32_t parent, const char* name, uint32_t* ino, bool* is_dir);
+
+// 加入或更新一项，ino 为 DCACHE_NEGATIVE 时记录该名字不存在
+void dcache_insert(uint32_t parent, const char* name, uint32_t ino, bool is_dir);
+
+// 删除 parent 目录下 name 对应的项（如果有）
+void dcache_remove(uint32_t parent, const char* name);
+
+// 删除所有父目录为 parent 的项，用于目录被删除时，防止 inode 号被复用后查到旧内容
+void dcache_purge_dir(uint32_t parent);
+
+#endif
@@ -0,0 +1,108 @@
+#include "dedupe.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "cache.h"
+#include "refcount.h"
+
+_Static_assert(DEDUPE_ENTRIES <= UINT8_MAX, "filter counts must fit in 8 bits");
+
+// 只记哈希的高 32 位（低位已经用来选项了），命中时总是比较内容，一项只占 8 字节
+struct dedupe_entry {
+    uint32_t tag;
+    uint32_t block;  // 0 表示空
+};
+
+// 索引和过滤器由 lock 保护，过滤器也可以不加锁用原子操作读
+static struct {
+    pthread_mutex_t lock;
+    bool enabled;
+    struct dedupe_entry entries[DEDUPE_ENTRIES];
+    uint8_t filter[DEDUPE_FILTER];  // filter[i] 为块号模 DEDUPE_FILTER 等于 i 的项数，不超过 DEDUPE_ENTRIES
+} dedupe = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+void dedupe_init(bool enabled) {
+    dedupe.enabled = enabled;
+    memset(dedupe.entries, 0, sizeof(dedupe.entries));
+    memset(dedupe.filter, 0, sizeof(dedupe.filter));
+}
+
+bool dedupe_enabled(void) {
+    return dedupe.enabled;
+}
+
+uint64_t dedupe_hash(const uint8_t* data) {
+    uint64_t h = 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+// 清空一项，调用时持有锁
+static void clear(struct dedupe_entry* e) {
+    if (e->block == 0)
+        return;
+    uint8_t* f = &dedupe.filter[e->block % DEDUPE_FILTER];
+    __atomic_store_n(f, *f - 1, __ATOMIC_RELAXED);
+    e->block = 0;
+}
+
+int dedupe_find(uint64_t hash, const uint8_t* data, uint32_t current, uint32_t* block) {
+    if (!dedupe.enabled)
+        return 0;
+    int ret = 0;
+    pthread_mutex_lock(&dedupe.lock);
+    struct dedupe_entry* e = &dedupe.entries[hash % DEDUPE_ENTRIES];
+    if (e->block != 0 && e->tag == hash >> 32) {
+        struct cache_buf* buf = cache_get(e->block);
+        if (buf == NULL) {
+            ret = -EIO;
+        } else {
+            bool same = memcmp(buf->data, data, BLOCK_SIZE) == 0;
+            cache_put(buf);
+            if (!same)
+                clear(e);
+            else if (e->block == current || (ret = refcount_inc(e->block, 1)) == 0)
+                ret = 1;
+            else if (ret == -EMLINK)
+                ret = 0;  // 共享的次数到了上限，这次照常写入
+        }
+        if (ret == 1)
+            *block = e->block;
+    }
+    pthread_mutex_unlock(&dedupe.lock);
+    return ret;
+}
+
+void dedupe_insert(uint64_t hash, uint32_t block) {
+    if (!dedupe.enabled)
+        return;
+    pthread_mutex_lock(&dedupe.lock);
+    struct dedupe_entry* e = &dedupe.entries[hash % DEDUPE_ENTRIES];
+    clear(e);
+    *e = (struct dedupe_entry){hash >> 32, block};
+    uint8_t* f = &dedupe.filter[block % DEDUPE_FILTER];
+    __atomic_store_n(f, *f + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&dedupe.lock);
+}
+
+void dedupe_forget(uint32_t start, uint32_t len) {
+    if (!dedupe.enabled)
+        return;
+    for (uint32_t b = start; b < start + len; ++b) {
+        if (__atomic_load_n(&dedupe.filter[b % DEDUPE_FILTER], __ATOMIC_RELAXED) == 0)
+            continue;
+        pthread_mutex_lock(&dedupe.lock);
+        for (uint32_t i = 0; i < DEDUPE_ENTRIES; ++i) {
+            if (dedupe.entries[i].block == b)
+                clear(&dedupe.entries[i]);
+        }
+        pthread_mutex_unlock(&dedupe.lock);
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef DEDUPE_H
+#define DEDUPE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// 数据块去重
+//
+// 写入一整块时先算出内容的哈希，在索引中找到内容相同的块就直接共享它（引用计数加一，见 refcount.h），
+// 不分配新块也不写盘；找不到时照常写入，再把新块记入索引。之后任何一个拥有者改写共享的块时
+// 都会先复制一份（见 fs.c 的 inode_cow），所以共享对文件是透明的
+//
+// 索引只在内存中，大小固定（DEDUPE_ENTRIES 项，按哈希直接映射，冲突时新的覆盖旧的），
+// 所以只能找到最近写过的重复块，卸载后从空的索引重新开始。命中时总是比较块的内容，
+// 哈希冲突或者索引过时都不会导致错误的共享
+//
+// 块被原地改写或者释放之前必须先调用 dedupe_forget 把它从索引中去掉，这样别的线程就不会在
+// 检查共享之后再共享这个块。一个块只会被它唯一的拥有者记入索引，所以 dedupe_forget 先不加锁
+// 查一个按块号计数的过滤器，不在索引中的块（绝大多数）不需要加锁
+#define DEDUPE_ENTRIES 128
+#define DEDUPE_FILTER 512
+
+// 启用或关闭去重，在 fs_mount 时调用，启用前引用计数表必须已经存在
+void dedupe_init(bool enabled);
+
+bool dedupe_enabled(void);
+
+// 一个块的内容的哈希
+uint64_t dedupe_hash(const uint8_t* data);
+
+// 找内容为 data（哈希为 hash）的块：找到时返回 1，*block 为这个块；找不到时返回 0，出错时返回负数
+//
+// 找到的块不是 current 时它的引用计数已经加一，调用者要把它映射到文件中，或者用 block_free_run 放掉这个引用；
+// 找到的就是 current 时（写入的内容和原来一样）什么也不改
+int dedupe_find(uint64_t hash, const uint8_t* data, uint32_t current, uint32_t* block);
+
+// 把刚写入完整内容的块 block 记入索引，调用时持有拥有它的 inode 的写锁
+void dedupe_insert(uint64_t hash, uint32_t block);
+
+// 把 [start, start + len) 从索引中去掉，在原地改写或者释放这些块之前调用
+void dedupe_forget(uint32_t start, uint32_t len);
+
+#endif
@@ -0,0 +1,136 @@
+#include "defrag.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "ctl.h"
+#include "logger.h"
+
+#define DEFRAG_TEXT_SIZE 1024  // 报告格式化后最长的长度
+
+static struct {
+    pthread_mutex_t lock;  // 整理和读取互斥
+    defrag_scan_fn scan;
+    defrag_run_fn run;
+    // 上一次整理
+    bool done;
+    bool compact;
+    struct defrag_report before;
+    struct defrag_report after;
+    struct defrag_result result;
+    int64_t elapsed_ms;
+} defrag = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+void defrag_init(defrag_scan_fn scan, defrag_run_fn run) {
+    defrag.scan = scan;
+    defrag.run = run;
+}
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// 格式化报告，返回长度。每一行是一项指标，列是现在的值，整理过时还有上一次整理前后的值
+static int format(char* text, size_t cap, size_t* len) {
+    struct defrag_report now;
+    int ret = defrag.scan(&now);
+    if (ret)
+        return ret;
+    const struct defrag_report* cols[] = {&now, &defrag.before, &defrag.after};
+    int ncols = defrag.done ? 3 : 1;
+    *len = 0;
+#define APPEND(...) (*len += snprintf(text + *len, *len < cap ? cap - *len : 0, __VA_ARGS__))
+#define ROW(name, field)                                   \
+    do {                                                   \
+        APPEND("%-14s", name);                             \
+        for (int i = 0; i < ncols; ++i)                    \
+            APPEND(" %10u", cols[i]->field);               \
+        APPEND("\n");                                      \
+    } while (0)
+    APPEND("%-14s %10s", "", "current");
+    if (defrag.done)
+        APPEND(" %10s %10s", "before", "after");
+    APPEND("\n");
+    ROW("files", files);
+    ROW("fragmented", fragmented);
+    ROW("fragments", fragments);
+    ROW("blocks", blocks);
+    ROW("free_blocks", free);
+    ROW("free_runs", free_runs);
+    ROW("largest_free", largest_free);
+    if (defrag.done)
+        APPEND("last %s: moved %u blocks in %u chunks, skipped %u, %lld ms\n", defrag.compact ? "compact" : "run",
+               defrag.result.moved, defrag.result.chunks, defrag.result.skipped, (long long)defrag.elapsed_ms);
+#undef ROW
+#undef APPEND
+    *len = *len < cap ? *len : cap - 1;
+    return 0;
+}
+
+int defrag_ctl_read(char* buffer, size_t size, off_t offset) {
+    char text[DEFRAG_TEXT_SIZE];
+    size_t len;
+    pthread_mutex_lock(&defrag.lock);
+    int ret = format(text, sizeof(text), &len);
+    pthread_mutex_unlock(&defrag.lock);
+    return ret ? ret : ctl_read_text(text, len, buffer, size, offset);
+}
+
+// 整理一遍，记下前后的碎片情况
+static int defrag_once(bool compact) {
+    struct defrag_report before, after;
+    struct defrag_result result = {0};
+    int64_t start = now_ms();
+    int ret = defrag.scan(&before);
+    if (ret || (ret = defrag.run(compact, &result)) || (ret = defrag.scan(&after)))
+        return ret;
+    defrag.done = true;
+    defrag.compact = compact;
+    defrag.before = before;
+    defrag.after = after;
+    defrag.result = result;
+    defrag.elapsed_ms = now_ms() - start;
+    fs_info("defrag: moved %u blocks in %u chunks, fragments %u -> %u, largest free run %u -> %u\n", result.moved,
+            result.chunks, before.fragments, after.fragments, before.largest_free, after.largest_free);
+    return 0;
+}
+
+// 执行一行命令 `run` 或 `compact`
+static int command(const char* line) {
+    char verb[8], extra;
+    if (sscanf(line, "%7s %c", verb, &extra) != 1)
+        return -EINVAL;
+    if (strcmp(verb, "run") == 0)
+        return defrag_once(false);
+    if (strcmp(verb, "compact") == 0)
+        return defrag_once(true);
+    return -EINVAL;
+}
+
+int defrag_ctl_write(const char* buffer, size_t size, off_t offset) {
+    // 每行一条命令，依次执行，遇到错误时停下
+    int ret = 0;
+    pthread_mutex_lock(&defrag.lock);
+    for (size_t start = 0, end; start < size && ret == 0; start = end + 1) {
+        for (end = start; end < size && buffer[end] != '\n'; ++end)
+            ;
+        char line[32];
+        size_t n = end - start;
+        if (n >= sizeof(line)) {
+            ret = -EINVAL;
+            break;
+        }
+        memcpy(line, buffer + start, n);
+        line[n] = '\0';
+        if (strspn(line, " \t") == n)
+            continue;
+        ret = command(line);
+    }
+    pthread_mutex_unlock(&defrag.lock);
+    return ret ? ret : (int)size;
+}
@@ -0,0 +1,58 @@
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// 在线碎片整理
+//
+// 长时间反复创建、删除之后，文件和目录的块散落在磁盘各处，空闲空间也被切成许多小段，
+// 顺序读变慢，新文件也分配不到连续的块。碎片整理把文件中不连续的块搬到一段连续的新块中：
+// 先复制内容，再改为映射到新块，旧块等这次修改提交之后才释放（见 journal_free），
+// 所以在任何时候崩溃，文件要么还是旧的映射，要么已经是新的映射，内容都是完整的。目录块也一样整理
+//
+// 一次搬动文件中逻辑上相邻的一段（至多一组的块，见 alloc.h），新块用 alloc_exact 从数据区的开头
+// 找第一段放得下的空隙，所以整理之后数据往磁盘的前部靠拢，空闲空间留在后面连成大段。
+// 压缩的组（见 compress.h）和共享的块（快照或去重，见 refcount.h）不搬动，它们把文件分成互不相连的几段；
+// 内联的文件没有数据块，extent 叶子块也不搬动
+//
+// 整理时文件系统照常使用：每一段在一个单独的操作中搬动，只持有这个文件的写锁（目录还要持有命名空间的写锁）。
+// 报告的数字是逐个文件统计的，统计期间别的线程修改了文件时只是近似值
+//
+// 通过控制文件 `/.defrag` 使用：读它报告现在的碎片情况，整理过时还有上一次整理前后的对比；
+// 写入 `run` 整理不连续的文件，写入 `compact` 还把已经连续的文件往前搬，合并空闲空间
+
+// 碎片情况
+struct defrag_report {
+    uint32_t files;  // 有块的文件和目录数
+    uint32_t fragmented;  // 块不连续的文件和目录数
+    uint32_t fragments;  // 所有文件的块组成的连续段数，每个文件都连续时等于 files
+    uint32_t blocks;  // 文件和目录的块数，不包括 extent 叶子块
+    uint32_t free;  // 空闲块数
+    uint32_t free_runs;  // 空闲块组成的连续段数
+    uint32_t largest_free;  // 最长的一段空闲块
+};
+
+// 一次整理做了什么
+struct defrag_result {
+    uint32_t chunks;  // 搬动的段数
+    uint32_t moved;  // 搬动的块数
+    uint32_t skipped;  // 找不到足够大的空隙、没有搬动的不连续的段数
+};
+
+// 统计现在的碎片情况
+typedef int (*defrag_scan_fn)(struct defrag_report* report);
+
+// 整理所有文件，compact 为 true 时已经连续的文件也尽量往前搬
+typedef int (*defrag_run_fn)(bool compact, struct defrag_result* result);
+
+// scan 和 run 完成具体的工作，在 fs_mount 时调用
+void defrag_init(defrag_scan_fn scan, defrag_run_fn run);
+
+// `/.defrag` 的内容和命令，见 ctl.h。整理和读取互斥，同一时间只有一次整理
+int defrag_ctl_read(char* buffer, size_t size, off_t offset);
+int defrag_ctl_write(const char* buffer, size_t size, off_t offset);
+
+#endif
@@ -7,8 +7,9 @@
 #include <fcntl.h>
 #include <fuse.h>
 #include <fuse/fuse.h>
-#include <libgen.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,9 +20,25 @@
 #include <unistd.h>
 #include <utime.h>
 
-#include "disk.h"
+#include "alloc.h"
+#include "attrcache.h"
+#include "blkdev.h"
+#include "cache.h"
+#include "compress.h"
+#include "ctl.h"
+#include "dcache.h"
+#include "dedupe.h"
+#include "defrag.h"
 #include "fs_opt.h"
+#include "handle.h"
+#include "journal.h"
 #include "logger.h"
+#include "options.h"
+#include "readahead.h"
+#include "refcount.h"
+#include "ringlog.h"
+#include "snapshot.h"
+#include "stats.h"
 
 // 默认的文件和目录的标志
 #define DIRMODE (S_IFDIR | 0755)
@@ -30,6 +47,2328 @@
 // 一些辅助宏定义
 #define ceil_div(a, b) (((a) + (b) - 1) / (b))
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+// 磁盘布局：
+//
+// | 超级块 | inode 位图 | 数据块位图 | inode 表 | 日志 | 数据块 |
+// |   1    |     1      |     2      |   1024   | 128  | 64380  |
+//
+// 数据块位图覆盖整个磁盘（包括前面的元数据区域，它们在格式化时被标记为已用），
+// 这样块号和位图中的位一一对应，不需要做偏移换算
+#define FS_MAGIC 0x424c5346  // "FSLB"
+#define INODE_NUM 32768
+#define INODE_SIZE 128
+#define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8)
+
+#define SUPER_BLOCK 0
+#define INODE_BITMAP_START 1
+#define INODE_BITMAP_BLOCKS ceil_div(INODE_NUM, BITS_PER_BLOCK)
+#define DATA_BITMAP_START (INODE_BITMAP_START + INODE_BITMAP_BLOCKS)
+#define DATA_BITMAP_BLOCKS ceil_div(BLOCK_NUM, BITS_PER_BLOCK)
+#define INODE_TABLE_START (DATA_BITMAP_START + DATA_BITMAP_BLOCKS)
+#define INODE_TABLE_BLOCKS (INODE_NUM / INODES_PER_BLOCK)
+#define JOURNAL_START (INODE_TABLE_START + INODE_TABLE_BLOCKS)
+#define DATA_START (JOURNAL_START + JOURNAL_BLOCKS)
+
+// 一个 inode 组在 inode 表中占的块数
+#define INODE_GROUP_BLOCKS (ALLOC_GROUP_BITS / INODES_PER_BLOCK)
+
+// n 个组都没有用过
+#define GROUPS_UNINIT(n) ((uint32_t)((1ULL << (n)) - 1))
+
+#define ROOT_INO 0
+#define NAME_MAX_LEN 24
+
+// 单个文件的逻辑块号用 uint32_t 表示
+#define MAX_FILE_BLOCKS ((uint64_t)UINT32_MAX)
+#define MAX_FILE_SIZE (MAX_FILE_BLOCKS * BLOCK_SIZE)
+
+struct superblock {
+    uint32_t magic;
+    uint32_t inode_num;
+    uint32_t block_num;
+    uint32_t data_start;
+    uint32_t free_inodes;
+    uint32_t free_blocks;
+    uint32_t snapshot_table;  // 快照表的块号，0 表示还没有创建过快照，见 snapshot.h
+    uint32_t zip_saved;  // 压缩节省的块数，只用于 statfs，在 sb_sync 时写回，崩溃后可能不准
+    // 格式化以来没有用过的 inode 组和数据块组（每组 ALLOC_GROUP_BITS 个），见 alloc.h 和 inode_group_init。
+    // 旧的文件系统中这两项为 0，所有组都当作用过
+    uint32_t uninit_inodes;
+    uint32_t uninit_blocks;
+    // 为 1 表示上一次是正常卸载的，此时下面两项是卸载时分配器的状态，挂载时直接载入，不用扫描位图。
+    // 挂载后马上清零并提交，崩溃之后再挂载时重新扫描，见 sb_unmount
+    uint32_t clean;
+    struct alloc_summary inode_summary;
+    struct alloc_summary block_summary;
+};
+
+// 一段连续的块映射：逻辑块 [lblk, lblk + len) 对应物理块 [pblk, pblk + len)
+//
+// 作为索引项时（见 struct inode），pblk 是叶子块的块号，len 是叶子中 extent 的数量，
+// lblk 是叶子中第一个 extent 的逻辑块号
+struct extent {
+    uint32_t lblk;
+    uint32_t pblk;
+    uint32_t len;
+};
+
+// 压缩的 extent（见 inode_write_zipped）：一组 COMPRESS_CLUSTER 个逻辑块压缩后存放在从 pblk 开始的 n 个物理块中，
+// len 的最高位是 EXTENT_ZIP，[EXTENT_ZIP_SHIFT, 31) 位是 n，低位是逻辑块数。这样的 extent 从不和别的合并，
+// 也不会只去掉一部分。extent_lookup 查到它时返回的物理块号同样带上这些高位，见 zip_start 和 zip_blocks
+#define EXTENT_ZIP 0x80000000u
+#define EXTENT_ZIP_SHIFT 24
+#define EXTENT_LEN_MASK ((1u << EXTENT_ZIP_SHIFT) - 1)
+
+#define INODE_EXTENTS 7
+#define LEAF_EXTENTS (BLOCK_SIZE / sizeof(struct extent))
+
+// inode 的 flags
+#define INODE_DIR_INDEXED 0x1  // 目录使用哈希索引，见 dir_add
+#define INODE_INLINE 0x2  // 文件内容直接存放在 inode 中，见 inode_uninline
+
+// 内联的文件内容最多能有多大：小文件的内容放在 extents 的位置上，不需要分配数据块
+#define INODE_INLINE_SIZE (INODE_EXTENTS * sizeof(struct extent))
+
+// 块映射是一棵至多两层的 extent 树，所有 extent 按 lblk 排序，没有被覆盖的逻辑块是空洞：
+// extent_depth 为 0 时，extents 中直接存放至多 INODE_EXTENTS 个 extent；
+// extent_depth 为 1 时，extents 中存放索引项，每项指向一个存放至多 LEAF_EXTENTS 个 extent 的叶子块
+//
+// 新建的文件是内联的（INODE_INLINE）：extents 的位置上直接存放文件内容，没有块映射，
+// 大小超过 INODE_INLINE_SIZE 时才转为普通的块映射。内联内容中 size 之后的部分总是 0
+//
+// 时间均以纳秒记，utimens 需要纳秒精度
+struct inode {
+    uint16_t mode;
+    uint16_t flags;
+    uint32_t blocks;  // 占用的块数，包括 extent 叶子块
+    uint64_t size;
+    int64_t atime;
+    int64_t mtime;
+    int64_t ctime;
+    uint16_t extent_count;
+    uint16_t extent_depth;
+    union {
+        struct extent extents[INODE_EXTENTS];
+        uint8_t inline_data[INODE_INLINE_SIZE];
+    };
+};
+static_assert(sizeof(struct inode) == INODE_SIZE, "inode size mismatch");
+
+// 目录项，name[0] 为 0 表示空闲，名字恰好 24 字节时不以 0 结尾
+struct dirent {
+    char name[NAME_MAX_LEN];
+    uint32_t ino;
+    uint32_t hash;  // 名字的哈希值，见 name_hash
+};
+#define DIRENTS_PER_BLOCK (BLOCK_SIZE / sizeof(struct dirent))
+
+static struct superblock sb;
+// 数据块位图覆盖整个磁盘，元数据区域在格式化时标记为已用
+static struct alloc block_bitmap;
+static struct alloc inode_bitmap;
+static struct fs_options options;
+
+// 只读挂载快照时为真，此时 inode 表是快照中的副本，snapshot_itable 是它的映射块，见 inode_block
+static bool readonly;
+static uint32_t snapshot_itable;
+
+// ---------------------------------------------------------------------------
+// 时间
+// ---------------------------------------------------------------------------
+
+static int64_t ts_to_ns(struct timespec ts) {
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct timespec ns_to_ts(int64_t ns) {
+    return (struct timespec){.tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000};
+}
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts_to_ns(ts);
+}
+
+// ---------------------------------------------------------------------------
+// 锁
+// ---------------------------------------------------------------------------
+
+// 多线程模式（不带 -s 挂载）下的加锁规则：
+//
+// 1. 目录项在持有 ns_lock 的写锁时修改，解析路径时持有它的读锁
+// 2. inode 和它的块在持有 inode 的写锁时修改，读取时持有读锁，atime 例外，见 inode_set_atime；
+//    目录的 inode 也一样，所以修改目录项时还要持有目录的写锁，readdir 只需要目录的读锁
+// 3. 先加 ns_lock，再加 inode 的锁；同时加多个 inode 的锁时按锁的下标从小到大加，见 inode_lock_set
+//
+// 修改命名空间的操作（创建、删除、重命名）都很短，所以共用一把全局的锁；读写文件的操作解析完路径、
+// 锁住 inode 之后就释放 ns_lock，所以不同文件的读写、同一个文件的读都可以并行。
+// 删除一个 inode 前要先拿到它的写锁，所以从解析出 inode 号到锁住它的这段时间里，它不会被释放并复用
+//
+// inode 的锁按 inode 号分成 INODE_LOCKS 组，不同的 inode 可能共用一把锁
+#define INODE_LOCKS 64
+
+static pthread_rwlock_t ns_lock;
+static pthread_rwlock_t inode_locks[INODE_LOCKS];
+
+static void locks_init(void) {
+    pthread_rwlock_init(&ns_lock, NULL);
+    for (int i = 0; i < INODE_LOCKS; ++i)
+        pthread_rwlock_init(&inode_locks[i], NULL);
+}
+
+static void inode_lock(uint32_t ino, bool write) {
+    if (write)
+        pthread_rwlock_wrlock(&inode_locks[ino % INODE_LOCKS]);
+    else
+        pthread_rwlock_rdlock(&inode_locks[ino % INODE_LOCKS]);
+}
+
+static void inode_unlock(uint32_t ino) {
+    pthread_rwlock_unlock(&inode_locks[ino % INODE_LOCKS]);
+}
+
+// 给 inos[0, n) 加写锁，共用一把锁的 inode 只加一次，返回加过锁的集合，用 inode_unlock_set 解锁
+static uint64_t inode_lock_set(const uint32_t* inos, int n) {
+    static_assert(INODE_LOCKS <= 64, "lock set does not fit in uint64_t");
+    uint64_t set = 0;
+    for (int i = 0; i < n; ++i)
+        set |= 1ULL << (inos[i] % INODE_LOCKS);
+    for (int i = 0; i < INODE_LOCKS; ++i) {
+        if (set & (1ULL << i))
+            pthread_rwlock_wrlock(&inode_locks[i]);
+    }
+    return set;
+}
+
+static void inode_unlock_set(uint64_t set) {
+    for (int i = 0; i < INODE_LOCKS; ++i) {
+        if (set & (1ULL << i))
+            pthread_rwlock_unlock(&inode_locks[i]);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// 超级块和位图
+// ---------------------------------------------------------------------------
+
+static int sb_sync(void) {
+    sb.free_inodes = __atomic_load_n(&inode_bitmap.free, __ATOMIC_RELAXED);
+    sb.free_blocks = __atomic_load_n(&block_bitmap.free, __ATOMIC_RELAXED);
+    struct cache_buf* buf = cache_get(SUPER_BLOCK);
+    if (buf == NULL)
+        return -EIO;
+    memcpy(buf->data, &sb, sizeof(sb));
+    journal_dirty(buf);
+    cache_put(buf);
+    return 0;
+}
+
+// 第一次在一个 inode 组中分配时，清零它在 inode 表中的部分：写 inode 时要读出整个 inode 表块，
+// 格式化时没有写过的块不能读。之后和清掉的标记一起写回超级块，标记随这次分配所在的事务提交，
+// 提交之前崩溃时组仍然是没有用过的，下次使用时再清零一遍
+//
+// 没有用过的组的 inode 表块从来没有被读过，不在缓存中，所以可以直接写到磁盘上
+static int inode_group_init(uint32_t group) {
+    if (blkdev_zero(INODE_TABLE_START + group * INODE_GROUP_BLOCKS, INODE_GROUP_BLOCKS))
+        return -EIO;
+    return sb_sync();
+}
+
+// 数据块组不需要清零：新分配的块总是用 cache_zero 取得或者整块写入，不会读出磁盘上的旧内容
+static int block_group_init(uint32_t group) {
+    (void)group;
+    return sb_sync();
+}
+
+// 初始化分配器，上一次正常卸载时载入超级块中的状态，否则扫描位图
+static int bitmaps_init(void) {
+    return alloc_init(&block_bitmap, DATA_BITMAP_START, BLOCK_NUM, &sb.uninit_blocks, block_group_init,
+                      sb.clean ? &sb.block_summary : NULL) ||
+           alloc_init(&inode_bitmap, INODE_BITMAP_START, INODE_NUM, &sb.uninit_inodes, inode_group_init,
+                      sb.clean ? &sb.inode_summary : NULL);
+}
+
+// 卸载前把分配器的状态存进超级块，和最后的修改一起提交，之后磁盘上的位图和这份状态一致
+//
+// 先提交一次：提交时才释放延迟释放的块（见 journal_free），之后分配器的状态才是最终的
+static int sb_unmount(void) {
+    if (journal_commit())
+        return -EIO;
+    alloc_save(&inode_bitmap, &sb.inode_summary);
+    alloc_save(&block_bitmap, &sb.block_summary);
+    sb.clean = 1;
+    return sb_sync() || journal_commit();
+}
+
+// 分配至多 want 个连续的数据块，优先从 goal 开始往后找，实际分配的块数通过 *got 返回
+//
+// 从 goal 开始找到第一个空闲块后，尽量向后延伸，所以顺序写入的文件通常是连续的；
+// goal 为 0 时从上一次分配结束的位置继续找
+static int block_alloc_run(uint32_t goal, uint32_t want, uint32_t* start, uint32_t* got) {
+    return alloc_range(&block_bitmap, goal, want, start, got);
+}
+
+// 真正释放没有别的拥有者的块 [start, start + len)，它们的内容已经没有用了，缓存中的直接丢掉，不用再写回。
+// 也是提交时释放延迟释放的块的函数（见 journal_init），这时引用计数和去重索引已经在放掉引用时处理过了
+static int block_free_now(uint32_t start, uint32_t len) {
+    for (uint32_t i = 0; i < len; ++i) {
+        cache_forget(start + i);
+        journal_forget(start + i);
+    }
+    return alloc_free(&block_bitmap, start, len);
+}
+
+// 延迟到事务提交时释放没有别的拥有者的块，见 journal_free。
+// 区间表满了时什么也不做，缓存中的内容也留着，这些块仍然属于原来的文件
+static int block_free_later(uint32_t start, uint32_t len) {
+    int ret = journal_free(start, len);
+    for (uint32_t i = 0; ret == 0 && i < len; ++i)
+        cache_forget(start + i);
+    return ret;
+}
+
+// 放掉对 [start, start + len) 的一个引用：共享的块只把引用计数减一，内容还要留给快照或者别的文件（见 refcount.h），
+// 没有别的拥有者的块交给 release 释放
+static int block_put_run(uint32_t start, uint32_t len, int (*release)(uint32_t start, uint32_t len)) {
+    dedupe_forget(start, len);
+    while (len > 0) {
+        uint32_t run;
+        int ret = refcount_put(start, len, &run);
+        if (ret < 0)
+            return ret;
+        if (ret == 0 && (ret = release(start, run)))
+            return ret;
+        start += run;
+        len -= run;
+    }
+    return 0;
+}
+
+// 立即释放 [start, start + len)，共享的块只把引用计数减一
+static int block_free_run(uint32_t start, uint32_t len) {
+    return block_put_run(start, len, block_free_now);
+}
+
+// 放掉文件对 [start, start + len) 的引用：共享的块立即把引用计数减一，
+// 没有别的拥有者的块等事务提交后才真正释放（见 journal_free），提交前不会被分配出去覆盖掉
+static int block_release_run(uint32_t start, uint32_t len) {
+    return block_put_run(start, len, block_free_later);
+}
+
+static int inode_alloc(uint32_t* ino) {
+    uint32_t got;
+    return alloc_range(&inode_bitmap, 0, 1, ino, &got);
+}
+
+static int inode_free(uint32_t ino) {
+    attrcache_remove(ino);
+    alloc_release(&block_bitmap, ino);
+    return alloc_free(&inode_bitmap, ino, 1);
+}
+
+// ---------------------------------------------------------------------------
+// inode
+// ---------------------------------------------------------------------------
+
+// ino 所在的 inode 表块：挂载快照时先从快照的映射块中查出它的副本的位置
+static int inode_block(uint32_t ino, int* block) {
+    if (snapshot_itable == 0) {
+        *block = INODE_TABLE_START + ino / INODES_PER_BLOCK;
+        return 0;
+    }
+    struct cache_buf* buf = cache_get(snapshot_itable);
+    if (buf == NULL)
+        return -EIO;
+    *block = ((uint32_t*)buf->data)[ino / INODES_PER_BLOCK];
+    cache_put(buf);
+    return *block != 0 ? 0 : -EIO;
+}
+
+static int inode_read(uint32_t ino, struct inode* inode) {
+    int block;
+    int ret = inode_block(ino, &block);
+    if (ret)
+        return ret;
+    struct cache_buf* buf = cache_get(block);
+    if (buf == NULL)
+        return -EIO;
+    memcpy(inode, buf->data + ino % INODES_PER_BLOCK * INODE_SIZE, INODE_SIZE);
+    cache_put(buf);
+    return 0;
+}
+
+static struct inode_attr inode_attr_of(const struct inode* inode) {
+    return (struct inode_attr){
+        .mode = inode->mode,
+        .blocks = inode->blocks,
+        .size = inode->size,
+        .atime = inode->atime,
+        .mtime = inode->mtime,
+        .ctime = inode->ctime,
+    };
+}
+
+// 写回 inode，同时更新属性缓存，调用时需持有 ino 的写锁（还没有加入目录的新 inode 除外）
+static int inode_write(uint32_t ino, const struct inode* inode) {
+    int block;
+    int ret = inode_block(ino, &block);
+    if (ret)
+        return ret;
+    struct cache_buf* buf = cache_get(block);
+    if (buf == NULL)
+        return -EIO;
+    memcpy(buf->data + ino % INODES_PER_BLOCK * INODE_SIZE, inode, INODE_SIZE);
+    journal_dirty(buf);
+    cache_put(buf);
+    struct inode_attr attr = inode_attr_of(inode);
+    attrcache_insert(ino, &attr);
+    return 0;
+}
+
+// 读出 ino 的属性，先查属性缓存，未命中时读 inode 并放入缓存，调用时需持有 ino 的锁
+static int inode_getattr(uint32_t ino, struct inode_attr* attr) {
+    if (attrcache_lookup(ino, attr))
+        return 0;
+    struct inode inode;
+    int ret = inode_read(ino, &inode);
+    if (ret)
+        return ret;
+    *attr = inode_attr_of(&inode);
+    attrcache_insert(ino, attr);
+    return 0;
+}
+
+// 只更新 inode 的 atime，用于读文件和目录
+//
+// 读者只持有 inode 的读锁，同一个 inode 的多个读者可能同时更新 atime，
+// 所以不能读出整个 inode 再写回，而是原子地写这一个字段。
+// 另一个读者可能刚刚读出旧的 atime、随后才把它填入属性缓存，所以缓存中的 atime 可能稍微落后
+//
+// 读不在日志操作中进行（否则每次读都要拿日志的锁、排在正在进行的提交后面，还要往事务中加一个 inode 表块），
+// 所以这里只把块标记为脏，不加入事务：块已经在当前事务中时随事务一起提交，不在时和数据块一样，
+// 在下一次提交、被淘汰或者卸载时写回原位置。不在事务中的块的其它内容都已经提交过了
+// （修改它们的操作会把块加入事务），所以直接写回原位置是安全的。
+// atime 不需要和其它元数据一起原子地生效，崩溃或者和提交同时进行时丢掉这一次更新也没有关系
+//
+// 只读挂载快照时不更新
+static int inode_set_atime(uint32_t ino, int64_t atime) {
+    if (readonly)
+        return 0;
+    struct cache_buf* buf = cache_get(INODE_TABLE_START + ino / INODES_PER_BLOCK);
+    if (buf == NULL)
+        return -EIO;
+    int64_t* field = (int64_t*)(buf->data + ino % INODES_PER_BLOCK * INODE_SIZE + offsetof(struct inode, atime));
+    __atomic_store_n(field, atime, __ATOMIC_RELAXED);
+    cache_dirty(buf);
+    cache_put(buf);
+    attrcache_set_atime(ino, atime);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// extent 树
+// ---------------------------------------------------------------------------
+
+// extent 树中存放 lblk 所在 extent 的那一层：inode 自身，或者某个叶子块
+struct extent_leaf {
+    struct cache_buf* buf;  // 为 NULL 表示 extent 直接存放在 inode 中
+    struct extent* extents;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t index;  // 叶子在 inode 索引中的位置
+    uint32_t end;  // 该叶子负责的逻辑块区间的终点（下一个叶子的起点）
+};
+
+// 映射的版本号，任何文件的映射改变（填上空洞或释放块）时增加，句柄中缓存的映射据此判断是否还有效
+static uint64_t extent_version;
+
+static void extent_changed(void) {
+    __atomic_add_fetch(&extent_version, 1, __ATOMIC_RELAXED);
+}
+
+// 取出句柄中上一次读写时查到的映射，没有句柄或者映射已经失效时长度为 0
+static void cursor_load(struct handle* h, struct handle_cursor* run) {
+    if (h == NULL || !handle_cursor_load(h, __atomic_load_n(&extent_version, __ATOMIC_RELAXED), run))
+        *run = (struct handle_cursor){0};
+}
+
+// 把这次读写最后查到的映射存回句柄，调用时持有 inode 的锁，所以这段映射现在一定有效
+static void cursor_save(struct handle* h, struct handle_cursor* run) {
+    if (h == NULL || run->len == 0)
+        return;
+    run->version = __atomic_load_n(&extent_version, __ATOMIC_RELAXED);
+    handle_cursor_save(h, run);
+}
+
+// extent 覆盖的逻辑块数
+static uint32_t extent_len(const struct extent* e) {
+    return e->len & EXTENT_LEN_MASK;
+}
+
+// 压缩的 extent 的物理位置（extent_lookup 返回的带 EXTENT_ZIP 的块号）中，第一个物理块和物理块数
+static uint32_t zip_start(uint32_t zip) {
+    return zip & EXTENT_LEN_MASK;
+}
+
+static uint32_t zip_blocks(uint32_t zip) {
+    return (zip & ~EXTENT_ZIP) >> EXTENT_ZIP_SHIFT;
+}
+
+// 找到 extents[0, count) 中最后一个 lblk 不大于 lblk 的位置，没有时返回 -1
+static int extent_search(const struct extent* extents, uint32_t count, uint32_t lblk) {
+    int lo = -1, hi = count;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (extents[mid].lblk <= lblk)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// 找到 lblk 所在的那一层，叶子块会被钉住，用完后调用 extent_leaf_put
+static int extent_leaf_get(struct inode* inode, uint32_t lblk, struct extent_leaf* leaf) {
+    if (inode->extent_depth == 0) {
+        *leaf = (struct extent_leaf){
+            .extents = inode->extents,
+            .count = inode->extent_count,
+            .capacity = INODE_EXTENTS,
+            .end = UINT32_MAX,
+        };
+        return 0;
+    }
+    int i = extent_search(inode->extents, inode->extent_count, lblk);
+    i = max(i, 0);
+    struct cache_buf* buf = cache_get(inode->extents[i].pblk);
+    if (buf == NULL)
+        return -EIO;
+    *leaf = (struct extent_leaf){
+        .buf = buf,
+        .extents = (struct extent*)buf->data,
+        .count = inode->extents[i].len,
+        .capacity = LEAF_EXTENTS,
+        .index = i,
+        .end = i + 1 < inode->extent_count ? inode->extents[i + 1].lblk : UINT32_MAX,
+    };
+    return 0;
+}
+
+// 释放 extent_leaf_get 钉住的叶子，dirty 表示叶子被修改过，此时把新的数量和起点写回 inode
+static void extent_leaf_put(struct inode* inode, struct extent_leaf* leaf, bool dirty) {
+    if (leaf->buf == NULL) {
+        if (dirty)
+            inode->extent_count = leaf->count;
+        return;
+    }
+    if (dirty) {
+        struct extent* idx = &inode->extents[leaf->index];
+        idx->len = leaf->count;
+        if (leaf->count > 0)
+            idx->lblk = min(idx->lblk, leaf->extents[0].lblk);
+        journal_dirty(leaf->buf);
+    }
+    cache_put(leaf->buf);
+}
+
+// 查找 lblk 的映射：*pblk 为对应的物理块（0 表示空洞），*len 为从 lblk 开始映射连续（或空洞连续）的块数
+//
+// lblk 在压缩的组中时 *pblk 是整组的物理位置，带有 EXTENT_ZIP，*len 为组中剩下的逻辑块数
+static int extent_lookup(struct inode* inode, uint32_t lblk, uint32_t* pblk, uint32_t* len) {
+    struct extent_leaf leaf;
+    int ret = extent_leaf_get(inode, lblk, &leaf);
+    if (ret)
+        return ret;
+    int i = extent_search(leaf.extents, leaf.count, lblk);
+    const struct extent* e = i >= 0 ? &leaf.extents[i] : NULL;
+    if (e != NULL && lblk - e->lblk < extent_len(e)) {
+        *pblk = e->len & EXTENT_ZIP ? e->pblk | (e->len & ~EXTENT_LEN_MASK) : e->pblk + (lblk - e->lblk);
+        *len = extent_len(e) - (lblk - e->lblk);
+    } else {
+        uint32_t next = (uint32_t)(i + 1) < leaf.count ? leaf.extents[i + 1].lblk : leaf.end;
+        *pblk = 0;
+        *len = next - lblk;
+    }
+    extent_leaf_put(inode, &leaf, false);
+    return 0;
+}
+
+// extent 放满 inode 时，把它们搬到一个新的叶子块中，inode 改为存放索引
+static int extent_grow(struct inode* inode) {
+    uint32_t pblk, got;
+    int ret = block_alloc_run(0, 1, &pblk, &got);
+    if (ret)
+        return ret;
+    struct cache_buf* buf = cache_zero(pblk);
+    if (buf == NULL) {
+        block_free_run(pblk, 1);
+        return -EIO;
+    }
+    memcpy(buf->data, inode->extents, inode->extent_count * sizeof(struct extent));
+    journal_dirty(buf);
+    cache_put(buf);
+    inode->extents[0] = (struct extent){.lblk = inode->extents[0].lblk, .pblk = pblk, .len = inode->extent_count};
+    inode->extent_count = 1;
+    inode->extent_depth = 1;
+    inode->blocks++;
+    return 0;
+}
+
+// 把已满的第 index 个叶子分裂，pos 是接下来要插入的位置
+//
+// 插入位置在最后一个叶子末尾时（顺序追加），只把最后一个 extent 搬到新叶子，
+// 否则追加写出来的叶子都只有一半满，能表示的 extent 数量会少一半
+static int extent_split(struct inode* inode, uint32_t index, uint32_t pos) {
+    if (inode->extent_count == INODE_EXTENTS)
+        return -EFBIG;
+    uint32_t pblk, got;
+    int ret = block_alloc_run(0, 1, &pblk, &got);
+    if (ret)
+        return ret;
+    struct cache_buf* old_buf = cache_get(inode->extents[index].pblk);
+    struct cache_buf* new_buf = cache_zero(pblk);
+    if (old_buf == NULL || new_buf == NULL) {
+        if (old_buf != NULL)
+            cache_put(old_buf);
+        if (new_buf != NULL)
+            cache_put(new_buf);
+        block_free_run(pblk, 1);
+        return -EIO;
+    }
+    struct extent* extents = (struct extent*)old_buf->data;
+    bool append = index + 1 == inode->extent_count && pos == LEAF_EXTENTS;
+    uint32_t keep = append ? LEAF_EXTENTS - 1 : LEAF_EXTENTS / 2, moved = LEAF_EXTENTS - keep;
+    memcpy(new_buf->data, &extents[keep], moved * sizeof(struct extent));
+    memmove(&inode->extents[index + 2], &inode->extents[index + 1],
+            (inode->extent_count - index - 1) * sizeof(struct extent));
+    inode->extents[index + 1] = (struct extent){.lblk = extents[keep].lblk, .pblk = pblk, .len = moved};
+    inode->extents[index].len = keep;
+    inode->extent_count++;
+    inode->blocks++;
+    journal_dirty(old_buf);
+    journal_dirty(new_buf);
+    cache_put(old_buf);
+    cache_put(new_buf);
+    return 0;
+}
+
+// 把 [lblk, lblk + len) -> [pblk, pblk + len) 加入 extent 树，调用者需保证这段逻辑块原本是空洞
+//
+// 能和前后的 extent 接上时直接合并，所以顺序追加的文件不会增加 extent 的数量。
+// pblk 带有 EXTENT_ZIP 时加入的是一个压缩的组，它不和别的 extent 合并
+static int extent_insert(struct inode* inode, uint32_t lblk, uint32_t pblk, uint32_t len) {
+    extent_changed();
+    bool zip = pblk & EXTENT_ZIP;
+    if (zip) {
+        len |= pblk & ~EXTENT_LEN_MASK;
+        pblk = zip_start(pblk);
+    }
+    for (;;) {
+        struct extent_leaf leaf;
+        int ret = extent_leaf_get(inode, lblk, &leaf);
+        if (ret)
+            return ret;
+        struct extent* e = leaf.extents;
+        uint32_t n = leaf.count;
+        int i = extent_search(e, n, lblk);
+        bool merge_prev = !zip && i >= 0 && !(e[i].len & EXTENT_ZIP) && e[i].lblk + e[i].len == lblk &&
+                          e[i].pblk + e[i].len == pblk;
+        bool merge_next = !zip && (uint32_t)(i + 1) < n && !(e[i + 1].len & EXTENT_ZIP) && lblk + len == e[i + 1].lblk &&
+                          pblk + len == e[i + 1].pblk;
+        if (merge_prev && merge_next) {
+            e[i].len += len + e[i + 1].len;
+            memmove(&e[i + 1], &e[i + 2], (n - i - 2) * sizeof(struct extent));
+            leaf.count--;
+        } else if (merge_prev) {
+            e[i].len += len;
+        } else if (merge_next) {
+            e[i + 1] = (struct extent){.lblk = lblk, .pblk = pblk, .len = e[i + 1].len + len};
+        } else if (n < leaf.capacity) {
+            memmove(&e[i + 2], &e[i + 1], (n - i - 1) * sizeof(struct extent));
+            e[i + 1] = (struct extent){.lblk = lblk, .pblk = pblk, .len = len};
+            leaf.count++;
+        } else {
+            // 这一层满了，扩展或者分裂之后重试
+            uint32_t index = leaf.index;
+            extent_leaf_put(inode, &leaf, false);
+            if ((ret = inode->extent_depth == 0 ? extent_grow(inode) : extent_split(inode, index, i + 1)))
+                return ret;
+            continue;
+        }
+        extent_leaf_put(inode, &leaf, true);
+        return 0;
+    }
+}
+
+// 把 [lblk, lblk + len) 从 extent 树中去掉（变为空洞），不释放块，这段逻辑块必须在同一个 extent 中，
+// 压缩的组只能整个去掉
+//
+// 去掉 extent 的中间一段时它会分成两个，这一层满了就和 extent_insert 一样先扩展或者分裂
+static int extent_punch(struct inode* inode, uint32_t lblk, uint32_t len) {
+    extent_changed();
+    for (;;) {
+        struct extent_leaf leaf;
+        int ret = extent_leaf_get(inode, lblk, &leaf);
+        if (ret)
+            return ret;
+        struct extent* e = leaf.extents;
+        uint32_t n = leaf.count;
+        int i = extent_search(e, n, lblk);
+        uint32_t head = i >= 0 ? lblk - e[i].lblk : 0, tail = i >= 0 ? e[i].lblk + extent_len(&e[i]) - (lblk + len) : 0;
+        if (i < 0 || lblk + len > e[i].lblk + extent_len(&e[i]) || ((e[i].len & EXTENT_ZIP) && (head || tail))) {
+            extent_leaf_put(inode, &leaf, false);
+            return -EIO;
+        }
+        if (head > 0 && tail > 0 && n == leaf.capacity) {
+            uint32_t index = leaf.index;
+            extent_leaf_put(inode, &leaf, false);
+            if ((ret = inode->extent_depth == 0 ? extent_grow(inode) : extent_split(inode, index, i + 1)))
+                return ret;
+            continue;
+        }
+        if (head == 0 && tail == 0) {
+            memmove(&e[i], &e[i + 1], (n - i - 1) * sizeof(struct extent));
+            leaf.count--;
+        } else if (head == 0) {
+            e[i] = (struct extent){.lblk = lblk + len, .pblk = e[i].pblk + len, .len = tail};
+        } else if (tail == 0) {
+            e[i].len = head;
+        } else {
+            memmove(&e[i + 2], &e[i + 1], (n - i - 1) * sizeof(struct extent));
+            e[i + 1] = (struct extent){.lblk = lblk + len, .pblk = e[i].pblk + head + len, .len = tail};
+            e[i].len = head;
+            leaf.count++;
+        }
+        extent_leaf_put(inode, &leaf, true);
+        return 0;
+    }
+}
+
+// 把正好是一个 extent 的 [lblk, lblk + len) 改为映射到 [pblk, pblk + len)，用于碎片整理搬动块
+//
+// 只改这一项，能和前一个 extent 接上时合并进去，不需要新的空间，所以只会在修改之前出错，
+// 不会像先 extent_punch 再 extent_insert 那样在中间失败、留下一个空洞
+static int extent_remap(struct inode* inode, uint32_t lblk, uint32_t len, uint32_t pblk) {
+    extent_changed();
+    struct extent_leaf leaf;
+    int ret = extent_leaf_get(inode, lblk, &leaf);
+    if (ret)
+        return ret;
+    struct extent* e = leaf.extents;
+    int i = extent_search(e, leaf.count, lblk);
+    if (i < 0 || e[i].lblk != lblk || e[i].len != len) {
+        extent_leaf_put(inode, &leaf, false);
+        return -EIO;
+    }
+    if (i > 0 && !(e[i - 1].len & EXTENT_ZIP) && e[i - 1].lblk + e[i - 1].len == lblk &&
+        e[i - 1].pblk + e[i - 1].len == pblk) {
+        e[i - 1].len += len;
+        memmove(&e[i], &e[i + 1], (leaf.count - i - 1) * sizeof(struct extent));
+        leaf.count--;
+    } else {
+        e[i].pblk = pblk;
+    }
+    extent_leaf_put(inode, &leaf, true);
+    return 0;
+}
+
+// 放掉一个压缩的组占用的块（zip 为 extent_lookup 查到的物理位置）
+static int zip_free(uint32_t zip) {
+    uint32_t run;
+    // 还被快照或者别的文件共享时块没有真正释放，省下的空间也还在
+    int ret = refcount_shared(zip_start(zip), zip_blocks(zip), &run);
+    if (ret < 0)
+        return ret;
+    if (ret == 0)
+        __atomic_sub_fetch(&sb.zip_saved, COMPRESS_CLUSTER - zip_blocks(zip), __ATOMIC_RELAXED);
+    return block_release_run(zip_start(zip), zip_blocks(zip));
+}
+
+// 截断时一次至多释放的块数。共享和不共享的块交错时每一块都可能单独占延迟释放的区间表中的一项，
+// 每释放一次就检查区间是否够多了（见 journal_free_full），这样停下之前至多再多占这么多项
+#define TRUNCATE_PIECE 32
+
+// 释放一层中逻辑块号不小于 from 的所有块，*count 随之减少
+//
+// 从后往前一次释放一个压缩的组或者至多 TRUNCATE_PIECE 块，延迟释放的区间够多时停下并返回 1，
+// 这时剩下的 extent 仍然是完整的，文件大小也缩到剩下的块为止，见 inode_truncate_slice。
+// 压缩的组总是整个释放，截断到组的中间之前要先解压（见 do_truncate）
+static int extent_truncate_leaf(struct inode* inode, struct extent* e, uint32_t* count, uint32_t from) {
+    int ret = 0;
+    while (*count > 0 && ret == 0) {
+        struct extent* last = &e[*count - 1];
+        if ((uint64_t)last->lblk + extent_len(last) <= from)
+            break;
+        uint64_t end = last->lblk;  // 释放之后这个位置往后都没有块了
+        if (last->len & EXTENT_ZIP) {
+            uint32_t zip = last->pblk | (last->len & ~EXTENT_LEN_MASK);
+            ret = zip_free(zip);
+            inode->blocks -= zip_blocks(zip);
+            (*count)--;
+        } else {
+            uint32_t keep = last->lblk >= from ? 0 : from - last->lblk;
+            uint32_t n = min(last->len - keep, TRUNCATE_PIECE);
+            // 目录块和文件的数据块都要等事务提交后才能真正释放，见 block_release_run
+            ret = block_release_run(last->pblk + last->len - n, n);
+            inode->blocks -= n;
+            last->len -= n;
+            end += last->len;
+            if (last->len == 0)
+                (*count)--;
+        }
+        if (ret == 0 && journal_free_full()) {
+            inode->size = min(inode->size, end * BLOCK_SIZE);
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+// 释放 inode 中逻辑块号不小于 from 的所有块，只需要访问被删除的 extent，和文件大小无关
+//
+// 当前事务延迟释放的区间够多时释放了一部分就返回 1，这时 inode 仍然是完整的，只是少了末尾的一些块，
+// 还要在新的日志操作中接着释放，见 inode_truncate_slice
+static int inode_truncate_blocks(struct inode* inode, uint64_t from) {
+    if (from >= MAX_FILE_BLOCKS || (inode->flags & INODE_INLINE))
+        return 0;
+    extent_changed();
+    if (inode->extent_depth == 0) {
+        uint32_t count = inode->extent_count;
+        int ret = extent_truncate_leaf(inode, inode->extents, &count, from);
+        inode->extent_count = count;
+        return ret;
+    }
+    int ret = 0;
+    while (inode->extent_count > 0 && ret == 0) {
+        uint32_t index = inode->extent_count - 1;
+        struct extent* idx = &inode->extents[index];
+        struct cache_buf* buf = cache_get(idx->pblk);
+        if (buf == NULL)
+            return -EIO;
+        ret = extent_truncate_leaf(inode, (struct extent*)buf->data, &idx->len, from);
+        journal_dirty(buf);
+        cache_put(buf);
+        if (ret < 0 || idx->len > 0)
+            break;
+        // 叶子空了，连同叶子块一起释放；这一段已经够了（ret 为 1）时也一样，不留下空的叶子
+        int err = journal_free(idx->pblk, 1);
+        inode->blocks--;
+        inode->extent_count--;
+        if (err)
+            ret = err;
+    }
+    if (ret < 0)
+        return ret;
+
+    // 只剩一个叶子且放得进 inode 时，退回到一层
+    if (inode->extent_count == 0) {
+        inode->extent_depth = 0;
+    } else if (inode->extent_count == 1 && inode->extents[0].len <= INODE_EXTENTS) {
+        uint32_t leaf = inode->extents[0].pblk, count = inode->extents[0].len;
+        struct cache_buf* buf = cache_get(leaf);
+        if (buf == NULL)
+            return -EIO;
+        memcpy(inode->extents, buf->data, count * sizeof(struct extent));
+        cache_put(buf);
+        inode->extent_count = count;
+        inode->extent_depth = 0;
+        inode->blocks--;
+        int err = journal_free(leaf, 1);
+        if (err)
+            ret = err;
+    }
+    return ret;
+}
+
+// 释放 ino 中逻辑块号不小于 from 的块。一个日志操作放不下时（见 inode_truncate_blocks）写回已经释放的部分并返回 1，
+// 调用者结束这个操作、放掉所有的锁，用 journal_restart 等事务提交之后从头再来一次（像 ext4 的截断一样）。
+// 中间崩溃时文件只是少了末尾的一些块，大小也随之缩小
+static int inode_truncate_slice(uint32_t ino, struct inode* inode, uint64_t from) {
+    int ret = inode_truncate_blocks(inode, from);
+    if (ret == 1 && (ret = inode_write(ino, inode)) == 0)
+        return 1;
+    return ret;
+}
+
+// 把块 [src, src + n) 的内容复制到 [dst, dst + n)，目标是新分配的块，和数据块一样写回
+static int block_copy(uint32_t src, uint32_t dst, uint32_t n) {
+    for (uint32_t i = 0; i < n; ++i) {
+        struct cache_buf* from = cache_get(src + i);
+        if (from == NULL)
+            return -EIO;
+        struct cache_buf* to = cache_zero(dst + i);
+        if (to != NULL) {
+            memcpy(to->data, from->data, BLOCK_SIZE);
+            cache_dirty(to);
+            cache_put(to);
+        }
+        cache_put(from);
+        if (to == NULL)
+            return -EIO;
+    }
+    return 0;
+}
+
+// 逻辑块 [lblk, lblk + n) 映射到的物理块 [old, old + n) 是共享的，写之前先复制（copy-on-write）：
+// 分配新的块，复制内容，改为映射到新块，放掉旧块的引用。*pblk 为新块，*len 为复制的块数（可能少于 n）
+//
+// 别的拥有者可能同时也在复制这些块，放掉引用时如果已经没有别人了，旧块在事务提交时释放，见 block_release_run
+static int inode_cow(struct inode* inode, uint32_t lblk, uint32_t old, uint32_t n, uint32_t* pblk, uint32_t* len) {
+    int ret = block_alloc_run(old, n, pblk, len);
+    if (ret)
+        return ret;
+    if ((ret = block_copy(old, *pblk, *len)) == 0 && (ret = extent_punch(inode, lblk, *len)) == 0 &&
+        (ret = extent_insert(inode, lblk, *pblk, *len)) != 0)
+        extent_insert(inode, lblk, old, *len);
+    if (ret) {
+        block_free_run(*pblk, *len);
+        return ret;
+    }
+    return block_release_run(old, *len);
+}
+
+// 分配 lblk 的数据块时的起点：紧跟着前一个逻辑块的物理位置，保持文件连续
+static int alloc_goal(struct inode* inode, uint32_t lblk, uint32_t* goal) {
+    uint32_t prev, len;
+    *goal = 0;
+    int ret = lblk > 0 ? extent_lookup(inode, lblk - 1, &prev, &len) : 0;
+    if (ret == 0 && lblk > 0 && prev != 0)
+        *goal = prev & EXTENT_ZIP ? zip_start(prev) + zip_blocks(prev) : prev + 1;
+    return ret;
+}
+
+// 把 data 写入新分配的块 [pblk, pblk + n)，不足一块的部分补 0
+static int block_write_new(uint32_t pblk, uint32_t n, const uint8_t* data, size_t size) {
+    for (uint32_t i = 0; i < n; ++i) {
+        struct cache_buf* buf = cache_zero(pblk + i);
+        if (buf == NULL)
+            return -EIO;
+        if ((size_t)i * BLOCK_SIZE < size)
+            memcpy(buf->data, data + (size_t)i * BLOCK_SIZE, min(BLOCK_SIZE, size - (size_t)i * BLOCK_SIZE));
+        cache_dirty(buf);
+        cache_put(buf);
+    }
+    return 0;
+}
+
+// 压缩的组在磁盘上的格式：第一个物理块开头是压缩后的长度，接着是 LZ4 的数据（见 compress.h）
+#define ZIP_HEADER sizeof(uint32_t)
+#define ZIP_MAX_BLOCKS (COMPRESS_CLUSTER - 1)  // 至少省下一个块才压缩
+
+// 读写压缩的组时用的缓冲区，放得下解压后的一组，也放得下压缩后的数据。
+// 放在栈上时每个读写压缩的组的线程都要多用 16KB 的栈，所以全局只有一个，用 lock 互斥。
+// 持有 lock 时可以钉住缓存块，但等它时不能钉住缓存块（句柄留住的块除外，见 cache.h），所以不会和缓存互相等待；
+// 它总是在 inode 的锁之后加，持有它时不再等别的锁
+static struct {
+    pthread_mutex_t lock;
+    uint8_t data[COMPRESS_INPLACE_SIZE];
+} zip_buf = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// 读出压缩的组 zip（extent_lookup 查到的物理位置）并解压到 data 的前 COMPRESS_CLUSTER_SIZE 字节中。
+// 压缩的数据先拷贝到 data 的末尾再原地解压（见 compress.h），不需要另外的缓冲区。data 是 zip_buf.data，调用时持有它的锁
+static int zip_read(uint32_t zip, uint8_t data[COMPRESS_INPLACE_SIZE]) {
+    uint32_t start = zip_start(zip), n = zip_blocks(zip), size = 0;
+    uint8_t* packed = NULL;  // 组的第一个块放在这里，压缩的数据正好在 data 的末尾结束
+    if (n == 0 || n > ZIP_MAX_BLOCKS)
+        return -EIO;
+    cache_prefetch_run(start, n);
+    for (uint32_t i = 0; i < n; ++i) {
+        struct cache_buf* buf = cache_get(start + i);
+        if (buf == NULL)
+            return -EIO;
+        if (i == 0) {
+            memcpy(&size, buf->data, ZIP_HEADER);
+            if (size > n * BLOCK_SIZE - ZIP_HEADER) {
+                cache_put(buf);
+                fs_error("zip_read: corrupted cluster at block %u\n", start);
+                return -EIO;
+            }
+            packed = data + COMPRESS_INPLACE_SIZE - (ZIP_HEADER + size);
+        }
+        // 第 i 块中属于压缩的数据的部分
+        size_t from = max(i * BLOCK_SIZE, ZIP_HEADER), to = min((i + 1) * BLOCK_SIZE, ZIP_HEADER + size);
+        if (from < to)
+            memcpy(packed + from, buf->data + from - i * BLOCK_SIZE, to - from);
+        cache_put(buf);
+    }
+    if (compress_unpack(packed + ZIP_HEADER, size, data, COMPRESS_CLUSTER_SIZE) != COMPRESS_CLUSTER_SIZE) {
+        fs_error("zip_read: corrupted cluster at block %u\n", start);
+        return -EIO;
+    }
+    return 0;
+}
+
+// 把 [lblk, lblk + n) 变为空洞并放掉原来的块，其中的压缩的组必须整个在这段中
+//
+// 放掉的块可能被 ino 的句柄留住（见 handle_hold），先让句柄放掉它们
+static int inode_unmap(uint32_t ino, struct inode* inode, uint32_t lblk, uint32_t n) {
+    bool dropped = false;
+    for (uint32_t end = lblk + n; lblk < end;) {
+        uint32_t pblk, len;
+        int ret = extent_lookup(inode, lblk, &pblk, &len);
+        if (ret)
+            return ret;
+        len = min(len, end - lblk);
+        if (pblk != 0 && !dropped) {
+            handle_drop(ino);
+            dropped = true;
+        }
+        if (pblk != 0 && (ret = extent_punch(inode, lblk, len)) == 0) {
+            ret = pblk & EXTENT_ZIP ? zip_free(pblk) : block_release_run(pblk, len);
+            inode->blocks -= pblk & EXTENT_ZIP ? zip_blocks(pblk) : len;
+        }
+        if (ret)
+            return ret;
+        lblk += len;
+    }
+    return 0;
+}
+
+// 改写压缩的组中的块之前先解压：分配 COMPRESS_CLUSTER 个新块写入解压后的内容，改为普通的映射，
+// 再放掉压缩的块（它们可能还被快照共享）。zip 是 lblk 所在的组的物理位置
+static int inode_unzip(struct inode* inode, uint32_t lblk, uint32_t zip) {
+    uint32_t first = lblk - lblk % COMPRESS_CLUSTER, pblks[COMPRESS_CLUSTER], lens[COMPRESS_CLUSTER], goal, done = 0;
+    int n = 0, ret = alloc_goal(inode, first, &goal);
+    if (ret)
+        return ret;
+    pthread_mutex_lock(&zip_buf.lock);
+    ret = zip_read(zip, zip_buf.data);
+    // 先分配并写好所有的块，空间不足时组保持不变
+    while (ret == 0 && done < COMPRESS_CLUSTER) {
+        if ((ret = block_alloc_run(goal, COMPRESS_CLUSTER - done, &pblks[n], &lens[n])))
+            break;
+        ret = block_write_new(pblks[n], lens[n], zip_buf.data + done * BLOCK_SIZE,
+                              (COMPRESS_CLUSTER - done) * BLOCK_SIZE);
+        goal = pblks[n] + lens[n];
+        done += lens[n++];
+    }
+    pthread_mutex_unlock(&zip_buf.lock);
+    int inserted = 0;
+    if (ret == 0 && (ret = extent_punch(inode, first, COMPRESS_CLUSTER)) == 0) {
+        for (done = 0; inserted < n; done += lens[inserted++]) {
+            if ((ret = extent_insert(inode, first + done, pblks[inserted], lens[inserted])))
+                break;
+        }
+        if (ret == 0) {
+            inode->blocks += COMPRESS_CLUSTER - zip_blocks(zip);
+            return zip_free(zip);
+        }
+        // extent 树放不下了，尽量恢复原来的映射
+        for (int i = 0, off = 0; i < inserted; off += lens[i++])
+            extent_punch(inode, first + off, lens[i]);
+        extent_insert(inode, first, zip, COMPRESS_CLUSTER);
+    }
+    for (int i = 0; i < n; ++i)
+        block_free_run(pblks[i], lens[i]);
+    return ret;
+}
+
+// 为写入准备 lblk 开始的映射：已经映射时返回对应的物理块和映射连续的块数，
+// 压缩的组先解压（见 inode_unzip），共享的块先复制一份（见 inode_cow），返回的块总是可以直接覆盖；
+// 是空洞时分配至多 want 个连续的块，*fresh 为真，新块的旧内容没有意义，调用者不需要从磁盘读
+//
+// owner 不是 ALLOC_NO_OWNER 时（文件的写入）分配时使用并重新预留 owner 的窗口（见 alloc.h），
+// 窗口至少 options.reserve 块，文件越大窗口越大。交替追加的几个文件各自保持连续，之后读的时候也是连续的
+static int inode_map_write(struct inode* inode, uint32_t owner, uint32_t lblk, uint32_t want, uint32_t* pblk,
+                           uint32_t* len, bool* fresh) {
+    int ret = extent_lookup(inode, lblk, pblk, len);
+    *fresh = false;
+    if (ret == 0 && (*pblk & EXTENT_ZIP) && (ret = inode_unzip(inode, lblk, *pblk)) == 0)
+        ret = extent_lookup(inode, lblk, pblk, len);
+    if (ret)
+        return ret;
+    if (*pblk != 0) {
+        // 目录块和叶子块不会共享，只有文件的数据块需要检查。
+        // 先把要写的块从去重索引中去掉，之后别的线程不会再共享它们，检查的结果一直有效
+        uint32_t run;
+        if (S_ISREG(inode->mode) && dedupe_enabled()) {
+            *len = min(*len, want);
+            dedupe_forget(*pblk, *len);
+        }
+        if (!S_ISREG(inode->mode) || (ret = refcount_shared(*pblk, *len, &run)) == 0) {
+            if (S_ISREG(inode->mode))
+                *len = run;
+            return 0;
+        }
+        if (ret < 0)
+            return ret;
+        return inode_cow(inode, lblk, *pblk, min(want, run), pblk, len);
+    }
+    uint32_t goal;
+    if ((ret = alloc_goal(inode, lblk, &goal)))
+        return ret;
+    want = min(want, *len);
+    if (owner != ALLOC_NO_OWNER && options.reserve > 0)
+        ret = alloc_range_owned(&block_bitmap, owner, max(inode->blocks, options.reserve), goal, want, pblk, len);
+    else
+        ret = block_alloc_run(goal, want, pblk, len);
+    if (ret)
+        return ret;
+    if ((ret = extent_insert(inode, lblk, *pblk, *len))) {
+        block_free_run(*pblk, *len);
+        return ret;
+    }
+    inode->blocks += *len;
+    *fresh = true;
+    return 0;
+}
+
+// 把一整组逻辑块 [lblk, lblk + COMPRESS_CLUSTER) 的新内容 data 压缩后写入（lblk 按组对齐）：
+// 至少能省下一个块时分配压缩后需要的块，原来的映射全部放掉，返回 1；
+// 压缩不下、或者分配不到连续的块时返回 0，调用者照常写入
+static int inode_write_zipped(uint32_t ino, struct inode* inode, uint32_t lblk, const uint8_t* data) {
+    uint32_t goal, pblk, got = 0;
+    int ret = alloc_goal(inode, lblk, &goal);
+    if (ret)
+        return ret;
+    // 压缩后的数据放在 zip_buf 中，写进新分配的块之后就不再需要了
+    pthread_mutex_lock(&zip_buf.lock);
+    uint8_t* packed = zip_buf.data;
+    uint32_t size =
+        compress_pack(data, COMPRESS_CLUSTER_SIZE, packed + ZIP_HEADER, ZIP_MAX_BLOCKS * BLOCK_SIZE - ZIP_HEADER);
+    uint32_t n = ceil_div(ZIP_HEADER + size, BLOCK_SIZE);
+    memcpy(packed, &size, ZIP_HEADER);
+    if (size > 0 && (ret = block_alloc_run(goal, n, &pblk, &got)) == 0 && got == n)
+        ret = block_write_new(pblk, n, packed, ZIP_HEADER + size);
+    pthread_mutex_unlock(&zip_buf.lock);
+    if (size == 0 || ret == -ENOSPC)
+        return 0;
+    uint32_t zip = pblk | EXTENT_ZIP | n << EXTENT_ZIP_SHIFT;
+    if (ret || got < n || (ret = inode_unmap(ino, inode, lblk, COMPRESS_CLUSTER))) {
+        if (got > 0)
+            block_free_run(pblk, got);
+        return ret;
+    }
+    // extent 树放不下时这一组已经是空洞了，由调用者照常写入
+    if (extent_insert(inode, lblk, zip, COMPRESS_CLUSTER)) {
+        block_free_run(pblk, n);
+        return 0;
+    }
+    inode->blocks += n;
+    __atomic_add_fetch(&sb.zip_saved, COMPRESS_CLUSTER - n, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// 逻辑块 lblk 的新内容是一整块 data，哈希为 hash：在去重索引中找到内容相同的块时改为共享它，返回 1；
+// 找不到时返回 0，调用者照常写入，写完后把块记入索引（见 dedupe_insert）
+static int inode_write_deduped(uint32_t ino, struct inode* inode, uint32_t lblk, const uint8_t* data, uint64_t hash) {
+    uint32_t cur, len, block;
+    int ret = extent_lookup(inode, lblk, &cur, &len);
+    // 压缩的组中的块照常写入，写之前会先解压
+    if (ret || (cur & EXTENT_ZIP) || (ret = dedupe_find(hash, data, cur, &block)) <= 0)
+        return ret;
+    // 写入的内容和原来一样
+    if (block == cur)
+        return 1;
+    if ((ret = inode_unmap(ino, inode, lblk, 1)) || extent_insert(inode, lblk, block, 1)) {
+        block_free_run(block, 1);
+        return ret;
+    }
+    inode->blocks++;
+    return 1;
+}
+
+// 找到第 lblk 个逻辑块对应的物理块号，alloc 为真时按需分配一个清零的块
+//
+// *pblk 为 0 表示该逻辑块是空洞，读出来应该全是 0
+static int inode_bmap(struct inode* inode, uint32_t lblk, bool alloc, uint32_t* pblk) {
+    uint32_t len;
+    bool fresh;
+    if (!alloc)
+        return extent_lookup(inode, lblk, pblk, &len);
+    int ret = inode_map_write(inode, ALLOC_NO_OWNER, lblk, 1, pblk, &len, &fresh);
+    if (ret || !fresh)
+        return ret;
+    struct cache_buf* buf = cache_zero(*pblk);
+    if (buf == NULL)
+        return -EIO;
+    cache_put(buf);
+    return 0;
+}
+
+// 内联的文件要超出 INODE_INLINE_SIZE 了，把内容搬到第 0 块中，改为普通的块映射
+static int inode_uninline(struct inode* inode) {
+    uint8_t data[INODE_INLINE_SIZE];
+    memcpy(data, inode->inline_data, sizeof(data));
+    memset(inode->extents, 0, sizeof(inode->extents));
+    inode->flags &= ~INODE_INLINE;
+    // 内容全是 0（比如只用 truncate 改过大小）时不需要数据块，整个文件都是空洞
+    size_t used = inode->size;
+    while (used > 0 && data[used - 1] == 0)
+        used--;
+    if (used == 0)
+        return 0;
+    uint32_t pblk, len;
+    bool fresh;
+    int ret = inode_map_write(inode, ALLOC_NO_OWNER, 0, 1, &pblk, &len, &fresh);
+    if (ret) {
+        // 没有空间时保持内联
+        memcpy(inode->inline_data, data, sizeof(data));
+        inode->flags |= INODE_INLINE;
+        return ret;
+    }
+    struct cache_buf* buf = cache_zero(pblk);
+    if (buf == NULL)
+        return -EIO;
+    memcpy(buf->data, data, used);
+    cache_dirty(buf);
+    cache_put(buf);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// 目录
+// ---------------------------------------------------------------------------
+
+// 目录的组织方式：
+//
+// 目录项不多时，目录只有第 0 块，里面是无序的目录项（线性目录）。
+// 第 0 块写满后，目录转为哈希索引（DIR_INDEXED）：第 0 块变为索引块，目录项按名字的哈希值
+// 分到各个叶子块中，索引块按哈希值从小到大记录每个叶子块负责的哈希区间的起点。
+// 查找时二分索引块找到叶子，只需要扫描一个叶子块；叶子写满时按哈希值对半分裂。
+//
+// 同一个哈希值的目录项总在同一个叶子里，所以分裂只发生在哈希值变化的地方
+struct dir_index_entry {
+    uint32_t hash;  // 该叶子负责的哈希区间的起点，第一项总是 0
+    uint32_t lblk;  // 叶子块在目录中的逻辑块号
+};
+
+#define DIR_INDEX_MAX ((BLOCK_SIZE - 2 * sizeof(uint32_t)) / sizeof(struct dir_index_entry))
+
+struct dir_index {
+    uint32_t count;
+    uint32_t reserved;
+    struct dir_index_entry entries[DIR_INDEX_MAX];
+};
+static_assert(sizeof(struct dir_index) <= BLOCK_SIZE, "dir index too large");
+
+// FNV-1a
+static uint32_t name_hash(const char* name) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < NAME_MAX_LEN && name[i] != '\0'; ++i)
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    return h;
+}
+
+static bool dirent_match(const struct dirent* de, const char* name, uint32_t hash) {
+    return de->name[0] != '\0' && de->hash == hash && strncmp(de->name, name, NAME_MAX_LEN) == 0;
+}
+
+static void dirent_set(struct dirent* de, const char* name, uint32_t hash, uint32_t ino) {
+    memset(de, 0, sizeof(*de));
+    memcpy(de->name, name, strnlen(name, NAME_MAX_LEN));
+    de->hash = hash;
+    de->ino = ino;
+}
+
+// 在索引中找到负责 hash 的叶子，即最后一个起点不大于 hash 的项
+static uint32_t dir_index_search(const struct dir_index* index, uint32_t hash) {
+    uint32_t lo = 0, hi = index->count;
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+        if (index->entries[mid].hash <= hash)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// 找到名字哈希为 hash 的目录项应该在的叶子块，*pos 返回叶子在索引中的位置（线性目录为 0）
+static int dir_leaf(struct inode* dir, uint32_t hash, uint32_t* pblk, uint32_t* pos) {
+    int ret = inode_bmap(dir, 0, false, pblk);
+    *pos = 0;
+    if (ret || !(dir->flags & INODE_DIR_INDEXED))
+        return ret;
+    struct cache_buf* buf = cache_get(*pblk);
+    if (buf == NULL)
+        return -EIO;
+    struct dir_index* index = (struct dir_index*)buf->data;
+    *pos = dir_index_search(index, hash);
+    uint32_t lblk = index->entries[*pos].lblk;
+    cache_put(buf);
+    return inode_bmap(dir, lblk, false, pblk);
+}
+
+// 在叶子块 pblk 中查找 name，找到时返回钉住的块，*slot 为目录项的下标；找不到时返回 NULL 且 *ret 为 -ENOENT
+static struct cache_buf* dir_leaf_find(uint32_t pblk, const char* name, uint32_t hash, uint32_t* slot, int* ret) {
+    struct cache_buf* buf = cache_get(pblk);
+    if (buf == NULL) {
+        *ret = -EIO;
+        return NULL;
+    }
+    struct dirent* entries = (struct dirent*)buf->data;
+    for (uint32_t i = 0; i < DIRENTS_PER_BLOCK; ++i) {
+        if (dirent_match(&entries[i], name, hash)) {
+            *slot = i;
+            *ret = 0;
+            return buf;
+        }
+    }
+    cache_put(buf);
+    *ret = -ENOENT;
+    return NULL;
+}
+
+// 目录中的位置：第 leaf 个叶子（按索引中的顺序，线性目录只有第 0 个）中的第 slot 个目录项
+struct dir_pos {
+    uint32_t leaf;
+    uint32_t slot;
+};
+
+// 从 *pos 开始，依次对目录中每个叶子块里的每个目录项（包括空闲的）调用 fn，直到 fn 返回 DIR_STOP
+//
+// 调用 fn 前 *pos 被设为当前目录项的位置，被中止时 *pos 停在中止的那一项上，
+// 所以可以从 *pos 接着遍历
+//
+// 返回 1 表示被 fn 中止，0 表示遍历完成，负数表示出错
+#define DIR_CONTINUE 0
+#define DIR_STOP 1
+#define DIR_DIRTY 2  // 回调修改了目录项，需要写回
+
+typedef int (*dirent_fn)(struct dirent* de, void* arg);
+
+static int dir_iterate_leaf(uint32_t pblk, struct dir_pos* pos, dirent_fn fn, void* arg) {
+    struct cache_buf* buf = cache_get(pblk);
+    if (buf == NULL)
+        return -EIO;
+    struct dirent* entries = (struct dirent*)buf->data;
+    int ret = 0;
+    for (; pos->slot < DIRENTS_PER_BLOCK; ++pos->slot) {
+        int action = fn(&entries[pos->slot], arg);
+        if (action & DIR_DIRTY)
+            journal_dirty(buf);
+        if (action & DIR_STOP) {
+            ret = 1;
+            break;
+        }
+    }
+    cache_put(buf);
+    return ret;
+}
+
+static int dir_iterate(struct inode* dir, struct dir_pos* pos, dirent_fn fn, void* arg) {
+    uint32_t pblk;
+    int ret;
+    if (dir->size == 0)
+        return 0;
+    if ((ret = inode_bmap(dir, 0, false, &pblk)))
+        return ret;
+    if (!(dir->flags & INODE_DIR_INDEXED))
+        return pos->leaf == 0 ? dir_iterate_leaf(pblk, pos, fn, arg) : 0;
+
+    // 每个叶子都重新读一次索引块，遍历叶子时不钉住索引块，
+    // 这样读目录的操作同时只钉住一个缓存块，不会因为缓存块被钉光而等待
+    for (; ret == 0; pos->leaf++, pos->slot = 0) {
+        struct cache_buf* buf = cache_get(pblk);
+        if (buf == NULL)
+            return -EIO;
+        struct dir_index* index = (struct dir_index*)buf->data;
+        bool done = pos->leaf >= index->count;
+        uint32_t lblk = done ? 0 : index->entries[pos->leaf].lblk, leaf;
+        cache_put(buf);
+        if (done)
+            break;
+        if ((ret = inode_bmap(dir, lblk, false, &leaf)) == 0 && (ret = dir_iterate_leaf(leaf, pos, fn, arg)) == 1)
+            break;
+    }
+    return ret;
+}
+
+// 在目录 dir 中查找名为 name 的条目，找不到时返回 -ENOENT
+static int dir_find(struct inode* dir, const char* name, uint32_t* ino) {
+    if (dir->size == 0)
+        return -ENOENT;
+    uint32_t hash = name_hash(name), pblk, pos, slot;
+    int ret = dir_leaf(dir, hash, &pblk, &pos);
+    if (ret)
+        return ret;
+    struct cache_buf* buf = dir_leaf_find(pblk, name, hash, &slot, &ret);
+    if (buf == NULL)
+        return ret;
+    *ino = ((struct dirent*)buf->data)[slot].ino;
+    cache_put(buf);
+    return 0;
+}
+
+// 在目录 dir_ino 中查找名为 name 的条目，*is_dir 返回它是不是目录（可以为 NULL）
+//
+// 先查目录项缓存，未命中时才扫描目录，并把结果（包括不存在）放入缓存
+static int dir_lookup(uint32_t dir_ino, const char* name, uint32_t* ino, bool* is_dir) {
+    if (strlen(name) > NAME_MAX_LEN)
+        return -ENAMETOOLONG;
+    uint32_t cached;
+    bool cached_dir;
+    if (dcache_lookup(dir_ino, name, &cached, &cached_dir)) {
+        if (cached == DCACHE_NEGATIVE)
+            return -ENOENT;
+        *ino = cached;
+        if (is_dir != NULL)
+            *is_dir = cached_dir;
+        return 0;
+    }
+    struct inode dir, inode;
+    int ret = inode_read(dir_ino, &dir);
+    if (ret)
+        return ret;
+    if ((ret = dir_find(&dir, name, ino)) == -ENOENT)
+        dcache_insert(dir_ino, name, DCACHE_NEGATIVE, false);
+    if (ret)
+        return ret;
+    // 只需要知道它是不是目录，inode 的类型不会改变，所以属性缓存中有就不用读 inode 了
+    struct inode_attr attr;
+    if (!attrcache_lookup(*ino, &attr)) {
+        if ((ret = inode_read(*ino, &inode)))
+            return ret;
+        attr.mode = inode.mode;
+    }
+    dcache_insert(dir_ino, name, *ino, S_ISDIR(attr.mode));
+    if (is_dir != NULL)
+        *is_dir = S_ISDIR(attr.mode);
+    return 0;
+}
+
+// 给目录追加一个空的块，返回其逻辑块号和物理块号
+static int dir_append_block(struct inode* dir, uint32_t* lblk, uint32_t* pblk) {
+    *lblk = dir->size / BLOCK_SIZE;
+    int ret = inode_bmap(dir, *lblk, true, pblk);
+    if (ret) {
+        // 可能已经分配了间接指针块，把它还回去
+        inode_truncate_blocks(dir, *lblk);
+        return ret;
+    }
+    dir->size += BLOCK_SIZE;
+    return 0;
+}
+
+// 把线性目录转为只有一个叶子的索引目录：第 0 块的内容搬到新的叶子块，第 0 块改写为索引
+static int dir_make_indexed(struct inode* dir) {
+    uint32_t root, lblk, pblk;
+    int ret = inode_bmap(dir, 0, false, &root);
+    if (ret || (ret = dir_append_block(dir, &lblk, &pblk)))
+        return ret;
+    struct cache_buf* root_buf = cache_get(root);
+    struct cache_buf* leaf_buf = cache_get(pblk);
+    if (root_buf == NULL || leaf_buf == NULL) {
+        ret = -EIO;
+        goto out;
+    }
+    memcpy(leaf_buf->data, root_buf->data, BLOCK_SIZE);
+    memset(root_buf->data, 0, BLOCK_SIZE);
+    struct dir_index* index = (struct dir_index*)root_buf->data;
+    index->count = 1;
+    index->entries[0] = (struct dir_index_entry){.hash = 0, .lblk = lblk};
+    journal_dirty(root_buf);
+    journal_dirty(leaf_buf);
+    dir->flags |= INODE_DIR_INDEXED;
+out:
+    if (root_buf != NULL)
+        cache_put(root_buf);
+    if (leaf_buf != NULL)
+        cache_put(leaf_buf);
+    return ret;
+}
+
+static int dirent_cmp(const void* a, const void* b) {
+    uint32_t x = ((const struct dirent*)a)->hash, y = ((const struct dirent*)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+// 把索引中第 pos 个叶子（已满）对半分裂，后一半搬到新的叶子块
+static int dir_split_leaf(struct inode* dir, uint32_t pos) {
+    uint32_t root, leaf, lblk, pblk;
+    int ret = inode_bmap(dir, 0, false, &root);
+    if (ret)
+        return ret;
+    struct cache_buf* root_buf = cache_get(root);
+    if (root_buf == NULL)
+        return -EIO;
+    struct dir_index* index = (struct dir_index*)root_buf->data;
+    struct cache_buf* old_buf = NULL;
+    struct cache_buf* new_buf = NULL;
+    if (index->count == DIR_INDEX_MAX) {
+        ret = -ENOSPC;
+        goto out;
+    }
+    if ((ret = inode_bmap(dir, index->entries[pos].lblk, false, &leaf)))
+        goto out;
+    if ((old_buf = cache_get(leaf)) == NULL) {
+        ret = -EIO;
+        goto out;
+    }
+
+    // 排序后从中间向两边找哈希值变化的位置作为分裂点
+    struct dirent* entries = (struct dirent*)old_buf->data;
+    qsort(entries, DIRENTS_PER_BLOCK, sizeof(struct dirent), dirent_cmp);
+    uint32_t split = 0;
+    for (uint32_t d = 0; d < DIRENTS_PER_BLOCK / 2 && split == 0; ++d) {
+        uint32_t hi = DIRENTS_PER_BLOCK / 2 + d, lo = DIRENTS_PER_BLOCK / 2 - d;
+        if (hi < DIRENTS_PER_BLOCK && entries[hi - 1].hash != entries[hi].hash)
+            split = hi;
+        else if (lo > 0 && entries[lo - 1].hash != entries[lo].hash)
+            split = lo;
+    }
+    if (split == 0) {
+        // 整个叶子的哈希值都相同，几乎不可能发生
+        ret = -ENOSPC;
+        journal_dirty(old_buf);
+        goto out;
+    }
+    if ((ret = dir_append_block(dir, &lblk, &pblk)))
+        goto out;
+    if ((new_buf = cache_get(pblk)) == NULL) {
+        ret = -EIO;
+        goto out;
+    }
+    uint32_t moved = DIRENTS_PER_BLOCK - split;
+    memmove(&index->entries[pos + 2], &index->entries[pos + 1],
+            (index->count - pos - 1) * sizeof(struct dir_index_entry));
+    index->entries[pos + 1] = (struct dir_index_entry){.hash = entries[split].hash, .lblk = lblk};
+    index->count++;
+    memcpy(new_buf->data, &entries[split], moved * sizeof(struct dirent));
+    memset(&entries[split], 0, moved * sizeof(struct dirent));
+    journal_dirty(root_buf);
+    journal_dirty(old_buf);
+    journal_dirty(new_buf);
+out:
+    cache_put(root_buf);
+    if (old_buf != NULL)
+        cache_put(old_buf);
+    if (new_buf != NULL)
+        cache_put(new_buf);
+    return ret;
+}
+
+// 在叶子块 pblk 中找一个空闲的目录项放入 name，叶子已满时返回 -ENOSPC
+static int dir_leaf_insert(uint32_t pblk, const char* name, uint32_t hash, uint32_t ino) {
+    struct cache_buf* buf = cache_get(pblk);
+    if (buf == NULL)
+        return -EIO;
+    struct dirent* entries = (struct dirent*)buf->data;
+    int ret = -ENOSPC;
+    for (uint32_t i = 0; i < DIRENTS_PER_BLOCK; ++i) {
+        if (entries[i].name[0] == '\0') {
+            dirent_set(&entries[i], name, hash, ino);
+            journal_dirty(buf);
+            ret = 0;
+            break;
+        }
+    }
+    cache_put(buf);
+    return ret;
+}
+
+// 在目录 dir_ino 中加入条目 name -> ino，调用者需保证 name 不存在
+static int dir_add(uint32_t dir_ino, const char* name, uint32_t ino) {
+    struct inode dir;
+    int ret = inode_read(dir_ino, &dir);
+    if (ret)
+        return ret;
+    uint32_t hash = name_hash(name), lblk, pblk, pos;
+    if (dir.size == 0 && (ret = dir_append_block(&dir, &lblk, &pblk)))
+        return ret;
+    // 叶子满了就分裂，分裂后两个叶子都至少有一个空位，所以最多尝试三次：
+    // 线性目录先转为索引目录，再分裂唯一的叶子
+    for (int i = 0;; ++i) {
+        if ((ret = dir_leaf(&dir, hash, &pblk, &pos)))
+            break;
+        if ((ret = dir_leaf_insert(pblk, name, hash, ino)) != -ENOSPC || i == 2)
+            break;
+        if (!(dir.flags & INODE_DIR_INDEXED))
+            ret = dir_make_indexed(&dir);
+        else
+            ret = dir_split_leaf(&dir, pos);
+        if (ret)
+            break;
+    }
+    int wret = inode_write(dir_ino, &dir);
+    return ret ? ret : wret;
+}
+
+// 找到目录 dir_ino 中的条目 name，ino 为 DCACHE_NEGATIVE 时删除它，否则把它改为指向 ino
+static int dir_set(uint32_t dir_ino, const char* name, uint32_t ino) {
+    struct inode dir;
+    int ret = inode_read(dir_ino, &dir);
+    if (ret)
+        return ret;
+    if (dir.size == 0)
+        return -ENOENT;
+    uint32_t hash = name_hash(name), pblk, pos, slot;
+    if ((ret = dir_leaf(&dir, hash, &pblk, &pos)))
+        return ret;
+    struct cache_buf* buf = dir_leaf_find(pblk, name, hash, &slot, &ret);
+    if (buf == NULL)
+        return ret;
+    struct dirent* de = &((struct dirent*)buf->data)[slot];
+    if (ino == DCACHE_NEGATIVE)
+        memset(de, 0, sizeof(*de));
+    else
+        de->ino = ino;
+    journal_dirty(buf);
+    cache_put(buf);
+    return 0;
+}
+
+// 从目录 dir_ino 中删除条目 name
+static int dir_remove(uint32_t dir_ino, const char* name) {
+    return dir_set(dir_ino, name, DCACHE_NEGATIVE);
+}
+
+// 把目录 dir_ino 中已有的条目 name 改为指向 ino
+static int dir_replace(uint32_t dir_ino, const char* name, uint32_t ino) {
+    return dir_set(dir_ino, name, ino);
+}
+
+static int dir_empty_fn(struct dirent* de, void* arg) {
+    return de->name[0] != '\0' ? DIR_STOP : DIR_CONTINUE;
+}
+
+// 目录为空返回 0，不为空返回 -ENOTEMPTY
+static int dir_check_empty(struct inode* dir) {
+    struct dir_pos pos = {0, 0};
+    int ret = dir_iterate(dir, &pos, dir_empty_fn, NULL);
+    return ret < 0 ? ret : ret == 1 ? -ENOTEMPTY : 0;
+}
+
+// 更新 inode 的时间戳，flags 为 'a' 'm' 'c' 的组合
+static int inode_touch(uint32_t ino, const char* flags) {
+    struct inode inode;
+    int ret = inode_read(ino, &inode);
+    if (ret)
+        return ret;
+    int64_t now = now_ns();
+    if (strchr(flags, 'a'))
+        inode.atime = now;
+    if (strchr(flags, 'm'))
+        inode.mtime = now;
+    if (strchr(flags, 'c'))
+        inode.ctime = now;
+    return inode_write(ino, &inode);
+}
+
+// ---------------------------------------------------------------------------
+// 路径解析
+// ---------------------------------------------------------------------------
+
+// 从根目录开始逐级查找 path 的前 len 个字符对应的 inode，*is_dir 返回它是不是目录
+//
+// 每一级的名字复制到栈上查找，不复制整个路径，也不分配内存；
+// 每一级都通过目录项缓存查找，全部命中时不需要读任何块
+static int path_walk(const char* path, size_t len, uint32_t* ino, bool* is_dir) {
+    uint32_t cur = ROOT_INO;
+    bool cur_dir = true;
+    const char* end = path + len;
+    for (const char* p = path; p < end;) {
+        if (*p == '/') {
+            p++;
+            continue;
+        }
+        const char* next = memchr(p, '/', end - p);
+        size_t n = (next != NULL ? next : end) - p;
+        if (!cur_dir)
+            return -ENOTDIR;
+        if (n > NAME_MAX_LEN)
+            return -ENAMETOOLONG;
+        char name[NAME_MAX_LEN + 1];
+        memcpy(name, p, n);
+        name[n] = '\0';
+        int ret = dir_lookup(cur, name, &cur, &cur_dir);
+        if (ret)
+            return ret;
+        p += n;
+    }
+    *ino = cur;
+    *is_dir = cur_dir;
+    return 0;
+}
+
+static int path_lookup(const char* path, uint32_t* ino) {
+    bool is_dir;
+    return path_walk(path, strlen(path), ino, &is_dir);
+}
+
+// 解析 path 的父目录，父目录的 inode 号通过 *parent 返回，最后一级的名字复制到 name 中
+//
+// 和 dirname/basename 一样忽略末尾的 '/'，但直接在 path 上找最后一级，不需要复制路径
+static int path_parent(const char* path, uint32_t* parent, char name[NAME_MAX_LEN + 1]) {
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+        len--;
+    size_t start = len;
+    while (start > 0 && path[start - 1] != '/')
+        start--;
+    if (len - start > NAME_MAX_LEN)
+        return -ENAMETOOLONG;
+    memcpy(name, path + start, len - start);
+    name[len - start] = '\0';
+    bool is_dir;
+    int ret = path_walk(path, start, parent, &is_dir);
+    if (ret == 0 && !is_dir)
+        ret = -ENOTDIR;
+    return ret;
+}
+
+// 解析 path 并给它的 inode 加锁（write 为真时加写锁），成功时调用者用完后需调用 inode_unlock
+//
+// 解析路径时持有 ns_lock 的读锁，锁住 inode 后就释放
+static int path_lock(const char* path, bool write, uint32_t* ino) {
+    pthread_rwlock_rdlock(&ns_lock);
+    int ret = path_lookup(path, ino);
+    if (ret == 0)
+        inode_lock(*ino, write);
+    pthread_rwlock_unlock(&ns_lock);
+    return ret;
+}
+
+// 找到 fi 对应的 inode 并加锁：打开时分配了句柄就直接用句柄中的 inode，否则按路径查找
+//
+// *h 返回句柄（可能为 NULL），成功时调用者用完后需调用 inode_unlock
+static int file_lock(const char* path, struct fuse_file_info* fi, bool write, uint32_t* ino, struct handle** h) {
+    *h = fi != NULL ? handle_get(fi->fh) : NULL;
+    if (*h == NULL)
+        return path_lock(path, write, ino);
+    if ((*ino = handle_ino(*h)) == HANDLE_STALE)
+        return -ENOENT;
+    inode_lock(*ino, write);
+    // 加锁前 inode 可能已经被删除甚至复用，删除时会在持有写锁的情况下作废句柄，所以加锁后再检查一次
+    if (handle_ino(*h) != *ino) {
+        inode_unlock(*ino);
+        return -ENOENT;
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// 快照
+// ---------------------------------------------------------------------------
+
+// 快照的组织方式见 snapshot.h。创建和删除快照要遍历所有的 inode，期间持有 ns_lock 和所有 inode 的写锁，
+// 并预留一整个事务的日志空间，所以它和其它修改操作不会交错，整个快照在同一个事务中提交
+#define SNAPSHOT_JOURNAL_BLOCKS (JOURNAL_SLOTS - JOURNAL_FREE_BLOCKS)
+
+// inode 位图中的一个 32 位的字恰好对应一个 inode 表块
+static_assert(INODES_PER_BLOCK == 32, "inode bitmap word does not match inode table block");
+
+static void inode_lock_all(void) {
+    pthread_rwlock_wrlock(&ns_lock);
+    for (int i = 0; i < INODE_LOCKS; ++i)
+        pthread_rwlock_wrlock(&inode_locks[i]);
+}
+
+static void inode_unlock_all(void) {
+    for (int i = 0; i < INODE_LOCKS; ++i)
+        pthread_rwlock_unlock(&inode_locks[i]);
+    pthread_rwlock_unlock(&ns_lock);
+}
+
+// 把块 block 看作 uint32_t 的数组（inode 表映射块、inode 位图），读出或写入第 i 项
+static int block_word_get(uint32_t block, uint32_t i, uint32_t* value) {
+    struct cache_buf* buf = cache_get(block);
+    if (buf == NULL)
+        return -EIO;
+    *value = ((uint32_t*)buf->data)[i];
+    cache_put(buf);
+    return 0;
+}
+
+static int block_word_set(uint32_t block, uint32_t i, uint32_t value) {
+    struct cache_buf* buf = cache_get(block);
+    if (buf == NULL)
+        return -EIO;
+    ((uint32_t*)buf->data)[i] = value;
+    cache_dirty(buf);
+    cache_put(buf);
+    return 0;
+}
+
+// 和 block_word_set 一样，但修改加入日志，用于已经被提交的快照表引用的块
+static int block_word_update(uint32_t block, uint32_t i, uint32_t value) {
+    struct cache_buf* buf = cache_get(block);
+    if (buf == NULL)
+        return -EIO;
+    ((uint32_t*)buf->data)[i] = value;
+    journal_dirty(buf);
+    cache_put(buf);
+    return 0;
+}
+
+// 为快照的元数据分配一个清零的块，优先放在 goal 之后
+//
+// 这些块在事务提交之前不会被任何已提交的元数据引用，所以和数据块一样在提交前写回，不需要写日志
+static int snapshot_alloc(uint32_t goal, uint32_t* block) {
+    uint32_t got;
+    int ret = block_alloc_run(goal, 1, block, &got);
+    if (ret)
+        return ret;
+    struct cache_buf* buf = cache_zero(*block);
+    if (buf == NULL) {
+        block_free_run(*block, 1);
+        return -EIO;
+    }
+    cache_dirty(buf);
+    cache_put(buf);
+    return 0;
+}
+
+// 把 inode 改为快照中的副本：extent 树重新建立（叶子是新的），文件的数据块和快照共享，引用计数加一，
+// 目录块复制到新的块中。*owned 为副本自己占用的块数（目录块和叶子）
+static int snapshot_copy_inode(struct inode* inode, uint32_t* owned) {
+    *owned = 0;
+    if (inode->flags & INODE_INLINE)
+        return 0;
+    struct inode copy = *inode;
+    copy.blocks = 0;
+    copy.extent_count = 0;
+    copy.extent_depth = 0;
+    memset(copy.extents, 0, sizeof(copy.extents));
+    uint32_t shared = 0, lblk = 0, pblk, len;
+    int ret = 0;
+    // 最后一个 extent 之后的空洞一直延伸到 UINT32_MAX
+    while (lblk < UINT32_MAX && (ret = extent_lookup(inode, lblk, &pblk, &len)) == 0) {
+        if (pblk != 0 && S_ISDIR(inode->mode)) {
+            uint32_t dst;
+            if ((ret = block_alloc_run(pblk, len, &dst, &len)))
+                break;
+            if ((ret = block_copy(pblk, dst, len)) || (ret = extent_insert(&copy, lblk, dst, len))) {
+                block_free_run(dst, len);
+                break;
+            }
+            copy.blocks += len;
+        } else if (pblk != 0) {
+            // 压缩的组共享它的所有物理块
+            uint32_t start = pblk & EXTENT_ZIP ? zip_start(pblk) : pblk;
+            uint32_t n = pblk & EXTENT_ZIP ? zip_blocks(pblk) : len;
+            if ((ret = refcount_inc(start, n)))
+                break;
+            if ((ret = extent_insert(&copy, lblk, pblk, len))) {
+                block_free_run(start, n);
+                break;
+            }
+            copy.blocks += n;
+            shared += n;
+        }
+        lblk += len;
+    }
+    if (ret) {
+        // 复制出来的块都是共享的，放掉时只把计数减一，不占延迟释放的区间，不用分段提交
+        while (inode_truncate_blocks(&copy, 0) == 1)
+            ;
+        return ret;
+    }
+    *inode = copy;
+    *owned = copy.blocks - shared;
+    return 0;
+}
+
+// 复制文件系统现在的元数据，位置记在 snap 中。失败时已经复制的部分也记在 snap 中，由 snapshot_drop 释放
+static int snapshot_copy(struct snapshot* snap) {
+    int ret = snapshot_alloc(0, &snap->itable);
+    if (ret)
+        return ret;
+    if ((ret = snapshot_alloc(snap->itable, &snap->ibitmap))) {
+        block_free_run(snap->itable, 1);
+        snap->itable = 0;
+        return ret;
+    }
+    if ((ret = block_copy(INODE_BITMAP_START, snap->ibitmap, 1)))
+        return ret;
+    snap->blocks = 2;
+    // 只复制有 inode 的 inode 表块，副本依次紧跟着分配
+    uint32_t table = snap->ibitmap;
+    for (uint32_t t = 0; t < INODE_TABLE_BLOCKS && ret == 0; ++t) {
+        uint32_t used;
+        if ((ret = block_word_get(snap->ibitmap, t, &used)) || used == 0)
+            continue;
+        if ((ret = snapshot_alloc(table, &table)) || (ret = block_word_set(snap->itable, t, table)))
+            break;
+        snap->blocks++;
+        for (uint32_t i = 0; i < INODES_PER_BLOCK && ret == 0; ++i) {
+            struct inode inode;
+            uint32_t owned;
+            if (!(used & (1u << i)))
+                continue;
+            if ((ret = inode_read(t * INODES_PER_BLOCK + i, &inode)) || (ret = snapshot_copy_inode(&inode, &owned)))
+                break;
+            struct cache_buf* buf = cache_get(table);
+            if (buf == NULL) {
+                ret = -EIO;
+                break;
+            }
+            memcpy(buf->data + i * INODE_SIZE, &inode, INODE_SIZE);
+            cache_dirty(buf);
+            cache_put(buf);
+            snap->inodes++;
+            snap->blocks += owned;
+        }
+    }
+    return ret;
+}
+
+// 释放快照自己的元数据，共享的数据块只把引用计数减一（见 block_put_run）
+//
+// 快照的元数据块在这次删除提交之前仍然被已提交的快照表引用，所以要等提交时才真正释放，见 journal_free
+//
+// 快照独占的块太多、一个日志操作放不下时（见 inode_truncate_blocks）返回 1，已经释放的部分记在快照自己的元数据中：
+// 释放完的 inode 从快照的 inode 位图中去掉，释放完的 inode 表从映射中去掉，释放了一部分的 inode 写回 inode 表。
+// 调用者提交之后再调用一次，从停下的地方接着释放
+static int snapshot_drop(const struct snapshot* snap) {
+    int ret = 0;
+    if (snap->itable == 0)
+        return 0;
+    for (uint32_t t = 0; t < INODE_TABLE_BLOCKS && ret == 0; ++t) {
+        uint32_t used, table;
+        if ((ret = block_word_get(snap->ibitmap, t, &used)) || used == 0 ||
+            (ret = block_word_get(snap->itable, t, &table)) || table == 0)
+            continue;
+        for (uint32_t i = 0; i < INODES_PER_BLOCK && ret == 0; ++i) {
+            if (!(used & (1u << i)))
+                continue;
+            struct inode inode;
+            struct cache_buf* buf = cache_get(table);
+            if (buf == NULL)
+                return -EIO;
+            memcpy(&inode, buf->data + i * INODE_SIZE, INODE_SIZE);
+            cache_put(buf);
+            if ((ret = inode_truncate_blocks(&inode, 0)) == 0) {
+                used &= ~(1u << i);
+            } else if (ret == 1) {
+                if ((buf = cache_get(table)) == NULL)
+                    return -EIO;
+                memcpy(buf->data + i * INODE_SIZE, &inode, INODE_SIZE);
+                journal_dirty(buf);
+                cache_put(buf);
+            }
+        }
+        if (ret == 1) {
+            if ((ret = block_word_update(snap->ibitmap, t, used)) == 0)
+                ret = 1;
+        } else if (ret == 0 && (ret = journal_free(table, 1)) == 0) {
+            ret = block_word_update(snap->itable, t, 0);
+        }
+    }
+    if (ret == 0 && (ret = journal_free(snap->itable, 1)) == 0)
+        ret = journal_free(snap->ibitmap, 1);
+    return ret;
+}
+
+// 第一次创建快照时分配并清零引用计数表，再分配快照表，记入超级块
+static int snapshot_format(struct snapshot_table* table) {
+    uint32_t block = 0, got;
+    for (uint32_t i = 0; i <= REFCOUNT_BLOCKS; ++i) {
+        int ret = block_alloc_run(block, 1, &block, &got);
+        struct cache_buf* buf = ret == 0 ? cache_zero(block) : NULL;
+        if (buf == NULL) {
+            if (ret == 0)
+                block_free_run(block, 1);
+            for (uint32_t j = 0; j < i; ++j)
+                block_free_run(table->refcount[j], 1);
+            return ret ? ret : -EIO;
+        }
+        journal_dirty(buf);
+        cache_put(buf);
+        if (i < REFCOUNT_BLOCKS)
+            table->refcount[i] = block;
+    }
+    // 最后一块是快照表
+    int ret = refcount_init(table->refcount);
+    if (ret == 0 && (ret = snapshot_table_write(block, table)) == 0) {
+        sb.snapshot_table = block;
+        ret = sb_sync();
+    }
+    return ret;
+}
+
+// 创建名为 name 的快照，由 /.snapshot 的 create 命令调用
+static int snapshot_create(const char* name) {
+    if (readonly)
+        return -EROFS;
+    journal_begin(SNAPSHOT_JOURNAL_BLOCKS);
+    inode_lock_all();
+    struct snapshot_table table;
+    int ret = snapshot_table_read(&table);
+    if (ret == 0 && snapshot_find(&table, name) >= 0)
+        ret = -EEXIST;
+    else if (ret == 0 && table.count == SNAPSHOT_MAX)
+        ret = -ENOSPC;
+    if (ret == 0 && sb.snapshot_table == 0)
+        ret = snapshot_format(&table);
+    if (ret == 0) {
+        struct snapshot* snap = &table.entries[table.count];
+        *snap = (struct snapshot){.ctime = now_ns()};
+        memcpy(snap->name, name, strnlen(name, SNAPSHOT_NAME_LEN));
+        if ((ret = snapshot_copy(snap)) != 0) {
+            // 复制出来的数据块都是共享的，放掉时只把计数减一，不用分段提交
+            while (snapshot_drop(snap) == 1)
+                ;
+        } else {
+            table.count++;
+            ret = snapshot_table_write(sb.snapshot_table, &table);
+        }
+    }
+    // 文件的数据块现在可能和快照共享了，句柄中缓存的映射不能再直接拿来写
+    extent_changed();
+    inode_unlock_all();
+    return journal_end(ret);
+}
+
+// 删除名为 name 的快照，由 /.snapshot 的 delete 命令调用
+static int snapshot_remove(const char* name) {
+    if (readonly)
+        return -EROFS;
+    journal_begin(SNAPSHOT_JOURNAL_BLOCKS);
+    int ret;
+    // 快照独占的块太多、一个日志操作放不下时分段释放，见 snapshot_drop
+    do {
+        inode_lock_all();
+        struct snapshot_table table;
+        int i = -1;
+        ret = snapshot_table_read(&table);
+        if (ret == 0 && (i = snapshot_find(&table, name)) < 0)
+            ret = -ENOENT;
+        if (ret == 0 && (ret = snapshot_drop(&table.entries[i])) == 0) {
+            memmove(&table.entries[i], &table.entries[i + 1], (table.count - i - 1) * sizeof(struct snapshot));
+            table.count--;
+            ret = snapshot_table_write(sb.snapshot_table, &table);
+        }
+        inode_unlock_all();
+    } while (ret == 1 && (ret = journal_restart()) == 0);
+    return journal_end(ret);
+}
+
+// 挂载时加载快照表和引用计数表，name 不为 NULL 时只读挂载这个快照，之后 inode 都从快照的 inode 表中读
+static int snapshot_load(const char* name) {
+    snapshot_init(sb.snapshot_table, snapshot_create, snapshot_remove);
+    struct snapshot_table table;
+    int i, ret = snapshot_table_read(&table);
+    if (ret || (ret = refcount_init(sb.snapshot_table != 0 ? table.refcount : NULL)) || name == NULL)
+        return ret;
+    if (strlen(name) > SNAPSHOT_NAME_LEN || (i = snapshot_find(&table, name)) < 0) {
+        fs_error("fs_mount: no snapshot named %s\n", name);
+        return -ENOENT;
+    }
+    readonly = true;
+    snapshot_itable = table.entries[i].itable;
+    fs_info("fs_mount: snapshot %s is mounted read-only\n", name);
+    return 0;
+}
+
+// 去重共享的块同样要记引用计数，启用去重时还没有计数表就先建立，和第一次创建快照时一样（见 snapshot_format）
+static int dedupe_load(void) {
+    bool enabled = options.dedupe && !readonly;
+    int ret = 0;
+    if (enabled && sb.snapshot_table == 0) {
+        struct snapshot_table table = {0};
+        journal_begin(SNAPSHOT_JOURNAL_BLOCKS);
+        ret = journal_end(snapshot_format(&table));
+    }
+    dedupe_init(enabled && ret == 0);
+    return ret;
+}
+
+// ---------------------------------------------------------------------------
+// 碎片整理
+// ---------------------------------------------------------------------------
+
+// 整理的方式见 defrag.h。整理逐个 inode、逐段进行，每一段是一个单独的操作，只持有这个 inode 的写锁，
+// 搬动目录的块时还持有 ns_lock 的写锁（见 defrag_inode）
+
+// 一段至多包含的 extent 数：每个 extent 的旧块都要延迟释放，不能占满 journal_free 的区间表
+#define DEFRAG_EXTENTS 64
+
+// 文件中可以一起搬动的一段：逻辑上相邻的几个 extent（中间可以有空洞），搬到一段连续的新块中
+struct defrag_chunk {
+    uint32_t next;  // 这一段之后的逻辑块号
+    uint32_t count;
+    uint32_t blocks;
+    uint32_t runs;  // 物理上连续的段数
+    struct extent extents[DEFRAG_EXTENTS];
+};
+
+// 锁住 ino 并读出它，ino 没有在用时返回 -ENOENT
+//
+// 创建和删除 inode 时都持有 ns_lock 的写锁，所以持有 ns_lock 时在位图中看到的 inode 已经写好了，
+// 之后持有 ino 的锁，它就不会被删除
+//
+// ns_held 表示调用者已经持有 ns_lock 的写锁，这时不再加读锁
+static int defrag_inode_get(uint32_t ino, bool write, bool ns_held, struct inode* inode) {
+    uint32_t used;
+    if (!ns_held)
+        pthread_rwlock_rdlock(&ns_lock);
+    int ret = alloc_next(&inode_bitmap, ino, &used);
+    if (ret == 0 && used != ino)
+        ret = -ENOENT;
+    if (ret == 0)
+        inode_lock(ino, write);
+    if (!ns_held)
+        pthread_rwlock_unlock(&ns_lock);
+    if (ret == 0 && (ret = inode_read(ino, inode)))
+        inode_unlock(ino);
+    return ret;
+}
+
+// 统计 inode 占用的块数和它们组成的连续段数，压缩的组按它占用的物理块算
+static int inode_fragments(struct inode* inode, uint32_t* blocks, uint32_t* runs) {
+    *blocks = *runs = 0;
+    if (inode->flags & INODE_INLINE)
+        return 0;
+    uint32_t lblk = 0, pblk, len, end = 0;
+    int ret = 0;
+    while (lblk < UINT32_MAX && (ret = extent_lookup(inode, lblk, &pblk, &len)) == 0) {
+        if (pblk != 0) {
+            uint32_t start = pblk & EXTENT_ZIP ? zip_start(pblk) : pblk;
+            uint32_t n = pblk & EXTENT_ZIP ? zip_blocks(pblk) : len;
+            if (start != end)
+                (*runs)++;
+            *blocks += n;
+            end = start + n;
+        }
+        lblk += len;
+    }
+    return ret;
+}
+
+static int defrag_scan(struct defrag_report* report) {
+    if (readonly)
+        return -EROFS;
+    *report = (struct defrag_report){.free = __atomic_load_n(&block_bitmap.free, __ATOMIC_RELAXED)};
+    int ret;
+    for (uint32_t ino = 0; (ret = alloc_next(&inode_bitmap, ino, &ino)) == 0; ++ino) {
+        struct inode inode;
+        uint32_t blocks, runs;
+        if ((ret = defrag_inode_get(ino, false, false, &inode)) == -ENOENT)
+            continue;
+        if (ret == 0) {
+            ret = inode_fragments(&inode, &blocks, &runs);
+            inode_unlock(ino);
+        }
+        if (ret)
+            return ret;
+        if (blocks == 0)
+            continue;
+        report->files++;
+        report->fragmented += runs > 1;
+        report->fragments += runs;
+        report->blocks += blocks;
+    }
+    if (ret != -ENOENT)
+        return ret;
+    return alloc_free_runs(&block_bitmap, &report->free_runs, &report->largest_free);
+}
+
+// 从 lblk 开始取出下一段可以搬动的块：跳过空洞；压缩的组和共享的块不能搬动，遇到时结束这一段，
+// 还没有取到块时跳过它们。一段至多 ALLOC_GROUP_BITS 块（alloc_exact 的上限），单个 extent 超过时单独成一段
+static int defrag_chunk_get(struct inode* inode, uint32_t lblk, struct defrag_chunk* chunk) {
+    chunk->count = chunk->blocks = chunk->runs = 0;
+    chunk->next = UINT32_MAX;
+    if (inode->flags & INODE_INLINE)
+        return 0;
+    uint32_t pblk, len, run;
+    int ret = 0;
+    while (lblk < UINT32_MAX && (ret = extent_lookup(inode, lblk, &pblk, &len)) == 0) {
+        int shared = pblk != 0 && !(pblk & EXTENT_ZIP) ? refcount_shared(pblk, len, &run) : 1;
+        if (shared < 0)
+            return shared;
+        bool movable = shared == 0 && run == len;
+        if (pblk != 0 && chunk->count > 0 &&
+            (!movable || chunk->count == DEFRAG_EXTENTS || chunk->blocks + len > ALLOC_GROUP_BITS))
+            break;
+        if (movable) {
+            const struct extent* prev = chunk->count > 0 ? &chunk->extents[chunk->count - 1] : NULL;
+            if (prev == NULL || prev->pblk + prev->len != pblk)
+                chunk->runs++;
+            chunk->extents[chunk->count++] = (struct extent){.lblk = lblk, .pblk = pblk, .len = len};
+            chunk->blocks += len;
+        }
+        lblk += len;
+    }
+    chunk->next = lblk;
+    return ret;
+}
+
+// 把 chunk 中的块搬到一段连续的新块中：先试着紧跟在前一个逻辑块后面，这样文件的各段也连在一起；
+// 否则不连续的一段从数据区的开头找第一个放得下的空隙，已经连续的一段（compact）只往前搬。
+// 找不到这样的空隙时什么也不做，调用时持有 ino 的写锁
+//
+// 新块和快照复制目录块时一样（见 snapshot_copy_inode）在提交前写回，目录块也不需要写日志：
+// 提交之前已提交的元数据不会引用它们。旧块用 journal_free 等到提交之后才释放
+static int defrag_move(uint32_t ino, struct inode* inode, const struct defrag_chunk* chunk,
+                       struct defrag_result* result) {
+    uint32_t goal, dst, to = chunk->runs > 1 ? BLOCK_NUM : chunk->extents[0].pblk, run;
+    int ret = alloc_goal(inode, chunk->extents[0].lblk, &goal);
+    if (ret == 0 && (goal == 0 || (ret = alloc_exact(&block_bitmap, goal, goal + chunk->blocks, chunk->blocks,
+                                                     &dst)) == -ENOSPC))
+        ret = alloc_exact(&block_bitmap, DATA_START, to, chunk->blocks, &dst);
+    if (ret == -ENOSPC) {
+        result->skipped += chunk->runs > 1;
+        return 0;
+    }
+    if (ret)
+        return ret;
+    // 先从去重的索引中去掉旧块，别的文件之后不会再共享它们，再确认一遍现在没有被共享
+    for (uint32_t i = 0; i < chunk->count && ret == 0; ++i) {
+        const struct extent* e = &chunk->extents[i];
+        dedupe_forget(e->pblk, e->len);
+        if ((ret = refcount_shared(e->pblk, e->len, &run)) == 0 && run != e->len)
+            ret = 1;
+    }
+    handle_drop(ino);
+    for (uint32_t i = 0, off = 0; i < chunk->count && ret == 0; off += chunk->extents[i++].len)
+        ret = block_copy(chunk->extents[i].pblk, dst + off, chunk->extents[i].len);
+    if (ret) {
+        block_free_run(dst, chunk->blocks);
+        return ret > 0 ? 0 : ret;
+    }
+
+    // 每个 extent 先改映射再释放旧块：改映射失败时旧块还在用，释放失败时旧块只是漏掉了，不会被别人覆盖
+    uint32_t moved = 0;
+    for (uint32_t i = 0; i < chunk->count && ret == 0; ++i) {
+        const struct extent* e = &chunk->extents[i];
+        if ((ret = extent_remap(inode, e->lblk, e->len, dst + moved)))
+            break;
+        ret = journal_free(e->pblk, e->len);
+        moved += e->len;
+    }
+    if (moved < chunk->blocks)
+        block_free_run(dst + moved, chunk->blocks - moved);
+    // 原来的窗口在旧的位置之后，之后追加时从新的位置接着分配
+    alloc_release(&block_bitmap, ino);
+    result->chunks += moved > 0;
+    result->moved += moved;
+    int err = inode_write(ino, inode);
+    return ret ? ret : err;
+}
+
+// 整理 ino 中从 *lblk 开始的一段，*lblk 移到这一段之后，ino 中没有更多的块时为 UINT32_MAX
+//
+// 解析路径时只持有 ns_lock 的读锁读目录块（见 path_walk），所以搬动目录的块时还要持有 ns_lock 的写锁。
+// 锁住之后才知道是不是目录，是目录时按加锁顺序放掉 inode 的锁，加上 ns_lock 的写锁之后重新来过
+static int defrag_inode(uint32_t ino, bool compact, uint32_t* lblk, struct defrag_result* result) {
+    struct inode inode;
+    struct defrag_chunk chunk;
+    int ret = defrag_inode_get(ino, true, false, &inode);
+    bool is_dir = ret == 0 && S_ISDIR(inode.mode);
+    if (is_dir) {
+        inode_unlock(ino);
+        pthread_rwlock_wrlock(&ns_lock);
+        ret = defrag_inode_get(ino, true, true, &inode);
+    }
+    if (ret == 0) {
+        ret = defrag_chunk_get(&inode, *lblk, &chunk);
+        *lblk = chunk.next;
+        if (ret == 0 && chunk.count > 0 && (chunk.runs > 1 || compact))
+            ret = defrag_move(ino, &inode, &chunk, result);
+        inode_unlock(ino);
+    } else {
+        *lblk = UINT32_MAX;
+        if (ret == -ENOENT)
+            ret = 0;
+    }
+    if (is_dir)
+        pthread_rwlock_unlock(&ns_lock);
+    return ret;
+}
+
+static int defrag_run(bool compact, struct defrag_result* result) {
+    if (readonly)
+        return -EROFS;
+    int ret;
+    for (uint32_t ino = 0; (ret = alloc_next(&inode_bitmap, ino, &ino)) == 0; ++ino) {
+        for (uint32_t lblk = 0; lblk < UINT32_MAX && ret == 0;) {
+            journal_begin(JOURNAL_OP_BLOCKS);
+            ret = journal_end(defrag_inode(ino, compact, &lblk, result));
+        }
+        if (ret)
+            return ret;
+    }
+    // 提交之后旧块才真正释放，之后统计的空闲空间才是整理过的
+    return ret == -ENOENT ? journal_commit() : ret;
+}
+
+// ---------------------------------------------------------------------------
+// 各个接口的公共部分
+// ---------------------------------------------------------------------------
+
+// 在目录 parent 中创建一个类型为 mode 的条目 name，调用时持有 ns_lock 和 parent 的写锁
+//
+// 新的 inode 在加入目录之前别的线程看不到，不需要加锁
+static int create_entry(uint32_t parent, const char* name, mode_t mode) {
+    uint32_t ino;
+    int ret = dir_lookup(parent, name, &ino, NULL);
+    if (ret != -ENOENT)
+        return ret == 0 ? -EEXIST : ret;
+
+    if ((ret = inode_alloc(&ino)))
+        return ret;
+    int64_t now = now_ns();
+    struct inode inode = {.mode = mode, .flags = S_ISREG(mode) ? INODE_INLINE : 0, .atime = now, .mtime = now, .ctime = now};
+    if ((ret = inode_write(ino, &inode)) || (ret = dir_add(parent, name, ino))) {
+        // 比如目录需要新的数据块但磁盘已满，回滚 inode 的分配
+        inode_free(ino);
+        return ret;
+    }
+    dcache_insert(parent, name, ino, S_ISDIR(mode));
+    return inode_touch(parent, "mc");
+}
+
+// 创建一个类型为 mode 的条目
+static int do_create(const char* path, mode_t mode) {
+    if (ctl_find(path) != NULL)
+        return -EEXIST;
+    uint32_t parent;
+    char name[NAME_MAX_LEN + 1];
+    pthread_rwlock_wrlock(&ns_lock);
+    int ret = path_parent(path, &parent, name);
+    if (ret == 0) {
+        uint64_t locked = inode_lock_set(&parent, 1);
+        ret = create_entry(parent, name, mode);
+        inode_unlock_set(locked);
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    return ret;
+}
+
+// 从目录 parent 中删除指向 ino 的条目 name，调用时持有 ns_lock 以及 parent 和 ino 的写锁
+static int remove_entry(uint32_t parent, const char* name, uint32_t ino, bool is_dir) {
+    struct inode inode;
+    int ret = inode_read(ino, &inode);
+    if (ret)
+        return ret;
+    if (is_dir && !S_ISDIR(inode.mode))
+        return -ENOTDIR;
+    if (!is_dir && S_ISDIR(inode.mode))
+        return -EISDIR;
+    if (is_dir && (ret = dir_check_empty(&inode)))
+        return ret;
+    // 先释放块，一次放不下时文件还在原处，下一次从头再来
+    if ((ret = inode_truncate_slice(ino, &inode, 0)) || (ret = dir_remove(parent, name)) || (ret = inode_free(ino)))
+        return ret;
+    handle_forget(ino);
+    dcache_insert(parent, name, DCACHE_NEGATIVE, false);
+    if (is_dir)
+        dcache_purge_dir(ino);
+    return inode_touch(parent, "mc");
+}
+
+// 删除一个条目，is_dir 表示期望删除的是目录还是文件
+static int do_remove(const char* path, bool is_dir) {
+    if (ctl_find(path) != NULL)
+        return -EPERM;
+    uint32_t inos[2];  // 父目录和被删除的 inode
+    char name[NAME_MAX_LEN + 1];
+    pthread_rwlock_wrlock(&ns_lock);
+    int ret = path_parent(path, &inos[0], name);
+    if (ret == 0 && (ret = dir_lookup(inos[0], name, &inos[1], NULL)) == 0) {
+        uint64_t locked = inode_lock_set(inos, 2);
+        ret = remove_entry(inos[0], name, inos[1], is_dir);
+        inode_unlock_set(locked);
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    return ret;
+}
 
 // 初始化文件系统
 //
@@ -49,7 +2388,69 @@
 int fs_mount(int init_flag) {
     fs_info("fs_mount is called\tinit_flag:%d)\n", init_flag);
 
-    return 0;
+    stats_init();
+    options_load(&options);
+    locks_init();
+    handle_init(options.coalesce);
+    cache_init();
+    dcache_init();
+    attrcache_init();
+    defrag_init(defrag_scan, defrag_run);
+    journal_init(JOURNAL_START, block_free_now);
+    if (!init_flag) {
+        // 先重放日志，之后读到的元数据才是最新的
+        if (journal_recover())
+            return 1;
+        struct cache_buf* buf = cache_get(SUPER_BLOCK);
+        if (buf == NULL)
+            return 1;
+        memcpy(&sb, buf->data, sizeof(sb));
+        cache_put(buf);
+        if (sb.magic != FS_MAGIC) {
+            fs_error("fs_mount: bad magic number\n");
+            return 1;
+        }
+        if (bitmaps_init() || snapshot_load(options.snapshot))
+            return 1;
+        // 在修改任何东西之前（包括 dedupe_load 建立引用计数表）先去掉正常卸载的标记，
+        // 否则崩溃后会载入过时的状态
+        if (!readonly && sb.clean) {
+            sb.clean = 0;
+            if (sb_sync() || journal_commit())
+                return 1;
+        }
+        if (dedupe_load())
+            return 1;
+        return 0;
+    }
+
+    // 磁盘没有清零过（见 blkdev_mount），这里只写入超级块、用到的位图块、根目录所在的 inode 组，
+    // 其余的组标记为没有用过，第一次分配时才初始化
+    sb = (struct superblock){
+        .magic = FS_MAGIC,
+        .inode_num = INODE_NUM,
+        .block_num = BLOCK_NUM,
+        .data_start = DATA_START,
+        .uninit_inodes = GROUPS_UNINIT(INODE_NUM / ALLOC_GROUP_BITS),
+        .uninit_blocks = GROUPS_UNINIT(BLOCK_NUM / ALLOC_GROUP_BITS),
+    };
+    if (options.snapshot != NULL)
+        fs_warning("fs_mount: FS_SNAPSHOT is ignored when formatting, use mount_noinit\n");
+    // 超级块在磁盘上还不存在，先在缓存中清零，sb_sync 就不会去读它
+    struct cache_buf* buf = cache_zero(SUPER_BLOCK);
+    if (buf == NULL)
+        return 1;
+    journal_dirty(buf);
+    cache_put(buf);
+    // 元数据区域在数据块位图中标记为已用
+    if (bitmaps_init() || alloc_mark(&block_bitmap, 0, DATA_START) || snapshot_load(NULL))
+        return 1;
+    uint32_t root;
+    if (inode_alloc(&root) || root != ROOT_INO)
+        return 1;
+    int64_t now = now_ns();
+    struct inode inode = {.mode = DIRMODE, .atime = now, .mtime = now, .ctime = now};
+    return inode_write(ROOT_INO, &inode) || dedupe_load() || sb_sync() || journal_commit();
 }
 
 // 关闭文件系统前的清理工作
@@ -58,7 +2459,54 @@ int fs_mount(int init_flag) {
 // fs_finalize 函数中完成，你可以假设 fuse_status 永远为 0，即 fuse
 // 永远会正常退出，该函数当且仅当清理工作失败时返回非零值
 int fs_finalize(int fuse_status) {
-    return fuse_status;
+    readahead_stop();
+    stats_dump();
+    // 只读挂载快照时没有修改过任何东西
+    int ret = (!readonly && sb_unmount()) || cache_flush() || blkdev_sync();
+    blkdev_stop();
+    ringlog_stop();
+    return ret ? 1 : fuse_status;
+}
+
+static void attr_to_stat(const struct inode_attr* inode, struct stat* attr) {
+    *attr = (struct stat){
+        .st_mode = inode->mode,
+        .st_nlink = 1,
+        .st_uid = getuid(),
+        .st_gid = getgid(),
+        .st_size = inode->size,
+        .st_atim = ns_to_ts(inode->atime),
+        .st_mtim = ns_to_ts(inode->mtime),
+        .st_ctim = ns_to_ts(inode->ctime),
+        .st_blksize = BLOCK_SIZE,
+        .st_blocks = (blkcnt_t)inode->blocks * (BLOCK_SIZE / 512),
+    };
+}
+
+static int do_getattr(const char* path, struct stat* attr) {
+    // 控制文件只读或者只写，内容现生成，大小报告为 0，见 ctl.h
+    const struct ctl_file* ctl = ctl_find(path);
+    if (ctl != NULL) {
+        *attr = (struct stat){
+            .st_mode = S_IFREG | (ctl->read ? 0444 : 0) | (ctl->write ? 0200 : 0),
+            .st_nlink = 1,
+            .st_uid = getuid(),
+            .st_gid = getgid(),
+            .st_blksize = BLOCK_SIZE,
+        };
+        return 0;
+    }
+
+    uint32_t ino;
+    struct inode_attr inode;
+    int ret = path_lock(path, false, &ino);
+    if (ret)
+        return ret;
+    ret = inode_getattr(ino, &inode);
+    inode_unlock(ino);
+    if (ret == 0)
+        attr_to_stat(&inode, attr);
+    return ret;
 }
 
 // 查询一个文件或目录的属性
@@ -76,38 +2524,120 @@ int fs_finalize(int fuse_status) {
 //
 // `stat` 会触发该函数，实际上 `cd` 的时候也会触发，这个函数被触发的情景特别多
 int fs_getattr(const char* path, struct stat* attr) {
-    fs_info("fs_getattr is called:%s\n", path);
+    ringlog_info("fs_getattr is called:%s\n", path);
 
-    // 这是一个示例实现，模拟一个空文件系统，以保证你能正常执行 `cd mnt` 命令
-    if (strcmp(path, "/") != 0) {
-        return -ENOENT;
+    stats_begin(STATS_GETATTR);
+    return stats_end(do_getattr(path, attr));
+}
+
+// readdir 的 offset：0 表示从头开始，"." 和 ".." 之后分别是 1 和 READDIR_FIRST，
+// 再往后的 offset 是目录中的位置（见 struct dir_pos）的编码
+//
+// 每一项都带着它之后的 offset 交给 filler，一次放不下时内核带着最后一项的 offset 再次调用 readdir，
+// 这时直接从这个位置接着读，大目录不需要每次都从头扫描
+#define READDIR_FIRST 2
+static_assert(DIRENTS_PER_BLOCK < 256, "slot does not fit in readdir offset");
+
+static off_t readdir_offset(struct dir_pos pos) {
+    return READDIR_FIRST + ((off_t)pos.leaf << 8 | pos.slot);
+}
+
+static struct dir_pos readdir_pos(off_t offset) {
+    offset -= READDIR_FIRST;
+    return (struct dir_pos){.leaf = offset >> 8, .slot = offset & 0xff};
+}
+
+// readdir 一批处理的目录项数
+//
+// 内核每次 readdir 只要一页（一百项左右），一批太大时多读的属性用不上，还会把缓存中有用的块挤掉
+#define READDIR_BATCH 16
+
+struct readdir_entry {
+    char name[NAME_MAX_LEN + 1];
+    uint32_t ino;
+    off_t next;  // 这一项之后的 offset
+};
+
+// 一批目录项，由 readdir_fn 从叶子块中复制出来
+struct readdir_batch {
+    uint32_t count;
+    struct dir_pos pos;  // 当前目录项的位置，由 dir_iterate 更新
+    struct readdir_entry entries[READDIR_BATCH];
+};
+
+static int readdir_fn(struct dirent* de, void* arg) {
+    struct readdir_batch* b = arg;
+    if (de->name[0] == '\0')
+        return DIR_CONTINUE;
+    // 满了就停在这一项上，下一批从这里开始
+    if (b->count == READDIR_BATCH)
+        return DIR_STOP;
+    struct readdir_entry* e = &b->entries[b->count++];
+    memcpy(e->name, de->name, NAME_MAX_LEN);
+    e->name[NAME_MAX_LEN] = '\0';
+    e->ino = de->ino;
+    e->next = readdir_offset((struct dir_pos){.leaf = b->pos.leaf, .slot = b->pos.slot + 1});
+    return DIR_CONTINUE;
+}
+
+// 把一批目录项的属性读入属性缓存，并把目录项放入目录项缓存，调用时持有目录 dir 的读锁
+//
+// 复制目录项时已经放掉了叶子块，读 inode 时同时只钉住一个块，见 cache.h
+//
+// 按加锁规则本不能在持有目录的锁时再等子项的锁，所以这里只尝试加读锁，子项正在被修改时跳过它，
+// 让之后的 getattr 自己去读；和目录共用一把锁的子项已经被读锁保护了
+static void readdir_prefetch(uint32_t dir, struct readdir_batch* b) {
+    for (uint32_t i = 0; i < b->count; ++i) {
+        struct readdir_entry* e = &b->entries[i];
+        bool same = e->ino % INODE_LOCKS == dir % INODE_LOCKS;
+        if (!same && pthread_rwlock_tryrdlock(&inode_locks[e->ino % INODE_LOCKS]))
+            continue;
+        struct inode_attr attr;
+        if (inode_getattr(e->ino, &attr) == 0)
+            dcache_insert(dir, e->name, e->ino, S_ISDIR(attr.mode));
+        if (!same)
+            inode_unlock(e->ino);
     }
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    *attr = (struct stat){
-        .st_mode =
-            DIRMODE,         // 记录条目的类型，权限等信息，本实验由于不考虑权限等高级功能，你只需要返回
-                             // DIRMODE 当条目是一个目录时；返回 REGMODE
-                             // 当条目是一个文件时
-        .st_nlink = 1,       // 固定返回 1 即可，因为我们不考虑链接
-        .st_uid = getuid(),  // 固定返回当前用户的 uid
-        .st_gid = getgid(),  // 固定返回当前用户的 gid
-        .st_size = 0,        // 返回文件大小（字节记）
-        .st_atim = ts,       // 最后访问时间
-        .st_mtim = ts,       // 最后修改时间（内容）
-        .st_ctim = ts,       // 最后修改时间（元数据）
-        .st_blksize = 4096,  // 文件的最小分配单位大小（字节记）
-        .st_blocks = 0,      // 实际占据的数据块数（以 512
-                             // 字节为一块，这是历史原因的规定，和 st_blksize
-                             // 中的不一样），这个块数需要考虑文件系统实现的实际情况，
-                             // 比如间接指针分配的那个数据块也应该算在这里。
-                             // 比如 `stat fs.c` 里的 `Blocks:` 显示的就是这个值
-    };
+}
 
-    return 0;
+// 读出每一项的属性放进属性缓存，`ls -l` 紧接着对每一项的 getattr 解析路径和取属性都命中内存，
+// 不需要再读目录块和 inode 表。属性也交给 filler，但 libfuse 2.9 没有 readdirplus，
+// 高层接口只把其中的 st_ino 和 st_mode 传给内核，getattr 照样会来
+//
+// 目录的大小按目录项算超过属性缓存的容量时不预读：一次 `ls -l` 读入的属性会在用到之前被挤掉，
+// 只是多读一遍 inode 表。目录项按批从叶子块中复制出来，先读完一批的属性，再依次交给 filler
+static int do_readdir(uint32_t ino, void* buffer, fuse_fill_dir_t filler, off_t offset) {
+    struct inode dir;
+    int ret = inode_read(ino, &dir);
+    if (ret)
+        return ret;
+    if (!S_ISDIR(dir.mode))
+        return -ENOTDIR;
+    bool full = (offset < 1 && filler(buffer, ".", NULL, 1)) ||
+                (offset < READDIR_FIRST && filler(buffer, "..", NULL, READDIR_FIRST));
+    struct readdir_batch batch = {.pos = offset < READDIR_FIRST ? (struct dir_pos){0, 0} : readdir_pos(offset)};
+    bool prefetch = dir.size / sizeof(struct dirent) <= ATTRCACHE_SIZE;
+    for (bool more = !full; more; more = ret == 1 && !full) {
+        batch.count = 0;
+        if ((ret = dir_iterate(&dir, &batch.pos, readdir_fn, &batch)) < 0)
+            return ret;
+        if (prefetch)
+            readdir_prefetch(ino, &batch);
+        for (uint32_t i = 0; !full && i < batch.count; ++i) {
+            struct readdir_entry* e = &batch.entries[i];
+            struct inode_attr attr;
+            struct stat st;
+            // 缓存中没有（被跳过或者已经被挤掉）时不带属性
+            bool cached = attrcache_lookup(e->ino, &attr);
+            if (cached)
+                attr_to_stat(&attr, &st);
+            full = filler(buffer, e->name, cached ? &st : NULL, e->next);
+        }
+    }
+    return inode_set_atime(ino, now_ns());
 }
 
-// 查询一个目录下的所有条目名（文件，目录）（忽略 offset 参数）
+// 查询一个目录下的所有条目名（文件，目录），从 offset 开始，见 readdir_offset
 //
 // 错误处理：
 // 1. 目录不存在时返回 -ENOENT
@@ -120,13 +2650,114 @@ int fs_getattr(const char* path, struct stat* attr) {
 //
 // `ls` 命令会触发这个函数
 int fs_readdir(const char* path, void* buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi) {
-    fs_info("fs_readdir is called:%s\n", path);
+    ringlog_info("fs_readdir is called:%s\n", path);
 
-    // 示例实现
-    filler(buffer, ".", NULL, 0);
-    filler(buffer, "..", NULL, 0);
+    stats_begin(STATS_READDIR);
+    // 只修改 atime，不需要日志操作，见 inode_set_atime
+    uint32_t ino;
+    struct handle* h;
+    int ret = file_lock(path, fi, false, &ino, &h);
+    if (ret == 0) {
+        ret = do_readdir(ino, buffer, filler, offset);
+        inode_unlock(ino);
+    }
+    return stats_end(ret);
+}
 
-    return 0;
+// 顺序读时，把 [offset, offset + size) 之后的若干块交给后台线程预读，run 是这次读最后查到的映射
+static void read_ahead(struct inode* inode, struct handle* h, uint64_t offset, size_t size, struct handle_cursor* run) {
+    uint64_t end = offset + size;
+    uint32_t from, to;
+    if (!handle_readahead(h, offset, end, ceil_div(end, BLOCK_SIZE), options.readahead, &from, &to))
+        return;
+    to = min((uint64_t)to, ceil_div(inode->size, BLOCK_SIZE));
+    for (uint32_t lblk = from; lblk < to;) {
+        if (lblk - run->lblk >= run->len) {
+            if (extent_lookup(inode, lblk, &run->pblk, &run->len))
+                return;
+            run->lblk = lblk;
+        }
+        uint32_t n = min(to - lblk, run->len - (lblk - run->lblk));
+        if (run->pblk & EXTENT_ZIP)
+            readahead_submit(zip_start(run->pblk), zip_blocks(run->pblk));
+        else if (run->pblk != 0)
+            readahead_submit(run->pblk + (lblk - run->lblk), n);
+        lblk += n;
+    }
+}
+
+static int do_read(uint32_t ino, struct handle* h, char* buffer, size_t size, off_t offset) {
+    struct inode inode;
+    int ret = inode_read(ino, &inode);
+    if (ret)
+        return ret;
+    if (S_ISDIR(inode.mode))
+        return -EISDIR;
+    if ((uint64_t)offset >= inode.size)
+        return 0;
+    size = min(size, inode.size - offset);
+    if (inode.flags & INODE_INLINE) {
+        memcpy(buffer, inode.inline_data + offset, size);
+        if ((ret = inode_set_atime(ino, now_ns())))
+            return ret;
+        return size;
+    }
+
+    // 每个 extent 只查一次映射，空洞直接填 0；顺序读时接着用上一次查到的映射。
+    // 压缩的组整个解压到 zip_buf 中，这次读到同一组的其它块时直接从中拷贝，所以第一次用到时加锁，读完再放开
+    size_t done = 0;
+    struct handle_cursor run;
+    cursor_load(h, &run);
+    bool zip_locked = false;
+    uint32_t unzipped = UINT32_MAX;
+    while (done < size && ret == 0) {
+        uint64_t pos = offset + done;
+        uint32_t lblk = pos / BLOCK_SIZE;
+        size_t in_block = pos % BLOCK_SIZE;
+        size_t len = min(size - done, BLOCK_SIZE - in_block);
+        if (lblk - run.lblk >= run.len) {
+            if ((ret = extent_lookup(&inode, lblk, &run.pblk, &run.len)))
+                break;
+            run.lblk = lblk;
+            run.writable = !refcount_any() && !(run.pblk & EXTENT_ZIP);
+            // 这次读要用到这个 extent 中的多个块时，先把它们一批并行读入
+            uint32_t need = (offset + size - 1) / BLOCK_SIZE - lblk + 1;
+            if (run.pblk != 0 && !(run.pblk & EXTENT_ZIP) && min(run.len, need) > 1)
+                cache_prefetch_run(run.pblk, min(run.len, need));
+        }
+        if (run.pblk == 0) {
+            memset(buffer + done, 0, len);
+        } else if (run.pblk & EXTENT_ZIP) {
+            uint32_t first = lblk - lblk % COMPRESS_CLUSTER;
+            if (!zip_locked) {
+                pthread_mutex_lock(&zip_buf.lock);
+                zip_locked = true;
+            }
+            if (unzipped != first && (ret = zip_read(run.pblk, zip_buf.data)))
+                break;
+            unzipped = first;
+            memcpy(buffer + done, zip_buf.data + (lblk - first) * BLOCK_SIZE + in_block, len);
+        } else {
+            struct cache_buf* buf = cache_get(run.pblk + (lblk - run.lblk));
+            if (buf == NULL) {
+                ret = -EIO;
+                break;
+            }
+            memcpy(buffer + done, buf->data + in_block, len);
+            cache_put(buf);
+        }
+        done += len;
+    }
+    if (zip_locked)
+        pthread_mutex_unlock(&zip_buf.lock);
+    if (ret)
+        return ret;
+    cursor_save(h, &run);
+    if (h != NULL && options.readahead > 0)
+        read_ahead(&inode, h, offset, done, &run);
+    if ((ret = inode_set_atime(ino, now_ns())))
+        return ret;
+    return done;
 }
 
 // 从 offset 位置开始读取至多 size 字节内容到 buffer 中
@@ -142,9 +2773,21 @@ int fs_readdir(const char* path, void* buffer, fuse_fill_dir_t filler, off_t off
 //
 // `cat` 命令会触发这个函数
 int fs_read(const char* path, char* buffer, size_t size, off_t offset, struct fuse_file_info* fi) {
-    fs_info("fs_read is called:%s\tsize:%d\toffset:%d\n", path, size, offset);
+    ringlog_info("fs_read is called:%s\tsize:%zu\toffset:%jd\n", path, size, (intmax_t)offset);
 
-    return 0;
+    stats_begin(STATS_READ);
+    const struct ctl_file* ctl = ctl_find(path);
+    if (ctl != NULL)
+        return stats_end(ctl->read != NULL ? ctl->read(buffer, size, offset) : -EACCES);
+    // 只修改 atime，不需要日志操作，见 inode_set_atime
+    uint32_t ino;
+    struct handle* h;
+    int ret = file_lock(path, fi, false, &ino, &h);
+    if (ret == 0) {
+        ret = do_read(ino, h, buffer, size, offset);
+        inode_unlock(ino);
+    }
+    return stats_end(ret);
 }
 
 // 创建一个文件（忽略 mode 和 dev 参数）
@@ -161,9 +2804,13 @@ int fs_read(const char* path, char* buffer, size_t size, off_t offset, struct fu
 //
 // `touch` 命令会触发这个函数
 int fs_mknod(const char* path, mode_t mode, dev_t dev) {
-    fs_info("fs_mknod is called:%s\n", path);
+    ringlog_info("fs_mknod is called:%s\n", path);
 
-    return 0;
+    stats_begin(STATS_MKNOD);
+    if (readonly)
+        return stats_end(-EROFS);
+    journal_begin(JOURNAL_OP_BLOCKS);
+    return stats_end(journal_end(do_create(path, REGMODE)));
 }
 
 // 创建一个目录（忽略 mode 参数）
@@ -171,9 +2818,13 @@ int fs_mknod(const char* path, mode_t mode, dev_t dev) {
 // 和 fs_mknod 几乎一模一样，
 // 唯一的区别是其对应的 stat 记录的 `st_mode` 为 `DIRMODE`
 int fs_mkdir(const char* path, mode_t mode) {
-    fs_info("fs_mkdir is called:%s\n", path);
+    ringlog_info("fs_mkdir is called:%s\n", path);
 
-    return 0;
+    stats_begin(STATS_MKDIR);
+    if (readonly)
+        return stats_end(-EROFS);
+    journal_begin(JOURNAL_OP_BLOCKS);
+    return stats_end(journal_end(do_create(path, DIRMODE)));
 }
 
 // 删除一个文件
@@ -189,9 +2840,17 @@ int fs_mkdir(const char* path, mode_t mode) {
 //
 // `rm` 命令会触发该函数
 int fs_unlink(const char* path) {
-    fs_info("fs_unlink is callded:%s\n", path);
+    ringlog_info("fs_unlink is callded:%s\n", path);
 
-    return 0;
+    stats_begin(STATS_UNLINK);
+    if (readonly)
+        return stats_end(-EROFS);
+    journal_begin(JOURNAL_OP_BLOCKS);
+    int ret = do_remove(path, false);
+    // 块太多、一个日志操作放不下时分段释放，见 inode_truncate_slice
+    while (ret == 1 && (ret = journal_restart()) == 0)
+        ret = do_remove(path, false);
+    return stats_end(journal_end(ret));
 }
 
 // 删除一个目录
@@ -206,9 +2865,84 @@ int fs_unlink(const char* path) {
 // 事实上，`rm -rf` 时的处理方法是系统自己调用 `ls, cd, rm, rmdir`
 // 来处理递归删除，而不是交给文件系统来处理递归
 int fs_rmdir(const char* path) {
-    fs_info("fs_rmdir is called:%s\n", path);
+    ringlog_info("fs_rmdir is called:%s\n", path);
 
-    return 0;
+    stats_begin(STATS_RMDIR);
+    if (readonly)
+        return stats_end(-EROFS);
+    journal_begin(JOURNAL_OP_BLOCKS);
+    int ret = do_remove(path, true);
+    // 块太多、一个日志操作放不下时分段释放，见 inode_truncate_slice
+    while (ret == 1 && (ret = journal_restart()) == 0)
+        ret = do_remove(path, true);
+    return stats_end(journal_end(ret));
+}
+
+// 把 old_parent 中指向 ino 的条目 old_name 移动为 new_parent 中的 new_name，
+// 目标已存在时 target 是它的 inode 号，否则为 DCACHE_NEGATIVE
+//
+// 调用时持有 ns_lock 以及两个父目录、ino 和 target 的写锁
+static int rename_entry(uint32_t old_parent, const char* old_name, uint32_t new_parent, const char* new_name,
+                        uint32_t ino, uint32_t target) {
+    struct inode inode;
+    int ret = inode_read(ino, &inode);
+    if (ret)
+        return ret;
+
+    if (target != DCACHE_NEGATIVE) {
+        // 目标已存在时覆盖它：直接让原来的目录项指向被移动的 inode，再释放目标
+        if (target == ino)
+            return 0;
+        struct inode victim;
+        if ((ret = inode_read(target, &victim)))
+            return ret;
+        if (S_ISDIR(victim.mode) && !S_ISDIR(inode.mode))
+            return -EISDIR;
+        if (!S_ISDIR(victim.mode) && S_ISDIR(inode.mode))
+            return -ENOTDIR;
+        if (S_ISDIR(victim.mode) && (ret = dir_check_empty(&victim)))
+            return ret;
+        if ((ret = inode_truncate_slice(target, &victim, 0)) || (ret = dir_replace(new_parent, new_name, ino)) ||
+            (ret = inode_free(target)))
+            return ret;
+        handle_forget(target);
+        if (S_ISDIR(victim.mode))
+            dcache_purge_dir(target);
+    } else {
+        // 先加入新目录项，失败时旧的目录项还在，文件系统不会被破坏
+        if ((ret = dir_add(new_parent, new_name, ino)))
+            return ret;
+    }
+    if ((ret = dir_remove(old_parent, old_name)))
+        return ret;
+    dcache_insert(old_parent, old_name, DCACHE_NEGATIVE, false);
+    dcache_insert(new_parent, new_name, ino, S_ISDIR(inode.mode));
+    if ((ret = inode_touch(old_parent, "mc")) ||
+        (ret = inode_touch(new_parent, "mc")))
+        return ret;
+    return inode_touch(ino, "c");
+}
+
+static int do_rename(const char* oldpath, const char* newpath) {
+    if (ctl_find(oldpath) != NULL || ctl_find(newpath) != NULL)
+        return -EPERM;
+    uint32_t inos[4];  // 两个父目录、被移动的 inode 和被覆盖的 inode
+    char old_name[NAME_MAX_LEN + 1], new_name[NAME_MAX_LEN + 1];
+    pthread_rwlock_wrlock(&ns_lock);
+    int ret = path_parent(oldpath, &inos[0], old_name);
+    if (ret == 0 && (ret = path_parent(newpath, &inos[1], new_name)) == 0 &&
+        (ret = dir_lookup(inos[0], old_name, &inos[2], NULL)) == 0) {
+        ret = dir_lookup(inos[1], new_name, &inos[3], NULL);
+        if (ret == -ENOENT)
+            inos[3] = DCACHE_NEGATIVE;
+        if (ret == 0 || ret == -ENOENT) {
+            uint64_t locked = inode_lock_set(inos, inos[3] == DCACHE_NEGATIVE ? 3 : 4);
+            ret = rename_entry(inos[0], old_name, inos[1], new_name, inos[2], inos[3]);
+            inode_unlock_set(locked);
+        }
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    return ret;
 }
 
 // 移动一个条目（文件或目录）
@@ -228,9 +2962,131 @@ int fs_rmdir(const char* path) {
 //
 // `mv` 命令会触发该函数
 int fs_rename(const char* oldpath, const char* newpath) {
-    fs_info("fs_rename is called:%s\tnewpath:%s\n", oldpath, newpath);
+    ringlog_info("fs_rename is called:%s\tnewpath:%s\n", oldpath, newpath);
 
-    return 0;
+    stats_begin(STATS_RENAME);
+    if (readonly)
+        return stats_end(-EROFS);
+    journal_begin(JOURNAL_OP_BLOCKS);
+    int ret = do_rename(oldpath, newpath);
+    // 块太多、一个日志操作放不下时分段释放，见 inode_truncate_slice
+    while (ret == 1 && (ret = journal_restart()) == 0)
+        ret = do_rename(oldpath, newpath);
+    return stats_end(journal_end(ret));
+}
+
+static int do_write(uint32_t ino, struct handle* h, const char* buffer, size_t size, off_t offset,
+                    struct fuse_file_info* fi) {
+    struct inode inode;
+    int ret = inode_read(ino, &inode);
+    if (ret)
+        return ret;
+    if (S_ISDIR(inode.mode))
+        return -EISDIR;
+    if (h != NULL ? h->append : fi != NULL && (fi->flags & O_APPEND))
+        offset = inode.size;
+    if ((uint64_t)offset + size > MAX_FILE_SIZE)
+        return -EFBIG;
+    if (inode.flags & INODE_INLINE) {
+        // 写完仍然放得下时直接改 inode，offset 和原来末尾之间的空隙本来就是 0
+        if ((uint64_t)offset + size <= INODE_INLINE_SIZE) {
+            memcpy(inode.inline_data + offset, buffer, size);
+            inode.size = max(inode.size, (uint64_t)offset + size);
+            inode.mtime = inode.ctime = now_ns();
+            if ((ret = inode_write(ino, &inode)))
+                return ret;
+            return size;
+        }
+        if ((ret = inode_uninline(&inode)))
+            return ret;
+    }
+
+    // 空洞一次分配一整段连续的块，新分配的块不需要从磁盘读；
+    // 覆盖写时接着用上一次查到的映射，但缓存的空洞不能直接写，要重新分配，
+    // 读时查到的映射中可能有和快照共享的块，也要重新查（见 inode_map_write）
+    //
+    // 写合并：从块首开始、覆盖了块中所有有效数据（整块覆盖，或者写到原文件末尾之后）的写入，
+    // 块中的旧内容没有用，直接从全 0 的块开始写，省去 read-modify-write；
+    // 停在块中间的写入把这个块留在句柄中，下一次紧接着写时直接接着填，见 handle_hold
+    //
+    // 压缩和去重：覆盖了按组对齐的一整组时先试着压缩（见 inode_write_zipped），
+    // 覆盖了一整块时先在去重索引中找内容相同的块（见 inode_write_deduped），成功时这一段不用再写。
+    // 去重时别的线程随时可能共享刚写完的块，所以不能接着用句柄中缓存的映射
+    size_t done = 0;
+    uint32_t last = (offset + size - 1) / BLOCK_SIZE;
+    struct handle_cursor run;
+    cursor_load(h, &run);
+    if (run.pblk == 0 || !run.writable || dedupe_enabled())
+        run.len = 0;
+    uint32_t held_lblk;
+    struct cache_buf* held = h != NULL ? handle_take(h, &held_lblk) : NULL;
+    bool fresh = false;
+    while (done < size) {
+        uint64_t pos = offset + done;
+        uint32_t lblk = pos / BLOCK_SIZE;
+        size_t in_block = pos % BLOCK_SIZE;
+        size_t len = min(size - done, BLOCK_SIZE - in_block);
+        const uint8_t* data = (const uint8_t*)buffer + done;
+        bool held_here = held != NULL && held_lblk - lblk < COMPRESS_CLUSTER;
+        if (options.compress && in_block == 0 && lblk % COMPRESS_CLUSTER == 0 && size - done >= COMPRESS_CLUSTER_SIZE &&
+            !held_here && (ret = inode_write_zipped(ino, &inode, lblk, data)) != 0) {
+            if (ret < 0)
+                break;
+            done += COMPRESS_CLUSTER_SIZE;
+            run.len = 0;
+            continue;
+        }
+        uint64_t hash = 0;
+        bool whole = dedupe_enabled() && in_block == 0 && len == BLOCK_SIZE && !held_here;
+        if (whole && (ret = inode_write_deduped(ino, &inode, lblk, data, hash = dedupe_hash(data))) != 0) {
+            if (ret < 0)
+                break;
+            done += len;
+            run.len = 0;
+            continue;
+        }
+        // 空间不足时停在已经写完的位置，返回实际写入的字节数
+        if (lblk - run.lblk >= run.len) {
+            if ((ret = inode_map_write(&inode, ino, lblk, last - lblk + 1, &run.pblk, &run.len, &fresh)))
+                break;
+            run.lblk = lblk;
+            run.writable = true;
+        }
+        uint32_t pblk = run.pblk + (lblk - run.lblk);
+        uint64_t valid = inode.size > (uint64_t)lblk * BLOCK_SIZE ? inode.size - (uint64_t)lblk * BLOCK_SIZE : 0;
+        valid = min(valid, BLOCK_SIZE);
+        struct cache_buf* buf;
+        if (held != NULL && held_lblk == lblk && held->block_id == (int)pblk) {
+            buf = held;
+            held = NULL;
+        } else if (fresh || (in_block == 0 && len >= valid)) {
+            buf = cache_zero(pblk);
+        } else {
+            buf = cache_get(pblk);
+        }
+        if (buf == NULL) {
+            ret = -EIO;
+            break;
+        }
+        memcpy(buf->data + in_block, buffer + done, len);
+        cache_dirty(buf);
+        if (whole)
+            dedupe_insert(hash, pblk);
+        done += len;
+        if (done == size && in_block + len < BLOCK_SIZE && h != NULL && handle_hold(h, lblk, buf))
+            break;
+        cache_put(buf);
+    }
+    if (held != NULL)
+        cache_put(held);
+    if (done == 0 && ret)
+        return ret;
+    cursor_save(h, &run);
+    inode.size = max(inode.size, (uint64_t)offset + done);
+    inode.mtime = inode.ctime = now_ns();
+    if ((ret = inode_write(ino, &inode)))
+        return ret;
+    return done;
 }
 
 // 从 offset 开始写入 size 字节的内容到文件中
@@ -250,9 +3106,70 @@ int fs_rename(const char* oldpath, const char* newpath) {
 //
 // `echo "hello world" > test.txt` 命令会触发这个函数
 int fs_write(const char* path, const char* buffer, size_t size, off_t offset, struct fuse_file_info* fi) {
-    fs_info("fs_write is called:%s\tsize:%d\toffset:%d\n", path, size, offset);
+    ringlog_info("fs_write is called:%s\tsize:%zu\toffset:%jd\n", path, size, (intmax_t)offset);
 
-    return 0;
+    stats_begin(STATS_WRITE);
+    const struct ctl_file* ctl = ctl_find(path);
+    if (ctl != NULL)
+        return stats_end(ctl->write != NULL ? ctl->write(buffer, size, offset) : -EACCES);
+    if (readonly)
+        return stats_end(-EROFS);
+    journal_begin(JOURNAL_OP_BLOCKS);
+    uint32_t ino;
+    struct handle* h;
+    int ret = file_lock(path, fi, true, &ino, &h);
+    if (ret == 0) {
+        ret = do_write(ino, h, buffer, size, offset, fi);
+        inode_unlock(ino);
+    }
+    return stats_end(journal_end(ret));
+}
+
+static int do_truncate(uint32_t ino, off_t size) {
+    struct inode inode;
+    int ret = inode_read(ino, &inode);
+    if (ret)
+        return ret;
+    if (S_ISDIR(inode.mode))
+        return -EISDIR;
+    if ((uint64_t)size > MAX_FILE_SIZE)
+        return -EFBIG;
+
+    // 变大时不分配数据块，新增的部分是空洞，读出来全是 0
+    if ((inode.flags & INODE_INLINE) && (uint64_t)size <= INODE_INLINE_SIZE) {
+        if ((uint64_t)size < inode.size)
+            memset(inode.inline_data + size, 0, inode.size - size);
+    } else if (inode.flags & INODE_INLINE) {
+        if ((ret = inode_uninline(&inode)))
+            return ret;
+    } else if ((uint64_t)size < inode.size) {
+        handle_drop(ino);
+        alloc_release(&block_bitmap, ino);
+        // 压缩的组只能整个释放，新的末尾落在组的中间时先解压
+        uint64_t from = ceil_div((uint64_t)size, BLOCK_SIZE);
+        uint32_t zip, zip_len;
+        if (from % COMPRESS_CLUSTER && (ret = extent_lookup(&inode, from, &zip, &zip_len)) == 0 && (zip & EXTENT_ZIP))
+            ret = inode_unzip(&inode, from, zip);
+        if (ret || (ret = inode_truncate_slice(ino, &inode, from)))
+            return ret;
+        // 最后一个块中超出新大小的部分清零，以免之后再变大时读到旧数据；这个块和快照共享时先复制一份
+        uint32_t pblk, len;
+        bool fresh;
+        if (size % BLOCK_SIZE && (ret = inode_bmap(&inode, size / BLOCK_SIZE, false, &pblk)) == 0 && pblk &&
+            (ret = inode_map_write(&inode, ALLOC_NO_OWNER, size / BLOCK_SIZE, 1, &pblk, &len, &fresh)) == 0) {
+            struct cache_buf* buf = cache_get(pblk);
+            if (buf == NULL)
+                return -EIO;
+            memset(buf->data + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+            cache_dirty(buf);
+            cache_put(buf);
+        }
+        if (ret)
+            return ret;
+    }
+    inode.size = size;
+    inode.mtime = inode.ctime = now_ns();
+    return inode_write(ino, &inode);
 }
 
 // 修改一个文件的大小（即分配或释放数据块）
@@ -268,9 +3185,43 @@ int fs_write(const char* path, const char* buffer, size_t size, off_t offset, st
 // 2. 分配或释放数据块（以及 inode 中的记录）
 // 3. 修改 inode 的 ctime
 int fs_truncate(const char* path, off_t size) {
-    fs_info("fs_truncate is called:%s\tsize:%d\n", path, size);
+    ringlog_info("fs_truncate is called:%s\tsize:%jd\n", path, (intmax_t)size);
 
-    return 0;
+    stats_begin(STATS_TRUNCATE);
+    // 往控制文件中写命令时 shell 会先截断它，什么也不用做
+    const struct ctl_file* ctl = ctl_find(path);
+    if (ctl != NULL)
+        return stats_end(ctl->write != NULL ? 0 : -EACCES);
+    if (readonly)
+        return stats_end(-EROFS);
+    journal_begin(JOURNAL_OP_BLOCKS);
+    int ret;
+    // 一次释放的块太多、一个日志操作放不下时分段进行，见 inode_truncate_slice
+    do {
+        uint32_t ino;
+        if ((ret = path_lock(path, true, &ino)) == 0) {
+            ret = do_truncate(ino, size);
+            inode_unlock(ino);
+        }
+    } while (ret == 1 && (ret = journal_restart()) == 0);
+    return stats_end(journal_end(ret));
+}
+
+static int do_utimens(uint32_t ino, const struct timespec tv[2]) {
+    struct inode inode;
+    int ret = inode_read(ino, &inode);
+    if (ret)
+        return ret;
+    int64_t now = now_ns();
+    int64_t* times[2] = {&inode.atime, &inode.mtime};
+    for (int i = 0; i < 2; ++i) {
+        if (tv == NULL || tv[i].tv_nsec == UTIME_NOW)
+            *times[i] = now;
+        else if (tv[i].tv_nsec != UTIME_OMIT)
+            *times[i] = ts_to_ns(tv[i]);
+    }
+    inode.ctime = now;
+    return inode_write(ino, &inode);
 }
 
 // 修改条目的 atime 和 mtime
@@ -280,9 +3231,21 @@ int fs_truncate(const char* path, off_t size) {
 // 2. 根据传入的 tv 参数（分别是 atime 和 mtime）修改 inode 的 atime 和 mtime
 // 3. 更新 inode 的 ctime（因为 utimens 本身修改了元数据）
 int fs_utimens(const char* path, const struct timespec tv[2]) {
-    fs_info("fs_utimens is called:%s\n", path);
+    ringlog_info("fs_utimens is called:%s\n", path);
 
-    return 0;
+    stats_begin(STATS_UTIMENS);
+    if (ctl_find(path) != NULL)
+        return stats_end(0);
+    if (readonly)
+        return stats_end(-EROFS);
+    journal_begin(JOURNAL_OP_BLOCKS);
+    uint32_t ino;
+    int ret = path_lock(path, true, &ino);
+    if (ret == 0) {
+        ret = do_utimens(ino, tv);
+        inode_unlock(ino);
+    }
+    return stats_end(journal_end(ret));
 }
 
 // 获取文件系统的状态
@@ -291,23 +3254,49 @@ int fs_utimens(const char* path, const struct timespec tv[2]) {
 //
 // `df mnt` 和 `df -i mnt` 会触发这个函数
 int fs_statfs(const char* path, struct statvfs* stat) {
-    fs_info("fs_statfs is called:%s\n", path);
+    ringlog_info("fs_statfs is called:%s\n", path);
 
+    stats_begin(STATS_STATFS);
+    // 等待提交的被释放的块也算作空闲，删除之后 df 立即可以看到空间被释放。
+    // 共享（去重和快照）和压缩省下的块算进总块数，df 看到的已用空间是文件内容的逻辑大小，
+    // 总大小比磁盘大出的部分就是省下的空间
+    uint32_t bfree = __atomic_load_n(&block_bitmap.free, __ATOMIC_RELAXED) + journal_freeing();
+    uint32_t saved = refcount_total() + __atomic_load_n(&sb.zip_saved, __ATOMIC_RELAXED);
     *stat = (struct statvfs){
-        .f_bsize = 0,   // 块大小（字节记）
-        .f_blocks = 0,  // 总数据块数
-        .f_bfree = 0,   // 空闲的数据块数量（包括 root 用户可用的）
-        .f_bavail = 0,  // 空闲的数据块数量（不包括 root 用户可用的）
-        // 由于我们要求实现权限管理，上面两个值应该是相同的
-        .f_files = 0,    // 文件系统可以创建的条目数量（相当于 inode 数量）
-        .f_ffree = 0,    // 空闲的 inode 数量（包括 root 用户可用的）
-        .f_favail = 0,   // 空闲的 inode 数量（不包括 root 用户可用的）
-        .f_namemax = 0,  // 文件名的最大长度
+        .f_bsize = BLOCK_SIZE,
+        .f_blocks = BLOCK_NUM - DATA_START + saved,
+        .f_bfree = bfree,
+        .f_bavail = bfree,
+        .f_files = INODE_NUM,
+        .f_ffree = __atomic_load_n(&inode_bitmap.free, __ATOMIC_RELAXED),
+        .f_favail = __atomic_load_n(&inode_bitmap.free, __ATOMIC_RELAXED),
+        .f_namemax = NAME_MAX_LEN,
+        .f_flag = readonly ? ST_RDONLY : 0,
     };
 
-    // 这里的块数量是以最开头 `f_bsize` 的块大小记的
-    // 如果你实现了稀疏文件，这里的块指的都是实际分配的块
+    return stats_end(0);
+}
 
+// 解析 path 并为它分配一个句柄，句柄的编号放进 fi->fh，见 handle.h
+//
+// 句柄用完时 fi->fh 为 0，之后的操作退回到按路径查找，打开本身不会失败
+static int do_open(const char* path, struct fuse_file_info* fi, bool append) {
+    const struct ctl_file* ctl = ctl_find(path);
+    if (ctl != NULL) {
+        int mode = fi->flags & O_ACCMODE;
+        if ((mode != O_WRONLY && ctl->read == NULL) || (mode != O_RDONLY && ctl->write == NULL))
+            return -EACCES;
+        fi->fh = 0;
+        fi->direct_io = 1;
+        return 0;
+    }
+    uint32_t ino;
+    int ret = path_lock(path, false, &ino);
+    if (ret)
+        return ret;
+    if (handle_open(ino, append, &fi->fh))
+        fi->fh = 0;
+    inode_unlock(ino);
     return 0;
 }
 
@@ -316,33 +3305,58 @@ int fs_statfs(const char* path, struct statvfs* stat) {
 // 参考实现：
 // 不考虑 `fs->fh` 时，这个函数事实上可以什么都不干
 int fs_open(const char* path, struct fuse_file_info* fi) {
-    fs_info("fs_open is called:%s\tflag:%o\n", path, fi->flags);
+    ringlog_info("fs_open is called:%s\tflag:%o\n", path, fi->flags);
 
-    return 0;
+    stats_begin(STATS_OPEN);
+    return stats_end(do_open(path, fi, fi->flags & O_APPEND));
 }
 
 // 会在一个文件被关闭时被调用，你可以在这里做相对于 `fs_open` 的一些清理工作
 int fs_release(const char* path, struct fuse_file_info* fi) {
-    fs_info("fs_release is called:%s\n", path);
+    ringlog_info("fs_release is called:%s\n", path);
 
-    return 0;
+    stats_begin(STATS_RELEASE);
+    handle_close(fi->fh);
+    return stats_end(0);
 }
 
-// 类似于 `fs_open`，本实验中可以不做任何处理
+// 类似于 `fs_open`，之后的 readdir 通过句柄直接找到目录
 int fs_opendir(const char* path, struct fuse_file_info* fi) {
-    fs_info("fs_opendir is called:%s\n", path);
+    ringlog_info("fs_opendir is called:%s\n", path);
 
-    return 0;
+    stats_begin(STATS_OPENDIR);
+    return stats_end(do_open(path, fi, false));
 }
 
-// 类似于 `fs_release`，本实验中可以不做任何处理
+// 类似于 `fs_release`
 int fs_releasedir(const char* path, struct fuse_file_info* fi) {
-    fs_info("fs_releasedir is called:%s\n", path);
+    ringlog_info("fs_releasedir is called:%s\n", path);
 
-    return 0;
+    stats_begin(STATS_RELEASEDIR);
+    handle_close(fi->fh);
+    return stats_end(0);
+}
+
+// 启动后台线程（块设备的 I/O 线程和预读线程）
+//
+// 不能在 fs_mount 中启动：不带 -f 挂载时 fuse_main 在 fs_mount 之后 fork 到后台，线程不会跟到子进程中，
+// 提交给 I/O 线程的请求就永远等不到完成。init 回调在 fork 之后调用。启动失败时不影响正确性：
+// 没有 I/O 线程时提交者自己完成请求，没有预读线程时预读请求被丢掉
+static void* fs_init(struct fuse_conn_info* conn) {
+    (void)conn;
+    if (blkdev_start(options.io_workers))
+        fs_warning("fs_init: cannot start I/O workers\n");
+    if (options.readahead > 0 && readahead_init())
+        fs_warning("fs_init: cannot start readahead\n");
+    if (ringlog_start())
+        fs_warning("fs_init: cannot start ringlog\n");
+    return NULL;
 }
 
-static struct fuse_operations fs_operations = {.getattr = fs_getattr,
+// libfuse 2.9 没有 lseek 回调，SEEK_DATA/SEEK_HOLE 由内核回答，它把整个文件都当作数据。
+// 空洞读出来是 0 且不读盘（见 do_read），所以把空洞当作数据读一遍的代价只是拷贝
+static struct fuse_operations fs_operations = {.init = fs_init,
+                                               .getattr = fs_getattr,
                                                .readdir = fs_readdir,
                                                .read = fs_read,
                                                .mkdir = fs_mkdir,
@@ -366,8 +3380,8 @@ int main(int argc, char* argv[]) {
     // 通过 make mount 或者 make debug 启动时，该值为 1
     // 通过 make mount_noinit 或者 make debug_noinit 启动时，该值为 0
 
-    if (disk_mount(init_flag)) {  // 不需要修改
-        fs_error("disk_mount failed!\n");
+    if (blkdev_mount(init_flag)) {  // 按 FS_BACKEND 选择块设备后端，默认就是 disk_mount，见 blkdev.h
+        fs_error("blkdev_mount failed!\n");
         return -1;
     }
 
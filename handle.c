@@ -0,0 +1,144 @@
+#include "handle.h"
+
+#include <errno.h>
+#include <stddef.h>
+
+static struct handle handles[HANDLE_NUM];
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static int free_head;
+static uint32_t held_max;
+static uint32_t held_count;  // 所有句柄留住的块数
+
+void handle_init(uint32_t max_held) {
+    held_max = max_held;
+    held_count = 0;
+    for (int i = 0; i < HANDLE_NUM; ++i) {
+        handles[i].ino = HANDLE_STALE;
+        handles[i].held = NULL;
+        handles[i].next_free = i + 1 < HANDLE_NUM ? i + 1 : -1;
+        pthread_mutex_init(&handles[i].lock, NULL);
+    }
+    free_head = 0;
+}
+
+int handle_open(uint32_t ino, bool append, uint64_t* fh) {
+    pthread_mutex_lock(&table_lock);
+    int i = free_head;
+    if (i < 0) {
+        pthread_mutex_unlock(&table_lock);
+        return -ENFILE;
+    }
+    free_head = handles[i].next_free;
+    struct handle* h = &handles[i];
+    h->next_free = -1;
+    h->append = append;
+    h->cursor = (struct handle_cursor){0};
+    h->ra_next = 0;
+    h->ra_end = 0;
+    __atomic_store_n(&h->ino, ino, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&table_lock);
+    *fh = i + 1;
+    return 0;
+}
+
+// 放掉句柄留住的块
+static void unhold(struct handle* h) {
+    uint32_t lblk;
+    struct cache_buf* buf = handle_take(h, &lblk);
+    if (buf != NULL)
+        cache_put(buf);
+}
+
+void handle_close(uint64_t fh) {
+    struct handle* h = handle_get(fh);
+    if (h == NULL)
+        return;
+    unhold(h);
+    pthread_mutex_lock(&table_lock);
+    __atomic_store_n(&h->ino, HANDLE_STALE, __ATOMIC_RELAXED);
+    h->next_free = free_head;
+    free_head = h - handles;
+    pthread_mutex_unlock(&table_lock);
+}
+
+struct handle* handle_get(uint64_t fh) {
+    if (fh == 0 || fh > HANDLE_NUM)
+        return NULL;
+    return &handles[fh - 1];
+}
+
+uint32_t handle_ino(struct handle* h) {
+    return __atomic_load_n(&h->ino, __ATOMIC_ACQUIRE);
+}
+
+void handle_forget(uint32_t ino) {
+    handle_drop(ino);
+    pthread_mutex_lock(&table_lock);
+    for (int i = 0; i < HANDLE_NUM; ++i) {
+        if (handles[i].ino == ino)
+            __atomic_store_n(&handles[i].ino, HANDLE_STALE, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&table_lock);
+}
+
+void handle_drop(uint32_t ino) {
+    if (held_max == 0)
+        return;
+    for (int i = 0; i < HANDLE_NUM; ++i) {
+        if (handle_ino(&handles[i]) == ino)
+            unhold(&handles[i]);
+    }
+}
+
+bool handle_cursor_load(struct handle* h, uint64_t version, struct handle_cursor* cursor) {
+    pthread_mutex_lock(&h->lock);
+    *cursor = h->cursor;
+    pthread_mutex_unlock(&h->lock);
+    return cursor->len > 0 && cursor->version == version;
+}
+
+void handle_cursor_save(struct handle* h, const struct handle_cursor* cursor) {
+    pthread_mutex_lock(&h->lock);
+    h->cursor = *cursor;
+    pthread_mutex_unlock(&h->lock);
+}
+
+bool handle_readahead(struct handle* h, uint64_t offset, uint64_t end, uint32_t next_lblk, uint32_t window,
+                      uint32_t* from, uint32_t* to) {
+    pthread_mutex_lock(&h->lock);
+    bool sequential = offset == h->ra_next;
+    h->ra_next = end;
+    if (!sequential)
+        h->ra_end = 0;
+    *from = h->ra_end > next_lblk ? h->ra_end : next_lblk;
+    *to = next_lblk + window < next_lblk ? UINT32_MAX : next_lblk + window;
+    bool issue = sequential && *from < *to;
+    if (issue)
+        h->ra_end = *to;
+    pthread_mutex_unlock(&h->lock);
+    return issue;
+}
+
+bool handle_hold(struct handle* h, uint32_t lblk, struct cache_buf* buf) {
+    unhold(h);
+    if (__atomic_add_fetch(&held_count, 1, __ATOMIC_RELAXED) > held_max) {
+        __atomic_sub_fetch(&held_count, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    pthread_mutex_lock(&h->lock);
+    h->held = buf;
+    h->held_lblk = lblk;
+    pthread_mutex_unlock(&h->lock);
+    return true;
+}
+
+struct cache_buf* handle_take(struct handle* h, uint32_t* lblk) {
+    pthread_mutex_lock(&h->lock);
+    struct cache_buf* buf = h->held;
+    *lblk = h->held_lblk;
+    h->held = NULL;
+    pthread_mutex_unlock(&h->lock);
+    if (buf != NULL)
+        __atomic_sub_fetch(&held_count, 1, __ATOMIC_RELAXED);
+    return buf;
+}
@@ -0,0 +1,96 @@
+#ifndef HANDLE_H
+#define HANDLE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cache.h"
+
+// 打开文件表
+//
+// fs_open/fs_opendir 解析一次路径，把 inode 号等信息记在一个句柄中，句柄的编号放进 fi->fh。
+// 之后同一次打开的 read/write/readdir 直接从句柄找到 inode，不需要再逐级解析路径
+//
+// 句柄从一个固定大小的数组中分配（用空闲链表管理），fi->fh 是下标加 1，
+// 0 表示没有句柄（比如句柄用完了），此时退回到按路径查找
+//
+// 多线程：分配和释放由表的锁保护；句柄中的 inode 号只在打开时写入、在文件被删除时作废，
+// 读写它用原子操作；游标、预读状态和留住的块由句柄自己的锁保护，同一个句柄可能被多个线程同时使用
+#define HANDLE_NUM 64
+
+// 句柄的 inode 已经被删除
+#define HANDLE_STALE UINT32_MAX
+
+// 上一次读写时查到的一段映射：逻辑块 [lblk, lblk + len) 对应物理块 [pblk, pblk + len)，pblk 为 0 表示空洞
+//
+// version 是查到这段映射时全局的映射版本号，任何文件的映射改变都会使版本号增加，
+// 版本号不同的游标不能再用
+//
+// writable 表示这段映射中的块既不共享（和快照或者去重，见 refcount.h）也不是压缩的，写的时候可以直接用；
+// 读时查到的映射没有检查过，有共享或压缩的块时不能直接拿来写
+struct handle_cursor {
+    uint64_t version;
+    uint32_t lblk;
+    uint32_t pblk;
+    uint32_t len;
+    bool writable;
+};
+
+struct handle {
+    uint32_t ino;
+    bool append;  // 以 O_APPEND 打开
+    int next_free;  // 空闲链表，-1 表示链表结束
+    pthread_mutex_t lock;  // 保护下面的字段
+    struct handle_cursor cursor;
+    uint64_t ra_next;  // 上一次读结束的位置（字节），下一次读从这里开始就是顺序读
+    uint32_t ra_end;  // 已经提交预读的逻辑块的末尾
+    uint32_t held_lblk;  // 留住的块的逻辑块号
+    struct cache_buf* held;  // 写合并时留住（钉住）的块，见 handle_hold
+};
+
+// max_held 是所有句柄同时留住的块数的上限，0 表示不留
+void handle_init(uint32_t max_held);
+
+// 为 ino 分配一个句柄，编号通过 *fh 返回，句柄用完时返回 -ENFILE
+//
+// 调用时需持有 ino 的锁，这样不会和删除它的操作交错，见 handle_forget
+int handle_open(uint32_t ino, bool append, uint64_t* fh);
+
+// 释放编号为 fh 的句柄，fh 为 0 时什么也不做
+void handle_close(uint64_t fh);
+
+// 找到编号为 fh 的句柄，fh 为 0 或无效时返回 NULL
+struct handle* handle_get(uint64_t fh);
+
+// 句柄对应的 inode 号，inode 已经被删除时返回 HANDLE_STALE
+uint32_t handle_ino(struct handle* h);
+
+// inode 被删除了，作废所有指向它的句柄并放掉它们留住的块，调用时需持有 ino 的写锁
+void handle_forget(uint32_t ino);
+
+// 放掉所有指向 ino 的句柄留住的块，在释放 ino 的数据块之前调用，调用时需持有 ino 的写锁
+void handle_drop(uint32_t ino);
+
+// 取出句柄中仍然有效（版本号等于 version）的游标，无效时返回 false
+bool handle_cursor_load(struct handle* h, uint64_t version, struct handle_cursor* cursor);
+
+// 保存游标，供同一个句柄的下一次读写使用
+void handle_cursor_save(struct handle* h, const struct handle_cursor* cursor);
+
+// 记录一次 [offset, end) 的读，如果它紧接着上一次读（顺序读），算出需要预读的逻辑块 [*from, *to)：
+// 从 next_lblk 开始的 window 块，去掉之前已经提交过预读的部分。不需要预读时返回 false
+bool handle_readahead(struct handle* h, uint64_t offset, uint64_t end, uint32_t next_lblk, uint32_t window,
+                      uint32_t* from, uint32_t* to);
+
+// 写合并：一次写停在块中间时，句柄把这个块留在缓存中（保持钉住），下一次接着写时直接使用，
+// 这个块不会在两次写之间被淘汰，也就不需要写回再读入（read-modify-write）。
+// 留住的块数达到上限时返回 false，此时 buf 仍由调用者释放；成功时 buf 归句柄所有
+//
+// 句柄原来留住的块会先被放掉。调用时需持有 inode 的写锁，留住的块只在写锁下修改
+bool handle_hold(struct handle* h, uint32_t lblk, struct cache_buf* buf);
+
+// 取出句柄留住的块，块号通过 *lblk 返回，没有时返回 NULL；取出的块由调用者释放或者再交给 handle_hold
+struct cache_buf* handle_take(struct handle* h, uint32_t* lblk);
+
+#endif
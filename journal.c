@@ -0,0 +1,330 @@
+#include "journal.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "blkdev.h"
+#include "logger.h"
+
+#define JOURNAL_NONE UINT32_MAX  // 事务中已经被释放的块
+
+// 日志头，count 为 0 表示没有需要重放的事务
+struct journal_header {
+    uint32_t count;
+    uint32_t blocks[JOURNAL_SLOTS];  // 日志区第 i + 1 块应该写回的位置
+};
+
+struct journal_free_run {
+    uint32_t start;
+    uint32_t len;
+};
+
+// 除了 start 和 free_fn，其它字段都由 lock 保护
+static struct {
+    int start;
+    journal_free_fn free_fn;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;  // 操作结束或提交结束
+    uint32_t count;
+    uint32_t blocks[JOURNAL_SLOTS];
+    uint32_t reserved;  // 正在进行的操作预留的块数之和
+    int outstanding;  // 正在进行的操作数
+    bool committing;
+    bool pending;  // 需要提交，新的操作要等到提交结束
+    bool started;  // 当前事务中已经有操作开始过
+    int64_t begin_ns;  // 当前事务中第一个操作开始的时间
+    int nfrees;
+    uint32_t freeing;  // frees 中的总块数
+    struct journal_free_run frees[JOURNAL_MAX_FREES];
+} journal;
+
+// 当前线程的操作预留的块数
+static __thread uint32_t reserved_blocks;
+
+static int64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int find_slot(int block_id) {
+    for (uint32_t i = 0; i < journal.count; ++i) {
+        if (journal.blocks[i] == (uint32_t)block_id)
+            return i;
+    }
+    return -1;
+}
+
+// 写入日志头，count 之后的部分保持为 0
+static int write_header(uint32_t count) {
+    struct cache_buf* buf = cache_zero(journal.start);
+    if (buf == NULL)
+        return -EIO;
+    struct journal_header* header = (struct journal_header*)buf->data;
+    header->count = count;
+    memcpy(header->blocks, journal.blocks, count * sizeof(uint32_t));
+    int ret = blkdev_write(journal.start, buf->data) ? -EIO : 0;
+    buf->dirty = false;
+    cache_put(buf);
+    cache_forget(journal.start);
+    return ret;
+}
+
+// 事务已经写回原位置，清空日志头。写回的块要先落盘，之后日志区才能被下一个事务覆盖，
+// 而下一个事务写日志区之前清空的日志头也要先落盘，否则崩溃后会用新的内容重放旧的事务
+static int clear_header(void) {
+    if (blkdev_sync())
+        return -EIO;
+    int ret = write_header(0);
+    if (ret == 0 && blkdev_sync())
+        ret = -EIO;
+    return ret;
+}
+
+void journal_init(int start, journal_free_fn free_fn) {
+    memset(&journal, 0, sizeof(journal));
+    journal.start = start;
+    journal.free_fn = free_fn;
+    pthread_mutex_init(&journal.lock, NULL);
+    pthread_cond_init(&journal.changed, NULL);
+}
+
+int journal_recover(void) {
+    struct cache_buf* buf = cache_get(journal.start);
+    if (buf == NULL)
+        return -EIO;
+    struct journal_header* header = (struct journal_header*)buf->data;
+    uint32_t count = header->count;
+    if (count > JOURNAL_SLOTS) {
+        cache_put(buf);
+        fs_error("journal: bad header\n");
+        return -EIO;
+    }
+    memcpy(journal.blocks, header->blocks, count * sizeof(uint32_t));
+    cache_put(buf);
+    cache_forget(journal.start);
+    if (count == 0)
+        return 0;
+
+    fs_info("journal: replaying %u blocks\n", count);
+    for (uint32_t i = 0; i < count; ++i) {
+        if (journal.blocks[i] == JOURNAL_NONE)
+            continue;
+        if ((buf = cache_get(journal.start + 1 + i)) == NULL)
+            return -EIO;
+        int ret = blkdev_write(journal.blocks[i], buf->data);
+        cache_put(buf);
+        cache_forget(journal.start + 1 + i);
+        if (ret)
+            return -EIO;
+    }
+    return clear_header();
+}
+
+// 事务中还能不能再放下 blocks 块，总是为提交时释放延迟的块留出空间
+static bool has_room(uint32_t blocks) {
+    return journal.count + journal.reserved + blocks + JOURNAL_FREE_BLOCKS <= JOURNAL_SLOTS;
+}
+
+// 提交当前事务，apply_frees 表示是否先释放延迟释放的块
+//
+// 调用时 journal.committing 为真且没有其它操作在进行，所以不需要持有锁，
+// 只有修改 count 时要加锁，因为块缓存会在别的线程中调用 journal_locate
+static int do_commit(bool apply_frees) {
+    int ret = 0;
+    if (apply_frees) {
+        // 释放时修改的位图和释放它们的操作在同一个事务中提交
+        for (int i = 0; i < journal.nfrees; ++i) {
+            if (journal.free_fn(journal.frees[i].start, journal.frees[i].len))
+                ret = -EIO;
+        }
+        pthread_mutex_lock(&journal.lock);
+        journal.nfrees = 0;
+        journal.freeing = 0;
+        pthread_mutex_unlock(&journal.lock);
+    }
+    if (journal.count == 0)
+        return ret;
+    // 写回所有脏块：数据块写回原位置，事务中的块写到日志区（见 journal_locate）
+    // 日志头要在事务中的块都落盘之后写，写回原位置要在日志头落盘之后开始
+    if (cache_flush() || blkdev_sync())
+        return -EIO;
+    if ((ret = write_header(journal.count)) != 0)
+        return ret;
+    if (blkdev_sync())
+        return -EIO;
+
+    // 已经提交，把事务中的块写回原位置，不在缓存中的块会从日志区读入。
+    // 每次处理一组：先一批读入不在缓存中的块，再一批写回，同时至多钉住 CACHE_PREFETCH_MAX 块
+    for (uint32_t i = 0; i < journal.count; i += CACHE_PREFETCH_MAX) {
+        int ids[CACHE_PREFETCH_MAX];
+        struct cache_buf* bufs[CACHE_PREFETCH_MAX];
+        struct blkdev_req reqs[CACHE_PREFETCH_MAX];
+        int n = 0, got = 0;
+        for (uint32_t j = i; j < journal.count && j < i + CACHE_PREFETCH_MAX; ++j) {
+            if (journal.blocks[j] != JOURNAL_NONE)
+                ids[n++] = journal.blocks[j];
+        }
+        cache_prefetch(ids, n);
+        for (; got < n; ++got) {
+            if ((bufs[got] = cache_get(ids[got])) == NULL)
+                break;
+            reqs[got] = (struct blkdev_req){BLKDEV_WRITE, ids[got], bufs[got]->data, 0};
+        }
+        if (got < n || blkdev_submit(reqs, got))
+            ret = -EIO;
+        for (int k = 0; k < got; ++k) {
+            bufs[k]->dirty = false;
+            cache_put(bufs[k]);
+        }
+        if (ret)
+            return ret;
+    }
+    pthread_mutex_lock(&journal.lock);
+    journal.count = 0;
+    pthread_mutex_unlock(&journal.lock);
+    return clear_header();
+}
+
+// 在当前线程中提交，调用时持有锁且没有正在进行的提交，提交期间释放锁
+static int commit_exclusive(bool apply_frees) {
+    journal.committing = true;
+    journal.pending = false;
+    pthread_mutex_unlock(&journal.lock);
+    int ret = do_commit(apply_frees);
+    pthread_mutex_lock(&journal.lock);
+    journal.committing = false;
+    journal.started = false;
+    pthread_cond_broadcast(&journal.changed);
+    return ret;
+}
+
+void journal_begin(uint32_t blocks) {
+    pthread_mutex_lock(&journal.lock);
+    while (journal.committing || journal.pending || !has_room(blocks) || journal.outstanding == JOURNAL_MAX_OPS) {
+        if (!journal.committing && journal.outstanding == 0) {
+            // 没有操作会在结束时提交，只能自己提交
+            if (commit_exclusive(true)) {
+                fs_error("journal: commit failed\n");
+                break;
+            }
+            continue;
+        }
+        pthread_cond_wait(&journal.changed, &journal.lock);
+    }
+    if (!journal.started) {
+        journal.started = true;
+        journal.begin_ns = monotonic_ns();
+    }
+    journal.outstanding++;
+    journal.reserved += blocks;
+    reserved_blocks = blocks;
+    pthread_mutex_unlock(&journal.lock);
+}
+
+int journal_end(int ret) {
+    pthread_mutex_lock(&journal.lock);
+    journal.outstanding--;
+    journal.reserved -= reserved_blocks;
+    reserved_blocks = 0;
+    bool full = journal.count + JOURNAL_OP_BLOCKS + JOURNAL_FREE_BLOCKS > JOURNAL_SLOTS ||
+                journal.nfrees > JOURNAL_MAX_FREES / 2;
+    bool expired = (journal.count > 0 || journal.nfrees > 0) && monotonic_ns() - journal.begin_ns >= JOURNAL_COMMIT_NS;
+    if (full || expired)
+        journal.pending = true;
+    int cret = 0;
+    if (journal.pending && journal.outstanding == 0 && !journal.committing)
+        cret = commit_exclusive(true);
+    else
+        pthread_cond_broadcast(&journal.changed);
+    pthread_mutex_unlock(&journal.lock);
+    return ret < 0 || cret == 0 ? ret : cret;
+}
+
+void journal_dirty(struct cache_buf* buf) {
+    cache_dirty(buf);
+    pthread_mutex_lock(&journal.lock);
+    if (find_slot(buf->block_id) < 0) {
+        if (journal.count == JOURNAL_SLOTS && !journal.committing && journal.outstanding == 1) {
+            // 单个操作修改的块超过了预留的空间，只能在操作中间提交，这个操作不再是原子的。
+            // 调用者可能持有分配器的锁，所以这次提交不释放延迟释放的块
+            fs_warning("journal: transaction full, committing in the middle of an operation\n");
+            if (commit_exclusive(false))
+                fs_error("journal: commit failed\n");
+        }
+        if (journal.count < JOURNAL_SLOTS)
+            journal.blocks[journal.count++] = buf->block_id;
+        else
+            fs_error("journal: transaction full, block %d is written back without journaling\n", buf->block_id);
+    }
+    pthread_mutex_unlock(&journal.lock);
+}
+
+void journal_forget(int block_id) {
+    pthread_mutex_lock(&journal.lock);
+    int i = find_slot(block_id);
+    if (i >= 0)
+        journal.blocks[i] = JOURNAL_NONE;
+    pthread_mutex_unlock(&journal.lock);
+}
+
+int journal_free(uint32_t start, uint32_t len) {
+    pthread_mutex_lock(&journal.lock);
+    // 截断和删除时从后往前释放一个文件的块，和上一段相连时合并成一段，大文件也只占几项
+    struct journal_free_run* last = journal.nfrees > 0 ? &journal.frees[journal.nfrees - 1] : NULL;
+    if (last != NULL && (start + len == last->start || last->start + last->len == start)) {
+        if (start < last->start)
+            last->start = start;
+        last->len += len;
+        journal.freeing += len;
+        pthread_mutex_unlock(&journal.lock);
+        return 0;
+    }
+    int ret = -ENOSPC;
+    if (journal.nfrees < JOURNAL_MAX_FREES) {
+        journal.frees[journal.nfrees++] = (struct journal_free_run){start, len};
+        journal.freeing += len;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&journal.lock);
+    return ret;
+}
+
+bool journal_free_full(void) {
+    pthread_mutex_lock(&journal.lock);
+    bool full = journal.nfrees > JOURNAL_MAX_FREES / 2;
+    pthread_mutex_unlock(&journal.lock);
+    return full;
+}
+
+int journal_restart(void) {
+    uint32_t blocks = reserved_blocks;
+    int ret = journal_end(0);
+    journal_begin(blocks);
+    return ret;
+}
+
+uint32_t journal_freeing(void) {
+    pthread_mutex_lock(&journal.lock);
+    uint32_t freeing = journal.freeing;
+    pthread_mutex_unlock(&journal.lock);
+    return freeing;
+}
+
+int journal_commit(void) {
+    pthread_mutex_lock(&journal.lock);
+    while (journal.committing || journal.outstanding > 0)
+        pthread_cond_wait(&journal.changed, &journal.lock);
+    int ret = commit_exclusive(true);
+    pthread_mutex_unlock(&journal.lock);
+    return ret;
+}
+
+int journal_locate(int block_id) {
+    pthread_mutex_lock(&journal.lock);
+    int i = find_slot(block_id);
+    pthread_mutex_unlock(&journal.lock);
+    return i >= 0 ? journal.start + 1 + i : block_id;
+}
@@ -0,0 +1,95 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cache.h"
+
+// 元数据日志（write-ahead journal）
+//
+// 元数据块（超级块、位图、inode 表、extent 叶子、目录块）被修改后用 journal_dirty 加入当前事务，
+// 而不是直接写回原位置。提交时先把事务中的块依次写入日志区，再写日志头（提交点），最后才写回原位置；
+// 挂载时如果日志头中记录了一个已提交的事务，就把它重放一遍。这样无论在哪里崩溃，
+// 一个事务对元数据的修改要么全部生效，要么全部不生效
+//
+// 多个操作合并为一个事务提交（group commit）：同一个块在事务中被反复修改时只写一次日志，
+// 原本分散在磁盘各处的小写入也变成对日志区的一次顺序追加
+//
+// 文件数据块不经过日志，但提交前会先写回所有脏的数据块（ordered 模式），
+// 所以已提交的元数据不会指向还没写入的数据
+//
+// 日志区的布局：第 0 块是日志头，之后的每一块依次存放事务中的一个块
+#define JOURNAL_BLOCKS 128
+#define JOURNAL_SLOTS (JOURNAL_BLOCKS - 1)
+
+// 单个操作最多修改的元数据块数，事务剩余的空间不够一个操作时就提交
+#define JOURNAL_OP_BLOCKS 32
+
+// 同时进行的操作数的上限，块缓存的大小依赖它（见 cache.h）
+#define JOURNAL_MAX_OPS 2
+
+// 提交时释放延迟释放的块会修改的元数据块数（数据位图），这部分日志空间总是预留出来
+#define JOURNAL_FREE_BLOCKS 4
+
+// 最多延迟释放的块区间数，见 journal_free
+#define JOURNAL_MAX_FREES 256
+
+// 事务最长攒多久，超过后在下一个操作结束时提交
+#define JOURNAL_COMMIT_NS 1000000000LL
+
+// 真正释放 [start, start + len) 的函数，提交时用来释放延迟释放的块
+typedef int (*journal_free_fn)(uint32_t start, uint32_t len);
+
+// 日志区从第 start 块开始，在 fs_mount 时调用
+void journal_init(int start, journal_free_fn free_fn);
+
+// 重放日志中已提交但还没写回原位置的事务，在挂载已有的文件系统时、读取其它元数据之前调用
+int journal_recover(void);
+
+// 每个修改文件系统的操作开始和结束时调用，ret 是操作的返回值
+//
+// 多线程：journal_begin 为操作在日志中预留 blocks 块的空间，空间不够、正在提交或者已经有 JOURNAL_MAX_OPS 个操作
+// 在进行时等待，所以同时进行的操作修改的块总能放进同一个事务。提交只在没有操作进行时发生，
+// 需要提交时新的操作会等到提交结束再开始
+//
+// 事务足够大、攒得足够久或被要求立即提交时，最后一个结束的操作会提交事务，
+// 提交失败且操作本身成功时返回 -EIO，否则原样返回 ret
+void journal_begin(uint32_t blocks);
+int journal_end(int ret);
+
+// 标记元数据块被修改过，并把它加入当前事务
+void journal_dirty(struct cache_buf* buf);
+
+// 第 block_id 块被释放了，把它从当前事务中去掉
+void journal_forget(int block_id);
+
+// 延迟释放块 [start, start + len)，直到当前事务提交时才真正释放
+//
+// 释放还没提交时这个块就被分配出去并写入，崩溃后旧的元数据会把新的数据当成元数据解析，
+// 或者旧文件读到别的文件的数据，所以元数据块和文件的数据块都这样释放。
+// 区间表满了时什么也不做，返回 -ENOSPC：一般的操作只释放几段，可能释放很多段的截断和删除分段进行，见 journal_free_full
+int journal_free(uint32_t start, uint32_t len);
+
+// 当前事务中延迟释放的区间是否已经够多，够多时结束的操作会要求提交。
+// 截断和删除这时停下，调用 journal_restart 等提交之后再接着释放，区间表剩下的一半留给同时进行的另一个操作
+bool journal_free_full(void);
+
+// 结束当前操作，再开始一个预留同样多块的新操作，需要提交时中间会提交。返回结束时提交的结果，见 journal_end
+//
+// 调用时不能持有 inode 的锁：别的操作可能已经在日志中占了位置，正在等这些锁，提交要等它们结束
+int journal_restart(void);
+
+// 延迟释放、还没真正释放的块数，statfs 把它们算作空闲块
+uint32_t journal_freeing(void);
+
+// 等待正在进行的操作结束后提交当前事务，用于 mkfs 和卸载
+int journal_commit(void);
+
+// 第 block_id 块现在在磁盘上的位置，块缓存读写磁盘时使用
+//
+// 未提交事务中的块被换出缓存时写到它在日志区中的位置，再次读入时也从那里读，
+// 这样事务中的块不需要一直留在缓存中，原位置也不会在提交前被修改
+int journal_locate(int block_id);
+
+#endif
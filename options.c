@@ -0,0 +1,53 @@
+#include "options.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "cache.h"
+#include "logger.h"
+
+// 读出环境变量 name 中的非负整数，未设置时返回 def，不合法时警告并返回 def，超过 max 时返回 max
+static uint32_t env_uint(const char* name, uint32_t def, uint32_t max) {
+    const char* value = getenv(name);
+    if (value == NULL || *value == '\0')
+        return def;
+    char* end;
+    errno = 0;
+    unsigned long n = strtoul(value, &end, 10);
+    if (errno || *end != '\0' || *value == '-') {
+        fs_warning("options: invalid %s=%s, using %u\n", name, value, def);
+        return def;
+    }
+    if (n > max) {
+        fs_warning("options: %s=%s is too large, using %u\n", name, value, max);
+        return max;
+    }
+    return n;
+}
+
+void options_load(struct fs_options* opts) {
+    opts->readahead = env_uint("FS_READAHEAD", OPTIONS_READAHEAD_DEFAULT, OPTIONS_READAHEAD_MAX);
+    opts->coalesce = env_uint("FS_COALESCE", OPTIONS_COALESCE_DEFAULT, CACHE_HOLD_MAX);
+    opts->reserve = env_uint("FS_RESERVE", OPTIONS_RESERVE_DEFAULT, ALLOC_WINDOW_MAX);
+    opts->io_workers = env_uint("FS_IO_WORKERS", OPTIONS_IO_WORKERS_DEFAULT, BLKDEV_WORKERS_MAX);
+    opts->snapshot = getenv("FS_SNAPSHOT");
+    if (opts->snapshot != NULL && *opts->snapshot == '\0')
+        opts->snapshot = NULL;
+    opts->compress = env_uint("FS_COMPRESS", 0, 1);
+    opts->dedupe = env_uint("FS_DEDUPE", 0, 1);
+    fs_info("options: readahead=%u coalesce=%u reserve=%u io_workers=%u snapshot=%s compress=%d dedupe=%d\n",
+            opts->readahead, opts->coalesce, opts->reserve, opts->io_workers,
+            opts->snapshot != NULL ? opts->snapshot : "-", opts->compress, opts->dedupe);
+}
+
+enum blkdev_backend options_backend(void) {
+    const char* value = getenv("FS_BACKEND");
+    if (value == NULL || *value == '\0' || strcmp(value, "files") == 0)
+        return BLKDEV_FILES;
+    if (strcmp(value, "image") == 0)
+        return BLKDEV_IMAGE;
+    fs_warning("options: invalid FS_BACKEND=%s, using files\n", value);
+    return BLKDEV_FILES;
+}
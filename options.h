@@ -0,0 +1,35 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "blkdev.h"
+
+// 挂载参数
+//
+// main 函数不应该修改，所以参数不走命令行，而是按 fs_mount 的提示用环境变量传递，比如
+// `FS_READAHEAD=4 make mount`；未设置或者不合法时使用默认值，超出范围时取上限
+struct fs_options {
+    uint32_t readahead;  // FS_READAHEAD：顺序读时预读的块数，0 表示不预读
+    uint32_t coalesce;  // FS_COALESCE：写合并时同时留在缓存中的未写满的块数，0 表示不合并
+    uint32_t reserve;  // FS_RESERVE：追加写时为文件预留的最少块数（见 alloc.h 的预留窗口），0 表示不预留
+    uint32_t io_workers;  // FS_IO_WORKERS：并行完成一批块读写的 I/O 线程数，0 表示由提交者依次完成
+    const char* snapshot;  // FS_SNAPSHOT：只读挂载这个名字的快照（见 snapshot.h），NULL 表示挂载文件系统本身
+    bool compress;  // FS_COMPRESS=1：按组压缩整组写入的文件内容（见 compress.h），默认关闭
+    bool dedupe;  // FS_DEDUPE=1：整块写入时和最近写过的内容相同的块共享（见 dedupe.h），默认关闭
+};
+
+#define OPTIONS_READAHEAD_DEFAULT 8
+#define OPTIONS_READAHEAD_MAX 8  // 缓存只有 CACHE_NBUF 块，预读太多会把刚读入的块挤出去
+#define OPTIONS_COALESCE_DEFAULT 2
+#define OPTIONS_RESERVE_DEFAULT 8
+#define OPTIONS_IO_WORKERS_DEFAULT 4
+
+// 从环境变量中读出挂载参数，在 fs_mount 时调用
+void options_load(struct fs_options* opts);
+
+// FS_BACKEND：块设备后端，files 或 image，默认 files。在 fs_mount 之前的 blkdev_mount 中调用
+enum blkdev_backend options_backend(void);
+
+#endif
@@ -0,0 +1,80 @@
+#include "readahead.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "cache.h"
+#include "logger.h"
+
+struct readahead_req {
+    uint32_t pblk;
+    uint32_t len;
+};
+
+// 请求的环形队列
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+    struct readahead_req reqs[READAHEAD_QUEUE];
+    uint32_t head;  // 下一个要处理的请求
+    uint32_t count;
+    bool running;
+    pthread_t worker;
+} ra = {.lock = PTHREAD_MUTEX_INITIALIZER, .nonempty = PTHREAD_COND_INITIALIZER};
+
+static void* worker_main(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&ra.lock);
+    for (;;) {
+        while (ra.running && ra.count == 0)
+            pthread_cond_wait(&ra.nonempty, &ra.lock);
+        if (!ra.running)
+            break;
+        struct readahead_req req = ra.reqs[ra.head];
+        ra.head = (ra.head + 1) % READAHEAD_QUEUE;
+        ra.count--;
+        pthread_mutex_unlock(&ra.lock);
+        cache_prefetch_run(req.pblk, req.len);
+        pthread_mutex_lock(&ra.lock);
+    }
+    pthread_mutex_unlock(&ra.lock);
+    return NULL;
+}
+
+int readahead_init(void) {
+    ra.head = 0;
+    ra.count = 0;
+    ra.running = true;
+    int ret = pthread_create(&ra.worker, NULL, worker_main, NULL);
+    if (ret) {
+        fs_error("readahead: cannot start worker: %d\n", ret);
+        ra.running = false;
+        return -ret;
+    }
+    return 0;
+}
+
+void readahead_submit(uint32_t pblk, uint32_t len) {
+    pthread_mutex_lock(&ra.lock);
+    // 和队尾的请求相邻时合并成一个
+    struct readahead_req* last = &ra.reqs[(ra.head + ra.count + READAHEAD_QUEUE - 1) % READAHEAD_QUEUE];
+    if (ra.count > 0 && last->pblk + last->len == pblk) {
+        last->len += len;
+    } else if (ra.running && ra.count < READAHEAD_QUEUE) {
+        ra.reqs[(ra.head + ra.count) % READAHEAD_QUEUE] = (struct readahead_req){pblk, len};
+        ra.count++;
+        pthread_cond_signal(&ra.nonempty);
+    }
+    pthread_mutex_unlock(&ra.lock);
+}
+
+void readahead_stop(void) {
+    pthread_mutex_lock(&ra.lock);
+    bool running = ra.running;
+    ra.running = false;
+    ra.count = 0;
+    pthread_cond_signal(&ra.nonempty);
+    pthread_mutex_unlock(&ra.lock);
+    if (running)
+        pthread_join(ra.worker, NULL);
+}
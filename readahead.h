@@ -0,0 +1,24 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdint.h>
+
+// 异步预读
+//
+// fs_read 发现一个句柄在顺序读时，把接下来的几个数据块交给后台线程读入缓存，
+// 这样下一次读到这些块时直接命中，读磁盘的时间和 fuse 处理请求、拷贝数据的时间重叠起来
+//
+// 预读只是提示：队列满了就丢掉请求，读入失败也不报错，之后真正读到时会再读一次。
+// 后台线程用 cache_prefetch 把一段块一批并行读入，它从不等待空闲的缓存块，不会影响缓存的死锁分析（见 cache.h）
+#define READAHEAD_QUEUE 16
+
+// 启动后台线程，在 fuse 的 init 回调中调用（见 fs.c 的 fs_init）
+int readahead_init(void);
+
+// 请求把物理块 [pblk, pblk + len) 读入缓存，不等待读完
+void readahead_submit(uint32_t pblk, uint32_t len);
+
+// 丢掉还没开始的请求并停止后台线程，在 fs_finalize 时调用
+void readahead_stop(void);
+
+#endif
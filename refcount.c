@@ -0,0 +1,142 @@
+#include "refcount.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "cache.h"
+#include "journal.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+#define REFCOUNT_MAX UINT8_MAX
+
+// blocks 只在挂载和创建计数表时写入，计数表的内容由 lock 保护
+static struct {
+    pthread_mutex_t lock;
+    bool ready;
+    uint32_t blocks[REFCOUNT_BLOCKS];
+    uint32_t shared;  // 计数大于 0 的块数，用原子操作读写
+    uint32_t total;  // 所有计数之和，用原子操作读写
+} refcount = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+int refcount_init(const uint32_t* blocks) {
+    refcount.ready = blocks != NULL;
+    refcount.shared = 0;
+    refcount.total = 0;
+    if (!refcount.ready)
+        return 0;
+    memcpy(refcount.blocks, blocks, sizeof(refcount.blocks));
+    for (uint32_t i = 0; i < REFCOUNT_BLOCKS; ++i) {
+        struct cache_buf* buf = cache_get(refcount.blocks[i]);
+        if (buf == NULL)
+            return -EIO;
+        uint32_t n = min(BLOCK_SIZE, BLOCK_NUM - i * BLOCK_SIZE);
+        for (uint32_t j = 0; j < n; ++j) {
+            refcount.shared += buf->data[j] != 0;
+            refcount.total += buf->data[j];
+        }
+        cache_put(buf);
+    }
+    return 0;
+}
+
+bool refcount_any(void) {
+    return __atomic_load_n(&refcount.shared, __ATOMIC_RELAXED) > 0;
+}
+
+uint32_t refcount_total(void) {
+    return __atomic_load_n(&refcount.total, __ATOMIC_RELAXED);
+}
+
+// 找出从 start 开始、不超过 len 块、同在一个计数块中的和 start 同样共享或不共享的块，调用时持有锁
+static int scan(uint32_t start, uint32_t len, uint32_t* run, struct cache_buf** buf) {
+    if ((*buf = cache_get(refcount.blocks[start / BLOCK_SIZE])) == NULL)
+        return -EIO;
+    uint32_t first = start % BLOCK_SIZE, end = min(BLOCK_SIZE, first + len), i = first + 1;
+    bool shared = (*buf)->data[first] != 0;
+    while (i < end && ((*buf)->data[i] != 0) == shared)
+        i++;
+    *run = i - first;
+    return shared;
+}
+
+int refcount_shared(uint32_t start, uint32_t len, uint32_t* run) {
+    // 没有共享的块时不读计数表：自己的块变为共享一定发生在调用者放掉去重索引中的这个块之前（见 dedupe_forget）
+    if (!refcount_any()) {
+        *run = len;
+        return 0;
+    }
+    struct cache_buf* buf;
+    pthread_mutex_lock(&refcount.lock);
+    int ret = scan(start, len, run, &buf);
+    pthread_mutex_unlock(&refcount.lock);
+    if (ret >= 0)
+        cache_put(buf);
+    return ret;
+}
+
+// 计数块 buf 中 [first, first + n) 的计数加上 delta，调用时持有锁
+static void update(struct cache_buf* buf, uint32_t first, uint32_t n, int delta) {
+    for (uint32_t i = first; i < first + n; ++i) {
+        if (delta > 0 && buf->data[i]++ == 0)
+            __atomic_add_fetch(&refcount.shared, 1, __ATOMIC_RELAXED);
+        else if (delta < 0 && --buf->data[i] == 0)
+            __atomic_sub_fetch(&refcount.shared, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&refcount.total, delta * (int)n, __ATOMIC_RELAXED);
+    journal_dirty(buf);
+}
+
+// [start, start + len) 中有没有计数已经到了上限的块，调用时持有锁
+static int saturated(uint32_t start, uint32_t len) {
+    for (uint32_t i = start; i < start + len;) {
+        struct cache_buf* buf = cache_get(refcount.blocks[i / BLOCK_SIZE]);
+        if (buf == NULL)
+            return -EIO;
+        uint32_t first = i % BLOCK_SIZE, n = min(start + len - i, BLOCK_SIZE - first);
+        bool full = memchr(buf->data + first, REFCOUNT_MAX, n) != NULL;
+        cache_put(buf);
+        if (full)
+            return -EMLINK;
+        i += n;
+    }
+    return 0;
+}
+
+int refcount_inc(uint32_t start, uint32_t len) {
+    if (!refcount.ready)
+        return -EIO;
+    pthread_mutex_lock(&refcount.lock);
+    int ret = saturated(start, len);
+    while (ret == 0 && len > 0) {
+        struct cache_buf* buf = cache_get(refcount.blocks[start / BLOCK_SIZE]);
+        if (buf == NULL) {
+            ret = -EIO;
+            break;
+        }
+        uint32_t first = start % BLOCK_SIZE, n = min(len, BLOCK_SIZE - first);
+        update(buf, first, n, 1);
+        cache_put(buf);
+        start += n;
+        len -= n;
+    }
+    pthread_mutex_unlock(&refcount.lock);
+    return ret;
+}
+
+int refcount_put(uint32_t start, uint32_t len, uint32_t* run) {
+    if (!refcount_any()) {
+        *run = len;
+        return 0;
+    }
+    struct cache_buf* buf;
+    pthread_mutex_lock(&refcount.lock);
+    int ret = scan(start, len, run, &buf);
+    if (ret > 0)
+        update(buf, start % BLOCK_SIZE, *run, -1);
+    pthread_mutex_unlock(&refcount.lock);
+    if (ret >= 0)
+        cache_put(buf);
+    return ret;
+}
@@ -0,0 +1,47 @@
+#ifndef REFCOUNT_H
+#define REFCOUNT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "disk.h"
+
+// 数据块的引用计数，文件系统和快照共享数据块时使用，见 snapshot.h
+//
+// 每块一个字节，记录这个块除了第一个拥有者之外还被几个快照引用：0 表示只有一个拥有者，可以直接覆盖；
+// 大于 0 表示共享，写之前要先复制一份（copy-on-write），释放时只把计数减一。
+// 数据块位图仍然表示块是否被使用，所以没有快照时计数全是 0，分配和释放都和原来一样
+//
+// 计数表存放在 REFCOUNT_BLOCKS 个数据块中（第一次创建快照时分配），通过块缓存访问，修改时加入日志。
+// 内存中只记录计数表的位置和共享块的总数，总数为 0 时查询直接返回，不读计数表
+//
+// 除了快照，去重（见 dedupe.h）也会让多个文件共享同一个块，所以一个块的计数可能被持有不同 inode 锁的线程修改，
+// 查询和修改都在模块的锁中进行；没有共享块时查询不加锁
+//
+// 多个拥有者可能同时复制同一个共享块，各自放掉一个引用（refcount_put），最后放掉的那个负责释放它，
+// 所以拥有者不需要知道还有谁在共享
+#define REFCOUNT_BLOCKS ((BLOCK_NUM + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+// 计数表位于 blocks[0, REFCOUNT_BLOCKS)，数出共享块的总数，在 fs_mount 时和创建计数表之后调用
+//
+// blocks 为 NULL 表示还没有计数表，此时所有块都不共享
+int refcount_init(const uint32_t* blocks);
+
+// 有没有共享的块
+bool refcount_any(void);
+
+// 第 start 块是否共享：返回 1 表示共享，0 表示不共享，负数表示出错。
+// *run 为从 start 开始、不超过 len 块中和 start 同样共享或不共享的块数
+int refcount_shared(uint32_t start, uint32_t len, uint32_t* run);
+
+// 共享的块中一共有多少额外的引用，也就是共享节省下来的块数
+uint32_t refcount_total(void);
+
+// [start, start + len) 的计数加一，用于创建快照和去重。有块的计数已经到了上限时什么也不改，返回 -EMLINK
+int refcount_inc(uint32_t start, uint32_t len);
+
+// 放掉从 start 开始的一个引用：和 refcount_shared 一样找出同样共享或不共享的 *run 块，
+// 共享的计数减一并返回 1；不共享时返回 0，调用者是最后的拥有者，应该释放这些块
+int refcount_put(uint32_t start, uint32_t len, uint32_t* run);
+
+#endif
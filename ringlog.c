@@ -0,0 +1,327 @@
+#include "ringlog.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if LOG_LEVEL <= LOG_IMPORTANT
+
+#define LINE_SIZE 512
+#define SPEC_SIZE 32
+#define STR_NONE UINT64_MAX  // 字符串参数放不下时记这个偏移，输出为空串
+
+struct ringlog_entry {
+    uint64_t seq;
+    const char* format;
+    uint64_t args[RINGLOG_ARGS];  // 整数和指针的值、浮点数的位、字符串在 str 中的偏移
+    uint32_t nargs;
+    char str[RINGLOG_STR];
+};
+
+// head 只由写入的线程修改，tail 只由后台线程修改
+struct ringlog_slot {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t busy;  // 共用的槽位正在被写
+    uint32_t dropped;
+    struct ringlog_entry entries[RINGLOG_ENTRIES];
+} __attribute__((aligned(64)));
+
+_Static_assert((RINGLOG_ENTRIES & (RINGLOG_ENTRIES - 1)) == 0, "RINGLOG_ENTRIES must be a power of two");
+
+// 参数的类型，由转换说明的长度修饰和转换字符决定
+enum arg_kind {
+    ARG_NONE,  // %%，没有参数
+    ARG_INT,
+    ARG_LONG,
+    ARG_LLONG,
+    ARG_SIZE,
+    ARG_INTMAX,
+    ARG_PTRDIFF,
+    ARG_PTR,
+    ARG_DOUBLE,
+    ARG_STR,
+    ARG_BAD,  // 不支持的转换说明
+};
+
+static struct ringlog_slot slots[RINGLOG_SLOTS];
+static uint32_t next_slot;
+static uint64_t next_seq;
+
+static __thread struct ringlog_slot* my_slot;
+
+// 后台线程，lock 只在后台线程和 ringlog_stop 之间使用，写日志的线程不碰它
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t stop;
+    bool running;
+    pthread_t thread;
+} worker = {.lock = PTHREAD_MUTEX_INITIALIZER, .stop = PTHREAD_COND_INITIALIZER};
+
+static struct ringlog_slot* slot(void) {
+    if (my_slot == NULL) {
+        uint32_t i = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED);
+        my_slot = &slots[i < RINGLOG_SLOTS ? i : RINGLOG_SLOTS - 1];
+    }
+    return my_slot;
+}
+
+static bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// 解析 *p（'%' 之后）开始的转换说明，成功时 *p 移到它之后，返回 ARG_BAD 时 *p 不变
+static enum arg_kind parse_spec(const char** p) {
+    const char* s = *p;
+    s += strspn(s, "-+ #0");
+    while (is_digit(*s))
+        s++;
+    if (*s == '.') {
+        s++;
+        while (is_digit(*s))
+            s++;
+    }
+    enum arg_kind kind = ARG_INT;
+    if (*s == 'h') {
+        s += s[1] == 'h' ? 2 : 1;
+    } else if (*s == 'l') {
+        kind = s[1] == 'l' ? ARG_LLONG : ARG_LONG;
+        s += s[1] == 'l' ? 2 : 1;
+    } else if (*s == 'z') {
+        kind = ARG_SIZE;
+        s++;
+    } else if (*s == 'j') {
+        kind = ARG_INTMAX;
+        s++;
+    } else if (*s == 't') {
+        kind = ARG_PTRDIFF;
+        s++;
+    }
+    if (*s == '\0') {
+        return ARG_BAD;
+    } else if (*s == 's') {
+        if (kind != ARG_INT)  // %ls
+            return ARG_BAD;
+        kind = ARG_STR;
+    } else if (*s == 'p') {
+        kind = ARG_PTR;
+    } else if (strchr("fFeEgGaA", *s) != NULL) {
+        kind = ARG_DOUBLE;
+    } else if (*s == '%') {
+        kind = ARG_NONE;
+    } else if (strchr("diouxXc", *s) == NULL) {
+        return ARG_BAD;  // `*`、L 和 %n
+    }
+    *p = s + 1;
+    return kind;
+}
+
+// 按格式串把参数记进 e，遇到不支持的转换说明或者参数记满时停下
+static void record(struct ringlog_entry* e, const char* format, va_list ap) {
+    size_t used = 0;
+    e->nargs = 0;
+    for (const char* p = format; (p = strchr(p, '%')) != NULL;) {
+        p++;
+        enum arg_kind kind = parse_spec(&p);
+        if (kind == ARG_NONE)
+            continue;
+        if (kind == ARG_BAD || e->nargs == RINGLOG_ARGS)
+            break;
+        uint64_t* arg = &e->args[e->nargs++];
+        if (kind == ARG_STR) {
+            const char* str = va_arg(ap, const char*);
+            if (str == NULL)
+                str = "(null)";
+            if (used == RINGLOG_STR) {
+                *arg = STR_NONE;
+                continue;
+            }
+            size_t n = strnlen(str, RINGLOG_STR - used - 1);
+            memcpy(e->str + used, str, n);
+            e->str[used + n] = '\0';
+            *arg = used;
+            used += n + 1;
+        } else if (kind == ARG_DOUBLE) {
+            double d = va_arg(ap, double);
+            memcpy(arg, &d, sizeof(d));
+        } else if (kind == ARG_PTR) {
+            *arg = (uintptr_t)va_arg(ap, void*);
+        } else if (kind == ARG_INT) {
+            *arg = (int64_t)va_arg(ap, int);
+        } else if (kind == ARG_LONG) {
+            *arg = (int64_t)va_arg(ap, long);
+        } else if (kind == ARG_LLONG) {
+            *arg = (int64_t)va_arg(ap, long long);
+        } else if (kind == ARG_SIZE) {
+            *arg = va_arg(ap, size_t);
+        } else if (kind == ARG_INTMAX) {
+            *arg = (int64_t)va_arg(ap, intmax_t);
+        } else {
+            *arg = (int64_t)va_arg(ap, ptrdiff_t);
+        }
+    }
+}
+
+void ringlog_write(const char* format, ...) {
+    struct ringlog_slot* s = slot();
+    bool shared = s == &slots[RINGLOG_SLOTS - 1];
+    if (shared && __atomic_exchange_n(&s->busy, 1, __ATOMIC_ACQUIRE)) {
+        __atomic_add_fetch(&s->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    uint32_t head = __atomic_load_n(&s->head, __ATOMIC_RELAXED);
+    if (head - __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE) == RINGLOG_ENTRIES) {
+        __atomic_add_fetch(&s->dropped, 1, __ATOMIC_RELAXED);
+    } else {
+        struct ringlog_entry* e = &s->entries[head % RINGLOG_ENTRIES];
+        e->seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+        e->format = format;
+        va_list ap;
+        va_start(ap, format);
+        record(e, format, ap);
+        va_end(ap);
+        __atomic_store_n(&s->head, head + 1, __ATOMIC_RELEASE);
+    }
+    if (shared)
+        __atomic_store_n(&s->busy, 0, __ATOMIC_RELEASE);
+}
+
+// 把 e 格式化到 out 中，返回长度。和 record 按同样的方式解析格式串，没有记下的参数原样输出转换说明
+static size_t format_entry(const struct ringlog_entry* e, char* out, size_t size) {
+    size_t len = 0;
+    uint32_t i = 0;
+    const char* p = e->format;
+    while (*p != '\0' && len < size - 1) {
+        const char* start = strchr(p, '%');
+        size_t n = start != NULL ? (size_t)(start - p) : strlen(p);
+        n = n < size - 1 - len ? n : size - 1 - len;
+        memcpy(out + len, p, n);
+        len += n;
+        if (start == NULL || len == size - 1)
+            break;
+        p = start + 1;
+        enum arg_kind kind = parse_spec(&p);
+        if (kind == ARG_BAD || (kind != ARG_NONE && i == e->nargs) || (size_t)(p - start) >= SPEC_SIZE) {
+            // 没有记下参数，剩下的部分原样输出
+            n = strlen(start) < size - 1 - len ? strlen(start) : size - 1 - len;
+            memcpy(out + len, start, n);
+            len += n;
+            break;
+        }
+        char spec[SPEC_SIZE];
+        memcpy(spec, start, p - start);
+        spec[p - start] = '\0';
+        uint64_t v = kind != ARG_NONE ? e->args[i++] : 0;
+        char* to = out + len;
+        size_t room = size - len;
+        double d;
+        int w;
+        if (kind == ARG_NONE) {
+            w = snprintf(to, room, "%%");
+        } else if (kind == ARG_STR) {
+            w = snprintf(to, room, spec, v == STR_NONE ? "" : e->str + v);
+        } else if (kind == ARG_DOUBLE) {
+            memcpy(&d, &v, sizeof(d));
+            w = snprintf(to, room, spec, d);
+        } else if (kind == ARG_PTR) {
+            w = snprintf(to, room, spec, (void*)(uintptr_t)v);
+        } else if (kind == ARG_INT) {
+            w = snprintf(to, room, spec, (int)v);
+        } else if (kind == ARG_LONG) {
+            w = snprintf(to, room, spec, (long)v);
+        } else if (kind == ARG_LLONG) {
+            w = snprintf(to, room, spec, (long long)v);
+        } else if (kind == ARG_SIZE) {
+            w = snprintf(to, room, spec, (size_t)v);
+        } else if (kind == ARG_INTMAX) {
+            w = snprintf(to, room, spec, (intmax_t)v);
+        } else {
+            w = snprintf(to, room, spec, (ptrdiff_t)v);
+        }
+        if (w > 0)
+            len += (size_t)w < room ? (size_t)w : room - 1;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+// 输出所有槽位中已经写完的记录，按序号从小到大合并
+static void drain(void) {
+    char line[LINE_SIZE];
+    bool wrote = false;
+    for (;;) {
+        struct ringlog_slot* next = NULL;
+        for (int i = 0; i < RINGLOG_SLOTS; ++i) {
+            struct ringlog_slot* s = &slots[i];
+            uint32_t tail = s->tail;
+            if (tail == __atomic_load_n(&s->head, __ATOMIC_ACQUIRE))
+                continue;
+            if (next == NULL || s->entries[tail % RINGLOG_ENTRIES].seq < next->entries[next->tail % RINGLOG_ENTRIES].seq)
+                next = s;
+        }
+        if (next == NULL)
+            break;
+        size_t len = format_entry(&next->entries[next->tail % RINGLOG_ENTRIES], line, sizeof(line));
+        __atomic_store_n(&next->tail, next->tail + 1, __ATOMIC_RELEASE);
+        fwrite(line, 1, len, stdout);
+        wrote = true;
+    }
+    for (int i = 0; i < RINGLOG_SLOTS; ++i) {
+        uint32_t dropped = __atomic_exchange_n(&slots[i].dropped, 0, __ATOMIC_RELAXED);
+        if (dropped > 0) {
+            printf("ringlog: dropped %u records\n", dropped);
+            wrote = true;
+        }
+    }
+    if (wrote)
+        fflush(stdout);
+}
+
+static void* worker_main(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&worker.lock);
+    while (worker.running) {
+        pthread_mutex_unlock(&worker.lock);
+        drain();
+        pthread_mutex_lock(&worker.lock);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += RINGLOG_INTERVAL_MS * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+        if (worker.running)
+            pthread_cond_timedwait(&worker.stop, &worker.lock, &ts);
+    }
+    pthread_mutex_unlock(&worker.lock);
+    return NULL;
+}
+
+int ringlog_start(void) {
+    worker.running = true;
+    int ret = pthread_create(&worker.thread, NULL, worker_main, NULL);
+    if (ret) {
+        fs_error("ringlog: cannot start worker: %d\n", ret);
+        worker.running = false;
+        return -ret;
+    }
+    return 0;
+}
+
+void ringlog_stop(void) {
+    pthread_mutex_lock(&worker.lock);
+    bool running = worker.running;
+    worker.running = false;
+    pthread_cond_signal(&worker.stop);
+    pthread_mutex_unlock(&worker.lock);
+    if (running)
+        pthread_join(worker.thread, NULL);
+    // 后台线程没有启动过时，启动之前写入的日志也在这里输出
+    drain();
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef RINGLOG_H
+#define RINGLOG_H
+
+#include "logger.h"
+
+// 不阻塞调用者的日志
+//
+// logger.c 的 fs_info 等在调用者的线程中同步地 vprintf，调试构建中每个回调都输出一行，
+// 写终端的时间占了回调耗时的大部分。ringlog_* 的用法和 fs_* 一样（printf 的格式），
+// 但调用者只把格式串的指针和参数的原始值记进一个环形缓冲区，由后台线程格式化并输出
+//
+// 每个线程占一个槽位（超出的线程共用最后一个，和 stats.c 一样），每个槽位是一个单生产者、单消费者的环，
+// 写入不加锁也没有系统调用，只有几次原子操作。共用的槽位用一个标志防止两个线程同时写。
+// 环满了或者共用的槽位正在被写时丢掉这条日志并计数，后台线程输出时报告丢了多少条。
+// 每条记录带一个全局的序号，后台线程按序号合并各个槽位，输出的顺序基本上就是写入的顺序
+// （正在写的记录还没有完成时，序号更大的记录可能先输出）
+//
+// 格式串必须是字符串常量（记下的只是指针）。参数按格式串中的转换说明读出：整数、指针和浮点数记原始值，
+// 字符串（%s）复制到记录中，所有字符串共用 RINGLOG_STR 字节，放不下的部分被截掉。
+// 一条记录至多 RINGLOG_ARGS 个参数，不支持 `*` 宽度和 long double，遇到时后面的参数都不记，原样输出转换说明
+//
+// 级别和 logger.h 一样在编译时过滤，低于 LOG_LEVEL 的调用什么也不做。警告和错误仍然用 fs_warning/fs_error
+// 同步输出，崩溃前的最后几条不会丢在缓冲区里。所有级别都被过滤掉时（比如 release 构建的 LOG_LEVEL=100），
+// 缓冲区和后台线程都不存在，ringlog_start 和 ringlog_stop 什么也不做
+#define RINGLOG_SLOTS 4
+#define RINGLOG_ENTRIES 64  // 每个槽位的记录数，必须是 2 的幂
+#define RINGLOG_ARGS 4
+#define RINGLOG_STR 40
+#define RINGLOG_INTERVAL_MS 10  // 后台线程每隔这么久检查一次缓冲区
+
+#if LOG_LEVEL <= LOG_IMPORTANT
+// 启动后台线程，在 fuse 的 init 回调中调用（见 fs.c 的 fs_init）。启动之前写入的日志留在缓冲区中
+int ringlog_start(void);
+
+// 输出缓冲区中剩下的日志并停止后台线程，在 fs_finalize 时调用
+void ringlog_stop(void);
+
+// 记一条日志，一般通过下面的宏调用
+void ringlog_write(const char* format, ...) __attribute__((format(printf, 1, 2)));
+#else
+#define ringlog_start() 0
+#define ringlog_stop() ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_DEBUG
+#define ringlog_debug(...) ringlog_write(__VA_ARGS__)
+#else
+#define ringlog_debug(...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_INFO
+#define ringlog_info(...) ringlog_write(__VA_ARGS__)
+#else
+#define ringlog_info(...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_IMPORTANT
+#define ringlog_important(...) ringlog_write(__VA_ARGS__)
+#else
+#define ringlog_important(...) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,135 @@
+#include "snapshot.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache.h"
+#include "ctl.h"
+#include "journal.h"
+#include "logger.h"
+
+_Static_assert(sizeof(struct snapshot_table) <= BLOCK_SIZE, "snapshot table too large");
+
+#define SNAPSHOT_TEXT_SIZE 2048  // 列表格式化后最长的长度
+
+static struct {
+    pthread_mutex_t lock;  // 命令和读取互斥
+    uint32_t block;
+    snapshot_fn create;
+    snapshot_fn remove;
+} snapshots = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+void snapshot_init(uint32_t block, snapshot_fn create, snapshot_fn remove) {
+    snapshots.block = block;
+    snapshots.create = create;
+    snapshots.remove = remove;
+}
+
+int snapshot_table_read(struct snapshot_table* table) {
+    memset(table, 0, sizeof(*table));
+    if (snapshots.block == 0)
+        return 0;
+    struct cache_buf* buf = cache_get(snapshots.block);
+    if (buf == NULL)
+        return -EIO;
+    memcpy(table, buf->data, sizeof(*table));
+    cache_put(buf);
+    if (table->count > SNAPSHOT_MAX) {
+        fs_error("snapshot: bad snapshot table\n");
+        return -EIO;
+    }
+    return 0;
+}
+
+int snapshot_table_write(uint32_t block, const struct snapshot_table* table) {
+    struct cache_buf* buf = cache_get(block);
+    if (buf == NULL)
+        return -EIO;
+    memcpy(buf->data, table, sizeof(*table));
+    journal_dirty(buf);
+    cache_put(buf);
+    snapshots.block = block;
+    return 0;
+}
+
+int snapshot_find(const struct snapshot_table* table, const char* name) {
+    for (uint32_t i = 0; i < table->count; ++i) {
+        if (strncmp(table->entries[i].name, name, SNAPSHOT_NAME_LEN) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// 格式化快照列表，返回长度
+static int format(char* text, size_t cap, size_t* len) {
+    struct snapshot_table table;
+    int ret = snapshot_table_read(&table);
+    if (ret)
+        return ret;
+    *len = 0;
+#define APPEND(...) (*len += snprintf(text + *len, *len < cap ? cap - *len : 0, __VA_ARGS__))
+    APPEND("%-24s %-19s %8s %11s\n", "name", "created", "inodes", "meta_blocks");
+    for (uint32_t i = 0; i < table.count; ++i) {
+        const struct snapshot* s = &table.entries[i];
+        time_t sec = s->ctime / 1000000000;
+        struct tm tm;
+        char created[32];
+        strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S", localtime_r(&sec, &tm));
+        APPEND("%-24.24s %-19s %8u %11u\n", s->name, created, s->inodes, s->blocks);
+    }
+#undef APPEND
+    *len = *len < cap ? *len : cap - 1;
+    return 0;
+}
+
+int snapshot_ctl_read(char* buffer, size_t size, off_t offset) {
+    char text[SNAPSHOT_TEXT_SIZE];
+    size_t len;
+    pthread_mutex_lock(&snapshots.lock);
+    int ret = format(text, sizeof(text), &len);
+    pthread_mutex_unlock(&snapshots.lock);
+    return ret ? ret : ctl_read_text(text, len, buffer, size, offset);
+}
+
+// 执行一行命令 `create NAME` 或 `delete NAME`
+static int command(const char* line) {
+    char verb[8], name[SNAPSHOT_NAME_LEN + 2], extra;
+    // 名字多读一个字符，用来发现超长的名字
+    if (sscanf(line, "%7s %25s %c", verb, name, &extra) != 2)
+        return -EINVAL;
+    if (strlen(name) > SNAPSHOT_NAME_LEN || strchr(name, '/') != NULL)
+        return -EINVAL;
+    if (strcmp(verb, "create") == 0)
+        return snapshots.create(name);
+    if (strcmp(verb, "delete") == 0)
+        return snapshots.remove(name);
+    return -EINVAL;
+}
+
+int snapshot_ctl_write(const char* buffer, size_t size, off_t offset) {
+    // 每行一条命令，依次执行，遇到错误时停下
+    int ret = 0;
+    pthread_mutex_lock(&snapshots.lock);
+    for (size_t start = 0, end; start < size && ret == 0; start = end + 1) {
+        for (end = start; end < size && buffer[end] != '\n'; ++end)
+            ;
+        char line[64];
+        size_t n = end - start;
+        if (n >= sizeof(line)) {
+            ret = -EINVAL;
+            break;
+        }
+        memcpy(line, buffer + start, n);
+        line[n] = '\0';
+        if (strspn(line, " \t") == n)
+            continue;
+        ret = command(line);
+        if (ret == 0)
+            fs_info("snapshot: %s\n", line);
+    }
+    pthread_mutex_unlock(&snapshots.lock);
+    return ret ? ret : (int)size;
+}
@@ -0,0 +1,60 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "refcount.h"
+
+// 快照：整个文件系统在某一时刻的只读副本
+//
+// 创建快照时复制所有的元数据（用到的 inode 表块、目录块、extent 叶子），文件的数据块不复制，
+// 而是和文件系统共享，引用计数加一（见 refcount.h）。之后文件系统要改写一个共享的块时，
+// 先把它复制到新的块中（copy-on-write），快照中的内容保持不变。
+// 所以创建快照的代价和元数据的多少成正比，和文件的数据量无关。具体的复制和释放在 fs.c 中
+//
+// 快照表存放在一个数据块中（第一次创建快照时分配，块号记在超级块中），记录每个快照的名字、创建时间、
+// inode 表映射块（第 i 项是快照中第 i 个 inode 表块的位置，0 表示这一块中没有 inode）、
+// inode 位图的副本，以及引用计数表的位置
+//
+// 通过控制文件 `/.snapshot` 使用：读它列出所有快照，写入 `create NAME` 或 `delete NAME` 创建或删除快照；
+// `FS_SNAPSHOT=NAME make mount_noinit` 只读挂载名为 NAME 的快照（见 options.h）
+#define SNAPSHOT_MAX 16
+#define SNAPSHOT_NAME_LEN 24
+
+struct snapshot {
+    char name[SNAPSHOT_NAME_LEN];  // 恰好 24 字节时不以 0 结尾
+    int64_t ctime;  // 创建时间，纳秒
+    uint32_t itable;  // inode 表映射块
+    uint32_t ibitmap;  // inode 位图的副本
+    uint32_t inodes;  // 快照中的 inode 数
+    uint32_t blocks;  // 快照自己的元数据占用的块数，不包括共享的数据块
+};
+
+struct snapshot_table {
+    uint32_t count;
+    uint32_t refcount[REFCOUNT_BLOCKS];  // 引用计数表的位置
+    struct snapshot entries[SNAPSHOT_MAX];
+};
+
+// 创建或删除名为 name 的快照，成功返回 0，失败返回负的错误码
+typedef int (*snapshot_fn)(const char* name);
+
+// 快照表位于第 block 块（0 表示还没有快照表），create 和 remove 完成具体的工作，在 fs_mount 时调用
+void snapshot_init(uint32_t block, snapshot_fn create, snapshot_fn remove);
+
+// 读出快照表，还没有快照表时是一张空表
+int snapshot_table_read(struct snapshot_table* table);
+
+// 把快照表写到第 block 块并加入日志，之后的 snapshot_table_read 都从这里读
+int snapshot_table_write(uint32_t block, const struct snapshot_table* table);
+
+// 名为 name 的快照在表中的下标，没有时返回 -1
+int snapshot_find(const struct snapshot_table* table, const char* name);
+
+// `/.snapshot` 的内容和命令，见 ctl.h。命令和读取互斥，create 和 remove 在持有这把锁时被调用
+int snapshot_ctl_read(char* buffer, size_t size, off_t offset);
+int snapshot_ctl_write(const char* buffer, size_t size, off_t offset);
+
+#endif
@@ -0,0 +1,193 @@
+#include "stats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ctl.h"
+#include "logger.h"
+
+#define DUMP_NAME "/fsstats~"
+#define PATH_SIZE 256
+
+// 只有总耗时用 64 位，次数用 32 位足够，槽位小一些
+struct stats_counter {
+    uint64_t ns;
+    uint32_t calls;
+    uint32_t errors;
+    uint32_t reads;  // 块读写次数
+    uint32_t writes;
+    uint32_t hist[STATS_BUCKETS];
+};
+
+struct stats_slot {
+    struct stats_counter ops[STATS_OPS];
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+} __attribute__((aligned(64)));
+
+static const char* const op_names[STATS_OPS] = {
+    "getattr", "readdir", "read",    "mkdir", "rmdir",   "unlink",  "rename",     "truncate",   "utimens",
+    "mknod",   "write",   "statfs", "open",  "release", "opendir", "releasedir", "background",
+};
+
+static struct stats_slot slots[STATS_THREADS];
+static char dump_path[PATH_SIZE];
+
+static __thread struct stats_slot* my_slot;
+static __thread enum stats_op my_op = STATS_BACKGROUND;
+static __thread int64_t my_start;
+
+static int64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 没有进过回调的线程（挂载、预读、卸载时的写回）记在最后一个槽位
+static struct stats_slot* slot(void) {
+    return my_slot != NULL ? my_slot : &slots[STATS_THREADS - 1];
+}
+
+static void add(uint64_t* counter, uint64_t n) {
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+static void count(uint32_t* counter) {
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+static int bucket(int64_t ns) {
+    uint64_t us = ns > 0 ? ns / 1000 : 0;
+    int b = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+void stats_init(void) {
+    if (getcwd(dump_path, sizeof(dump_path) - strlen(DUMP_NAME)) == NULL)
+        dump_path[0] = '\0';
+    else
+        strcat(dump_path, DUMP_NAME);
+}
+
+// 回调线程按线程号散列到其余的槽位：fuse 的工作线程空闲时会退出、之后再创建新的，
+// 按先来后到分配的话槽位很快就被退出的线程占完了
+void stats_begin(enum stats_op op) {
+    if (my_slot == NULL)
+        my_slot = &slots[(uint32_t)syscall(SYS_gettid) % (STATS_THREADS - 1)];
+    my_op = op;
+    my_start = monotonic_ns();
+}
+
+int stats_end(int ret) {
+    int64_t ns = monotonic_ns() - my_start;
+    struct stats_counter* c = &slot()->ops[my_op];
+    count(&c->calls);
+    if (ret < 0)
+        count(&c->errors);
+    add(&c->ns, ns);
+    count(&c->hist[bucket(ns)]);
+    my_op = STATS_BACKGROUND;
+    return ret;
+}
+
+void stats_block_read(void) {
+    count(&slot()->ops[my_op].reads);
+}
+
+void stats_block_write(void) {
+    count(&slot()->ops[my_op].writes);
+}
+
+void stats_cache(bool hit) {
+    add(hit ? &slot()->cache_hits : &slot()->cache_misses, 1);
+}
+
+// 把所有槽位加起来
+static void collect(struct stats_counter* ops, uint64_t* hits, uint64_t* misses) {
+    memset(ops, 0, STATS_OPS * sizeof(*ops));
+    *hits = *misses = 0;
+    for (int i = 0; i < STATS_THREADS; ++i) {
+        for (int op = 0; op < STATS_OPS; ++op) {
+            const struct stats_counter* c = &slots[i].ops[op];
+            ops[op].calls += __atomic_load_n(&c->calls, __ATOMIC_RELAXED);
+            ops[op].errors += __atomic_load_n(&c->errors, __ATOMIC_RELAXED);
+            ops[op].ns += __atomic_load_n(&c->ns, __ATOMIC_RELAXED);
+            ops[op].reads += __atomic_load_n(&c->reads, __ATOMIC_RELAXED);
+            ops[op].writes += __atomic_load_n(&c->writes, __ATOMIC_RELAXED);
+            for (int b = 0; b < STATS_BUCKETS; ++b)
+                ops[op].hist[b] += __atomic_load_n(&c->hist[b], __ATOMIC_RELAXED);
+        }
+        *hits += __atomic_load_n(&slots[i].cache_hits, __ATOMIC_RELAXED);
+        *misses += __atomic_load_n(&slots[i].cache_misses, __ATOMIC_RELAXED);
+    }
+}
+
+// 直方图中第 p% 个调用所在的桶的上界（us），落在最后一桶时返回 -1
+static long percentile(const struct stats_counter* c, int p) {
+    uint64_t want = ((uint64_t)c->calls * p + 99) / 100, seen = 0;
+    for (int b = 0; b < STATS_BUCKETS - 1; ++b) {
+        seen += c->hist[b];
+        if (seen >= want)
+            return 1L << b;
+    }
+    return -1;
+}
+
+// 格式化统计，返回长度
+static size_t format(char* text, size_t cap) {
+    struct stats_counter ops[STATS_OPS];
+    uint64_t hits, misses;
+    collect(ops, &hits, &misses);
+    size_t len = 0;
+#define APPEND(...) (len += snprintf(text + len, len < cap ? cap - len : 0, __VA_ARGS__))
+    APPEND("%-10s %10s %8s %10s %8s %8s %10s %10s\n", "op", "calls", "errors", "avg_us", "p50_us", "p99_us",
+           "blk_reads", "blk_writes");
+    for (int op = 0; op < STATS_OPS; ++op) {
+        const struct stats_counter* c = &ops[op];
+        if (c->calls == 0 && c->reads == 0 && c->writes == 0)
+            continue;
+        if (op == STATS_BACKGROUND) {
+            APPEND("%-10s %10s %8s %10s %8s %8s %10u %10u\n", op_names[op], "-", "-", "-", "-", "-", c->reads,
+                   c->writes);
+            continue;
+        }
+        long p50 = percentile(c, 50), p99 = percentile(c, 99);
+        APPEND("%-10s %10u %8u %10.1f %8ld %8ld %10u %10u\n", op_names[op], c->calls, c->errors,
+               c->calls ? c->ns / 1000.0 / c->calls : 0.0, p50, p99, c->reads, c->writes);
+    }
+    uint64_t lookups = hits + misses;
+    APPEND("\ncache hits %lu misses %lu hit_rate %.1f%%\n", hits, misses, lookups ? 100.0 * hits / lookups : 0.0);
+    APPEND("\nlatency histogram: bucket 0 is <1us, bucket i is [2^(i-1), 2^i) us;\n"
+           "p50/p99 above are bucket upper bounds, -1 means the last bucket\n");
+    for (int op = 0; op < STATS_OPS; ++op) {
+        if (ops[op].calls == 0)
+            continue;
+        APPEND("%-10s", op_names[op]);
+        for (int b = 0; b < STATS_BUCKETS; ++b)
+            APPEND(" %u", ops[op].hist[b]);
+        APPEND("\n");
+    }
+#undef APPEND
+    return len < cap ? len : cap - 1;
+}
+
+int stats_ctl_read(char* buffer, size_t size, off_t offset) {
+    char text[STATS_TEXT_SIZE];
+    size_t len = format(text, sizeof(text));
+    return ctl_read_text(text, len, buffer, size, offset);
+}
+
+void stats_dump(void) {
+    if (dump_path[0] == '\0')
+        return;
+    char text[STATS_TEXT_SIZE];
+    size_t len = format(text, sizeof(text));
+    FILE* fp = fopen(dump_path, "w");
+    if (fp == NULL || fwrite(text, 1, len, fp) != len)
+        fs_warning("stats: cannot write %s\n", dump_path);
+    if (fp != NULL)
+        fclose(fp);
+}
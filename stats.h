@@ -0,0 +1,65 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// 运行时统计
+//
+// 每个 fuse 回调记录调用次数、出错次数、耗时（按 2 的幂分桶的直方图）以及期间读写的块数，
+// 另外记录块缓存的命中率。日志在 release 构建中被关掉了，这些统计是运行时唯一能看到的信息：
+// 挂载后读 `/.fsstats`（见 ctl.h）可以看到当前的统计，卸载时写入启动目录下的 `fsstats~`
+//
+// 每个线程把计数记在自己的槽位中（按缓存行对齐），读取时把所有槽位加起来。槽位数量有限（统计也占运行时内存）：
+// 回调线程在第一次进入回调时按线程号散列到前 STATS_THREADS - 1 个槽位，其它线程共用最后一个，
+// 几个线程可能共用一个槽位，所以计数一律用原子加
+enum stats_op {
+    STATS_GETATTR,
+    STATS_READDIR,
+    STATS_READ,
+    STATS_MKDIR,
+    STATS_RMDIR,
+    STATS_UNLINK,
+    STATS_RENAME,
+    STATS_TRUNCATE,
+    STATS_UTIMENS,
+    STATS_MKNOD,
+    STATS_WRITE,
+    STATS_STATFS,
+    STATS_OPEN,
+    STATS_RELEASE,
+    STATS_OPENDIR,
+    STATS_RELEASEDIR,
+    STATS_BACKGROUND,  // 不在任何回调中的块读写，比如预读线程和卸载时的写回
+    STATS_OPS,
+};
+
+#define STATS_THREADS 4
+#define STATS_BUCKETS 16  // 第 0 桶是不到 1us，第 i 桶是 [2^(i-1), 2^i) us，最后一桶（16ms 以上）不设上限
+#define STATS_TEXT_SIZE 4096  // 格式化后的统计最长的长度，放在栈上，计数很大时末尾的直方图可能被截掉
+
+// 记下启动目录，在 fs_mount 时调用（fuse 转到后台后会切换到根目录）
+void stats_init(void);
+
+// 一个回调开始，和 stats_end 成对调用
+void stats_begin(enum stats_op op);
+
+// 回调结束，记录耗时，ret 小于 0 时记为出错，返回 ret
+int stats_end(int ret);
+
+// 当前线程读写了一个块，由块设备后端调用
+void stats_block_read(void);
+void stats_block_write(void);
+
+// 块缓存命中或未命中
+void stats_cache(bool hit);
+
+// `/.fsstats` 的内容，见 ctl.h
+int stats_ctl_read(char* buffer, size_t size, off_t offset);
+
+// 把统计写入 `fsstats~`，在 fs_finalize 时调用
+void stats_dump(void);
+
+#endif
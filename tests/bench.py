@@ -0,0 +1,290 @@
+import json
+import os
+import os.path as osp
+import random
+import subprocess
+import time
+from argparse import ArgumentParser
+
+# 文件系统的基准测试
+#
+# test.py 计时的是整个 bash 脚本，大部分时间花在启动 bash 和 coreutils 上，
+# 这里直接在 Python 中发起系统调用，分别测量几种固定的负载，输出 JSON，方便比较不同的构建：
+# 每种负载的 ops/sec、单次操作延迟的 p50/p99，以及期间块设备的读写次数（从 /.fsstats 中读出）
+#
+# 用法：python3 tests/bench.py [--release] [--backend image] [-w metadata,seq] [-o result.json]
+
+MNT = "mnt"
+STATS = osp.join(MNT, ".fsstats")
+
+WORKLOADS = ["metadata", "deep_path", "seq", "random", "big_dir", "remount"]
+
+parser = ArgumentParser()
+parser.add_argument("-w", "--workload", type=str, help="comma separated workloads, default all")
+parser.add_argument("-s", "--scale", type=float, default=1.0, help="multiply the size of every workload")
+parser.add_argument("--release", action="store_true", help="release build")
+parser.add_argument("--backend", type=str, help="block device backend, passed as FS_BACKEND")
+parser.add_argument("-o", "--output", type=str, help="write JSON to this file instead of stdout")
+parser.add_argument("--seed", type=int, default=1)
+parser.add_argument("-V", "--verbose", action="store_true", help="show make output")
+args = parser.parse_args()
+
+workloads = args.workload.split(",") if args.workload else WORKLOADS
+for w in workloads:
+    if w not in WORKLOADS:
+        print(f"Workload {w} is not valid, choose from {','.join(WORKLOADS)}")
+        exit(1)
+
+build_type = "release" if args.release else "debug"
+env = dict(os.environ)
+if args.backend:
+    env["FS_BACKEND"] = args.backend
+
+
+def scaled(n):
+    return max(1, int(n * args.scale))
+
+
+def make(target):
+    subprocess.run(
+        ["make", target, f"BUILD_TYPE={build_type}"],
+        check=True,
+        capture_output=not args.verbose,
+        env=env,
+    )
+
+
+def wait_mounted(timeout=10):
+    deadline = time.monotonic() + timeout
+    while not osp.ismount(MNT):
+        if time.monotonic() > deadline:
+            raise RuntimeError("file system did not mount")
+        time.sleep(0.001)
+
+
+def wait_exited(timeout=30):
+    # make umount 是懒卸载，等旧的进程在 fs_finalize 中写回完退出，再挂载同一个虚拟磁盘
+    deadline = time.monotonic() + timeout
+    while subprocess.run(["pgrep", "-x", "fuse"], capture_output=True).returncode == 0:
+        if time.monotonic() > deadline:
+            raise RuntimeError("file system did not exit")
+        time.sleep(0.01)
+
+
+def block_io():
+    # 所有行（包括 background）的块读写次数之和，没有 /.fsstats 时返回 None
+    try:
+        with open(STATS) as f:
+            lines = f.read().split("\n\n")[0].splitlines()[1:]
+    except OSError:
+        return None
+    reads = writes = 0
+    for line in lines:
+        fields = line.split()
+        reads += int(fields[-2])
+        writes += int(fields[-1])
+    return reads, writes
+
+
+def percentile(samples, p):
+    if not samples:
+        return 0.0
+    samples = sorted(samples)
+    return samples[min(len(samples) - 1, int(len(samples) * p / 100))]
+
+
+class Recorder:
+    # 记录一种负载中每次操作的耗时
+
+    def __init__(self):
+        self.samples = []
+        self.seconds = 0.0
+
+    def time(self, fn, *fn_args):
+        start = time.perf_counter_ns()
+        result = fn(*fn_args)
+        elapsed = time.perf_counter_ns() - start
+        self.samples.append(elapsed)
+        self.seconds += elapsed / 1e9
+        return result
+
+    def report(self, io_before, io_after, **extra):
+        ops = len(self.samples)
+        result = {
+            "ops": ops,
+            "seconds": round(self.seconds, 6),
+            "ops_per_sec": round(ops / self.seconds, 1) if self.seconds > 0 else 0.0,
+            "p50_us": round(percentile(self.samples, 50) / 1000, 2),
+            "p99_us": round(percentile(self.samples, 99) / 1000, 2),
+        }
+        if io_before is not None and io_after is not None:
+            result["blk_reads"] = io_after[0] - io_before[0]
+            result["blk_writes"] = io_after[1] - io_before[1]
+        result.update(extra)
+        return result
+
+
+def create(path):
+    os.close(os.open(path, os.O_CREAT | os.O_WRONLY, 0o644))
+
+
+def bench_metadata():
+    # 创建、stat、删除 N 个空文件
+    n = scaled(2000)
+    os.mkdir(osp.join(MNT, "meta"))
+    paths = [osp.join(MNT, "meta", f"f{i}") for i in range(n)]
+    rec = Recorder()
+    before = block_io()
+    for p in paths:
+        rec.time(create, p)
+    for p in paths:
+        rec.time(os.stat, p)
+    for p in paths:
+        rec.time(os.unlink, p)
+    after = block_io()
+    os.rmdir(osp.join(MNT, "meta"))
+    return rec.report(before, after, files=n)
+
+
+def bench_deep_path():
+    # 在 16 层深的目录中 stat 一批不同的文件，每次都要逐级解析路径
+    depth, n = 16, scaled(2000)
+    path = MNT
+    for i in range(depth):
+        path = osp.join(path, f"d{i}")
+        os.mkdir(path)
+    files = [osp.join(path, f"f{i}") for i in range(n)]
+    for p in files:
+        create(p)
+    rec = Recorder()
+    before = block_io()
+    for p in files:
+        rec.time(os.stat, p)
+    after = block_io()
+    return rec.report(before, after, depth=depth)
+
+
+def bench_seq():
+    # 以 128KB 为单位顺序写再顺序读一个大文件，ops 是读写的次数
+    chunk, mb = 128 * 1024, scaled(32)
+    count = mb * 1024 * 1024 // chunk
+    path = osp.join(MNT, "seq")
+    data = os.urandom(chunk)
+    result = {}
+    fd = os.open(path, os.O_CREAT | os.O_WRONLY | os.O_TRUNC, 0o644)
+    rec = Recorder()
+    before = block_io()
+    for _ in range(count):
+        rec.time(os.write, fd, data)
+    rec.time(os.fsync, fd)
+    os.close(fd)
+    after = block_io()
+    result["write"] = rec.report(before, after, mb_per_sec=round(mb / rec.seconds, 1))
+
+    fd = os.open(path, os.O_RDONLY)
+    rec = Recorder()
+    before = block_io()
+    for _ in range(count):
+        rec.time(os.read, fd, chunk)
+    os.close(fd)
+    after = block_io()
+    result["read"] = rec.report(before, after, mb_per_sec=round(mb / rec.seconds, 1))
+    os.unlink(path)
+    return result
+
+
+def bench_random():
+    # 在一个 16MB 的文件中随机读写 4KB
+    size, block, n = 16 * 1024 * 1024, 4096, scaled(4000)
+    path = osp.join(MNT, "random")
+    fd = os.open(path, os.O_CREAT | os.O_RDWR | os.O_TRUNC, 0o644)
+    os.ftruncate(fd, size)
+    rng = random.Random(args.seed)
+    offsets = [rng.randrange(size // block) * block for _ in range(n)]
+    data = os.urandom(block)
+    result = {}
+    rec = Recorder()
+    before = block_io()
+    for off in offsets:
+        rec.time(os.pwrite, fd, data, off)
+    after = block_io()
+    result["write"] = rec.report(before, after)
+    rng.shuffle(offsets)
+    rec = Recorder()
+    before = block_io()
+    for off in offsets:
+        rec.time(os.pread, fd, block, off)
+    after = block_io()
+    result["read"] = rec.report(before, after)
+    os.close(fd)
+    os.unlink(path)
+    return result
+
+
+def bench_big_dir():
+    # 在一个目录中创建很多文件，再完整地列几次目录。每次列目录是一个样本，吞吐量按目录项计
+    n, rounds = scaled(10000), 5
+    path = osp.join(MNT, "big")
+    os.mkdir(path)
+    create_rec = Recorder()
+    for i in range(n):
+        create_rec.time(create, osp.join(path, f"entry_{i:06d}"))
+    rec = Recorder()
+    before = block_io()
+    listed = 0
+    for _ in range(rounds):
+        listed = rec.time(lambda: sum(1 for _ in os.scandir(path)))
+    after = block_io()
+    result = rec.report(before, after, entries=listed, create_ops_per_sec=create_rec.report(None, None)["ops_per_sec"])
+    result["ops_per_sec"] = round(listed * rounds / rec.seconds, 1) if rec.seconds > 0 else 0.0
+    return result
+
+
+def bench_remount():
+    # 卸载后用 --noinit 重新挂载，计时直到第一次 stat 根目录成功
+    n = scaled(1000)
+    os.mkdir(osp.join(MNT, "remount"))
+    for i in range(n):
+        create(osp.join(MNT, "remount", f"f{i}"))
+    make("umount")
+    wait_exited()
+    start = time.perf_counter_ns()
+    subprocess.run(["./fuse", "--noinit", "-s", MNT], check=True, env=env)
+    wait_mounted()
+    os.stat(MNT)
+    elapsed = time.perf_counter_ns() - start
+    rec = Recorder()
+    rec.samples.append(elapsed)
+    rec.seconds = elapsed / 1e9
+    listed = len(os.listdir(osp.join(MNT, "remount")))
+    return rec.report(None, None, files=listed)
+
+
+def main():
+    subprocess.run(["make", "clean"], check=True, capture_output=not args.verbose)
+    results = {}
+    for w in workloads:
+        # 每种负载都从一个新的文件系统开始，互不影响
+        make("mount")
+        wait_mounted()
+        try:
+            results[w] = globals()[f"bench_{w}"]()
+        finally:
+            make("umount")
+            wait_exited()
+    report = {
+        "build": build_type,
+        "backend": env.get("FS_BACKEND", "files"),
+        "scale": args.scale,
+        "workloads": results,
+    }
+    text = json.dumps(report, indent=2)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+
+
+if __name__ == "__main__":
+    main()
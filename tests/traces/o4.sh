@@ -0,0 +1,38 @@
+#!/bin/bash
+set -e
+
+# 该测试点考察并发读写的吞吐量：分别用 1、2、4 个进程同时写、同时读各自的文件，输出每一轮的总吞吐量
+# 测试脚本用 `make mount`（-s，单线程）挂载，此时吞吐量不会随进程数增加；
+# 用 `make mount_mt` 挂载后手动运行这个脚本，可以看到多线程模式下吞吐量的变化
+
+cd mnt
+
+MB=8
+
+elapsed() {
+    echo "$1 $2" | awk '{printf "%.3f", $2 - $1}'
+}
+
+run() {
+    local jobs=$1 op=$2
+    local start end
+    start=$(date +%s.%N)
+    for ((i=0;i<jobs;++i)); do
+        if [ "$op" = write ]; then
+            dd if=/dev/zero of=bench$i bs=64k count=$((MB * 16)) status=none &
+        else
+            cat bench$i > /dev/null &
+        fi
+    done
+    wait
+    end=$(date +%s.%N)
+    local secs
+    secs=$(elapsed "$start" "$end")
+    echo "$op jobs=$jobs ${secs}s $(echo "$jobs $secs" | awk -v mb=$MB '{printf "%.1f", $1 * mb / $2}') MB/s"
+}
+
+for jobs in 1 2 4; do
+    run $jobs write
+    run $jobs read
+    rm -f bench*
+done
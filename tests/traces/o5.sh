@@ -0,0 +1,48 @@
+#!/bin/bash
+set -e
+
+# 该测试点考察碎片整理：交替追加两个文件、在同一个目录中穿插创建和删除小文件，让文件和目录都产生碎片，
+# 再分别用 run 和 compact 整理（echo run > mnt/.defrag），每次整理后用 cmp 检查所有文件的内容没有变化
+
+cd mnt
+
+BLOCKS=256
+SMALL=320
+
+block() {
+    yes "$1 $2" | head -c 4096
+}
+
+expect() {
+    for ((i=0;i<BLOCKS;++i)); do
+        block "$1" $i
+    done
+}
+
+check() {
+    expect a | cmp - a
+    expect b | cmp - b
+    for ((i=1;i<SMALL;i+=2)); do
+        block d $i | cmp - d/$i
+    done
+    echo "$1 $(ls d | wc -l) ok"
+}
+
+for ((i=0;i<BLOCKS;++i)); do
+    block a $i >> a
+    block b $i >> b
+done
+
+mkdir d
+for ((i=0;i<SMALL;++i)); do
+    block d $i > d/$i
+done
+for ((i=0;i<SMALL;i+=2)); do
+    rm d/$i
+done
+
+check write
+echo run > .defrag
+check run
+echo compact > .defrag
+check compact
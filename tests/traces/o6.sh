@@ -0,0 +1,76 @@
+#!/bin/bash
+set -e
+
+# 该测试点考察快照：通过 mnt/.snapshot 创建快照（包括名字恰好 24 个字符的），之后修改、删除文件，
+# 用 FS_SNAPSHOT 只读重新挂载快照，检查其中的内容还是创建时的样子、不能写入，再正常挂载回来删除快照。
+# 生成标准答案时 mnt 只是普通目录，只输出和是否挂载无关的内容；快照的检查不通过时脚本出错退出
+
+LONG=snapshot-name-24-chars-x
+
+mounted=false
+mountpoint -q mnt && mounted=true
+
+# 重新挂载，给出快照的名字时只读挂载这个快照
+remount() {
+    cd ..
+    make -s umount > /dev/null 2>&1
+    while pgrep -x fuse > /dev/null; do
+        sleep 0.1
+    done
+    if [ -n "$1" ]; then
+        FS_SNAPSHOT=$1 make -s mount_noinit > /dev/null
+    else
+        make -s mount_noinit > /dev/null
+    fi
+    cd mnt
+}
+
+fails() {
+    if "$@" 2> /dev/null; then
+        echo "$* should fail" >&2
+        exit 1
+    fi
+}
+
+listed() {
+    grep -q "^$1 " .snapshot
+}
+
+cd mnt
+
+mkdir dir
+echo hello > dir/a
+seq 1 100000 > b
+echo "create s1" > .snapshot
+echo "create $LONG" > .snapshot
+if $mounted; then
+    listed s1
+    listed $LONG
+fi
+
+echo world >> dir/a
+rm b
+mkdir dir2
+cat dir/a
+ls
+
+if $mounted; then
+    remount s1
+    echo hello | cmp - dir/a
+    seq 1 100000 | cmp - b
+    [ ! -e dir2 ]
+    fails touch c
+    fails mkdir dir3
+    remount $LONG
+    echo hello | cmp - dir/a
+    remount
+fi
+
+echo "delete s1" > .snapshot
+echo "delete $LONG" > .snapshot
+if $mounted; then
+    fails listed s1
+    fails listed $LONG
+fi
+cat dir/a
+ls